@@ -0,0 +1,66 @@
+#!/usr/bin/env bash
+# test_stream_drop_oldest.sh
+# 慢客户端丢弃策略（drop-oldest）不得丢弃正在传输的文件流：
+# 接收方暂停读取，文件流积压在它的发送队列里，同时另一个客户端刷屏，
+# 让队列不断溢出；恢复后接收方收到的文件必须与原文件完全一致。
+# Usage:
+#   ./06_05_test_stream_drop_oldest.sh [TCP_SERVER] [TCP_CLIENT] [PORT]
+# Example:
+#   ./06_05_test_stream_drop_oldest.sh ./tcp_server/tcp_server ./tcp_server/tcp_client 5055
+
+SERVER_BIN=$(realpath "${1:-./tcp_server/tcp_server}")
+CLIENT_BIN=$(realpath "${2:-./tcp_server/tcp_client}")
+PORT=${3:-5055}
+
+WORK=$(mktemp -d)
+mkdir -p "$WORK/sender" "$WORK/receiver" "$WORK/spammer"
+head -c $((16 * 1024 * 1024)) /dev/urandom > "$WORK/sender/blob.bin"
+
+cleanup() {
+  kill -CONT $RECEIVER 2>/dev/null
+  kill $SERVER $RECEIVER $SENDER $SPAMMER 2>/dev/null
+  rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+# 队列上限远小于流控窗口（1 MiB），任何一条广播都会触发丢弃；
+# 用 epoll 后端，io_uring 下已提交给内核的消息本来就不会被丢弃
+"$SERVER_BIN" $PORT --backend epoll --max-queue-bytes 65536 --overflow-policy drop-oldest > "$WORK/server.log" 2>&1 &
+SERVER=$!
+sleep 0.5
+
+(cd "$WORK/receiver" && sleep 60 | "$CLIENT_BIN" 127.0.0.1 $PORT > client.log 2>&1) &
+RECEIVER_SHELL=$!
+sleep 0.5
+RECEIVER=$(pgrep -P $RECEIVER_SHELL -x "$(basename "$CLIENT_BIN")")
+kill -STOP $RECEIVER
+
+# 先刷屏塞满接收方的 socket 缓冲区，之后的文件流分片只能留在服务器的发送队列里，
+# 再继续刷屏让队列溢出
+PADDING=$(head -c 1000 /dev/zero | tr '\0' x)
+spam() {
+  for ((m=$1;m<=$2;m++)); do echo "/say spam $m $PADDING"; done
+}
+(cd "$WORK/spammer" && (spam 1 6000; sleep 3; spam 6001 8000; sleep 60) |
+  "$CLIENT_BIN" 127.0.0.1 $PORT > client.log 2>&1) &
+SPAMMER=$!
+sleep 2
+
+(cd "$WORK/sender" && (echo "/sendfile $WORK/sender/blob.bin"; sleep 60) | "$CLIENT_BIN" 127.0.0.1 $PORT > client.log 2>&1) &
+SENDER=$!
+sleep 4
+
+kill -CONT $RECEIVER
+for ((t=0;t<60;t++)); do
+  if grep -qE "\[STREAM\] (Received|Incomplete)" "$WORK/receiver/client.log"; then break; fi
+  sleep 1
+done
+RECEIVED=$(ls "$WORK"/receiver/received_*_blob.bin 2>/dev/null)
+
+if cmp -s "$WORK/sender/blob.bin" "$RECEIVED"; then
+  echo "PASS: file intact ($(stat -c %s "$RECEIVED") bytes) while broadcasts were dropped"
+  exit 0
+fi
+echo "FAIL: received file differs or is incomplete ($(stat -c %s "$RECEIVED" 2>/dev/null || echo 0) bytes)"
+tail -5 "$WORK/receiver/client.log"
+exit 1
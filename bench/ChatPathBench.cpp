@@ -0,0 +1,166 @@
+// Chat hot path allocation benchmark
+//
+// Drives the same per-message steps the servers run for a chat message --
+// decode, prefix with the cached timestamp, encode once into a pooled
+// buffer, queue a reference per recipient, write out and release -- and
+// counts every heap allocation made along the way. After warm-up the count
+// must be zero; the program exits non-zero otherwise.
+//
+// Build: g++ -O2 ChatPathBench.cpp -o chat_path_bench -pthread
+// Usage: ./chat_path_bench [messages] [recipients]
+
+#include "../tcp_server/TCPCommon.h"
+#include "../common/RingQueue.h"
+#include "../common/Timestamp.h"
+
+// Both protocols name their message types MSG_CHAT/MSG_STATS; keep the UDP
+// ones apart. Every header UDPCommon.h pulls in is already included above.
+namespace udp {
+#include "../udp_server/UDPCommon.h"
+}
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+static atomic<uint64_t> g_allocations(0);
+
+void* operator new(size_t size) {
+    g_allocations.fetch_add(1, memory_order_relaxed);
+    void* p = malloc(size == 0 ? 1 : size);
+    if (p == nullptr) throw bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+struct UdpOutgoing {
+    BufferRef packet;
+    sockaddr_in addr;
+};
+
+// Stand-in for the socket write: touch the bytes so nothing is optimized out
+static uint64_t g_sink = 0;
+
+static void consume(const BufferRef& buffer) {
+    g_sink += (uint8_t)buffer.data()[buffer.size() - 1] + buffer.size();
+}
+
+// Reactor side: one sender's frames in, one queue per recipient out
+static void run_tcp(TcpFrameDecoder& decoder, const string& wire, vector<RingQueue<TcpSharedBuffer>*>& queues,
+                    int messages) {
+    for (int i = 0; i < messages; i++) {
+        decoder.feed(wire.data(), wire.size());
+        TcpFrame frame;
+        while (decoder.next(frame) == 1) {
+            char prefix[64];
+            int prefix_length = snprintf(prefix, sizeof(prefix), "[%s] Client %d: ", cached_timestamp(), 7);
+            TcpSharedBuffer encoded[2];
+            for (int framed = 0; framed < 2; framed++) {
+                encoded[framed] = make_shared_message(framed, MSG_CHAT, 7, prefix, (uint32_t)prefix_length,
+                                                      frame.payload, frame.payload_length);
+            }
+            for (size_t q = 0; q < queues.size(); q++) {
+                queues[q]->push_back(encoded[q & 1]);
+            }
+        }
+        for (RingQueue<TcpSharedBuffer>* queue : queues) {
+            while (!queue->empty()) {
+                consume(queue->front());
+                queue->pop_front();
+            }
+        }
+    }
+}
+
+// UDP side: parse a datagram, build the prefixed broadcast, queue per peer
+static void run_udp(const vector<uint8_t>& datagram, RingQueue<UdpOutgoing>& outgoing,
+                    const vector<sockaddr_in>& peers, int messages) {
+    for (int i = 0; i < messages; i++) {
+        uint16_t type, flags;
+        uint32_t seq, clientId, plLen;
+        const uint8_t* payload;
+        if (!udp::parse_packet(datagram.data(), datagram.size(), type, flags, seq, clientId, payload, plLen)) abort();
+
+        outgoing.push_back(UdpOutgoing{udp::build_packet(udp::MSG_CHAT, udp::FLAG_ACK, seq, 7, nullptr, 0, nullptr, 0), peers[0]});
+
+        char prefix[64];
+        int prefixLen = snprintf(prefix, sizeof(prefix), "[%s] Client %u: ", cached_timestamp(), 7u);
+        BufferRef packet = udp::build_packet(udp::MSG_CHAT, 0, 0, 7, prefix, (uint32_t)prefixLen, payload, plLen);
+        for (size_t p = 1; p < peers.size(); p++) {
+            outgoing.push_back(UdpOutgoing{packet, peers[p]});
+        }
+        packet.reset();
+
+        while (!outgoing.empty()) {
+            consume(outgoing.front().packet);
+            outgoing.pop_front();
+        }
+    }
+}
+
+static double elapsed_ns(chrono::steady_clock::time_point start) {
+    return (double)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[]) {
+    int messages = argc > 1 ? atoi(argv[1]) : 1000000;
+    int recipients = argc > 2 ? atoi(argv[2]) : 16;
+    if (messages <= 0 || recipients <= 0) {
+        fprintf(stderr, "Usage: %s [messages] [recipients]\n", argv[0]);
+        return 1;
+    }
+    const int warmup = 1000;
+
+    // Two framed chat messages per read, as a busy client would send them
+    const char text[] = "the quick brown fox jumps over the lazy dog";
+    string wire;
+    for (int i = 0; i < 2; i++) {
+        encode_message(wire, true, MSG_CHAT, 0, text, sizeof(text) - 1);
+    }
+    TcpFrameDecoder decoder;
+    decoder.set_framed(true);
+    vector<RingQueue<TcpSharedBuffer>*> queues;
+    for (int i = 0; i < recipients; i++) queues.push_back(new RingQueue<TcpSharedBuffer>());
+
+    vector<uint8_t> datagram;
+    udp::build_packet(datagram, udp::MSG_CHAT, 0, 1, 7, reinterpret_cast<const uint8_t*>(text), sizeof(text) - 1);
+    vector<sockaddr_in> peers(recipients + 1);
+    for (size_t i = 0; i < peers.size(); i++) {
+        peers[i].sin_family = AF_INET;
+        peers[i].sin_port = htons((uint16_t)(40000 + i));
+        peers[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+    RingQueue<UdpOutgoing> outgoing;
+
+    // Warm-up fills the pool, the queues and the decoder buffer
+    run_tcp(decoder, wire, queues, warmup);
+    run_udp(datagram, outgoing, peers, warmup);
+
+    uint64_t before = g_allocations.load();
+    auto start = chrono::steady_clock::now();
+    run_tcp(decoder, wire, queues, messages / 2);
+    double tcp_ns = elapsed_ns(start);
+    uint64_t tcp_allocations = g_allocations.load() - before;
+
+    before = g_allocations.load();
+    start = chrono::steady_clock::now();
+    run_udp(datagram, outgoing, peers, messages);
+    double udp_ns = elapsed_ns(start);
+    uint64_t udp_allocations = g_allocations.load() - before;
+
+    int tcp_messages = (messages / 2) * 2;
+    printf("recipients per message: %d\n", recipients);
+    printf("tcp: %d messages, %.1f ns/message, %llu allocations (%.4f per message)\n",
+           tcp_messages, tcp_ns / tcp_messages, (unsigned long long)tcp_allocations,
+           (double)tcp_allocations / tcp_messages);
+    printf("udp: %d messages, %.1f ns/message, %llu allocations (%.4f per message)\n",
+           messages, udp_ns / messages, (unsigned long long)udp_allocations,
+           (double)udp_allocations / messages);
+    printf("pool buffers allocated: %llu (checksum %llu)\n",
+           (unsigned long long)MessagePool::instance().allocated(), (unsigned long long)g_sink);
+
+    for (RingQueue<TcpSharedBuffer>* queue : queues) delete queue;
+    return (tcp_allocations == 0 && udp_allocations == 0) ? 0 : 1;
+}
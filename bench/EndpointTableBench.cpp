@@ -0,0 +1,109 @@
+// UDP endpoint lookup benchmark
+//
+// Registers N clients under random IPv4 endpoints in a ClientRegistry, the
+// way the UDP server does on hello, then times with_endpoint() -- the
+// lookup every datagram goes through -- for registered endpoints (hits)
+// and unknown ones (misses) in random order, for N from 10 up to 1M. The
+// time per lookup should stay flat as N grows, apart from cache misses once
+// the table no longer fits in the caches. A linear scan over a vector of
+// endpoints, as the server once did per packet, is timed alongside up to
+// 10k endpoints for comparison.
+//
+// Build: g++ -O2 EndpointTableBench.cpp -o endpoint_table_bench -pthread
+// Usage: ./endpoint_table_bench [lookups per size] [max endpoints]
+
+#include "../common/ClientRegistry.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <unordered_set>
+
+static const size_t SCAN_MAX_ENDPOINTS = 10000;
+
+static double elapsed_ns(chrono::steady_clock::time_point start) {
+    return (double)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+}
+
+// Distinct random endpoints, none of them 0
+static vector<uint64_t> random_endpoints(size_t count, mt19937_64& rng) {
+    unordered_set<uint64_t> seen;
+    vector<uint64_t> endpoints;
+    endpoints.reserve(count);
+    while (endpoints.size() < count) {
+        uint64_t value = rng();
+        uint64_t endpoint = pack_endpoint((uint32_t)value, (uint16_t)(value >> 32));
+        if (endpoint != 0 && seen.insert(endpoint).second) endpoints.push_back(endpoint);
+    }
+    return endpoints;
+}
+
+// Time lookups of keys[order[i]]; returns ns per lookup and counts the hits
+static double time_lookups(ClientRegistry<uint32_t>& registry, const vector<uint64_t>& keys,
+                           const vector<uint32_t>& order, uint64_t& hits) {
+    uint64_t found = 0;
+    auto start = chrono::steady_clock::now();
+    for (uint32_t index : order) {
+        registry.with_endpoint(keys[index], [&](uint32_t& id) { found += id; });
+    }
+    double ns = elapsed_ns(start) / order.size();
+    hits = found;
+    return ns;
+}
+
+int main(int argc, char* argv[]) {
+    size_t lookups = argc > 1 ? strtoul(argv[1], NULL, 10) : 2000000;
+    size_t max_endpoints = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+    if (lookups == 0 || max_endpoints < 10) {
+        fprintf(stderr, "Usage: %s [lookups per size] [max endpoints]\n", argv[0]);
+        return 1;
+    }
+
+    mt19937_64 rng(42);
+    printf("%10s %12s %12s %12s %12s\n", "endpoints", "insert ns", "hit ns", "miss ns", "scan ns");
+    uint64_t checksum = 0;
+    for (size_t count = 10; count <= max_endpoints; count *= 10) {
+        vector<uint64_t> registered = random_endpoints(count * 2, rng);
+        vector<uint64_t> unknown(registered.begin() + count, registered.end());
+        registered.resize(count);
+
+        ClientRegistry<uint32_t> registry;
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < count; i++) {
+            if (!registry.insert((uint32_t)i + 1, registered[i], (uint32_t)i + 1)) abort();
+        }
+        double insert_ns = elapsed_ns(start) / count;
+
+        vector<uint32_t> order(lookups);
+        for (uint32_t& index : order) index = (uint32_t)(rng() % count);
+
+        uint64_t hits = 0, misses = 0;
+        time_lookups(registry, registered, order, hits); // warm-up
+        double hit_ns = time_lookups(registry, registered, order, hits);
+        double miss_ns = time_lookups(registry, unknown, order, misses);
+        if (misses != 0) abort();
+        checksum += hits;
+
+        char scan[32] = "-";
+        if (count <= SCAN_MAX_ENDPOINTS) {
+            size_t scans = min(lookups, (size_t)200000000 / count);
+            uint64_t found = 0;
+            start = chrono::steady_clock::now();
+            for (size_t i = 0; i < scans; i++) {
+                uint64_t key = registered[order[i]];
+                for (size_t j = 0; j < count; j++) {
+                    if (registered[j] == key) {
+                        found += j;
+                        break;
+                    }
+                }
+            }
+            snprintf(scan, sizeof(scan), "%.1f", elapsed_ns(start) / scans);
+            checksum += found;
+        }
+        printf("%10zu %12.1f %12.1f %12.1f %12s\n", count, insert_ns, hit_ns, miss_ns, scan);
+    }
+    printf("checksum %llu\n", (unsigned long long)checksum);
+    return 0;
+}
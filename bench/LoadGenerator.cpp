@@ -0,0 +1,622 @@
+// Load generator and latency benchmark for the TCP and UDP chat servers
+//
+// Opens thousands of client connections spread over a few worker threads,
+// each running one epoll loop. A configurable subset of clients send chat
+// messages at a fixed rate; every client records the broadcasts it receives.
+// Each payload carries "lg <sender> <seq> <send time>", so a receiver can
+// compute end-to-end latency and detect loss and duplicates per sender.
+//
+// Build: g++ -O2 LoadGenerator.cpp -o load_generator -pthread
+// Usage: ./load_generator --proto tcp|udp [--host IP] [--port N] [--clients N]
+//          [--senders N] [--rate MSGS_PER_SEC] [--payload BYTES] [--duration SEC]
+//          [--drain SEC] [--threads N] [--framed] [--json FILE]
+
+#include "../tcp_server/TCPCommon.h"
+
+// Both protocols name their message types MSG_CHAT/MSG_STATS; keep the UDP
+// ones apart. Every header UDPCommon.h pulls in is already included above.
+namespace udp {
+#include "../udp_server/UDPCommon.h"
+}
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netinet/tcp.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cinttypes>
+
+using namespace std;
+
+static const int LG_MAX_EVENTS = 256;
+static const uint32_t LG_WINDOW_BITS = 256; // per-sender reorder window for duplicate detection
+
+struct LoadConfig {
+    bool tcp;
+    string host;
+    int port;
+    int clients;
+    int senders;         // the first `senders` clients send, all clients receive
+    double rate;         // messages per second per sender
+    int payload;         // payload bytes per chat message (before the server prefix)
+    double duration;     // seconds of sending
+    double drain;        // seconds to keep receiving after the last send
+    int threads;
+    bool framed;         // TCP only: negotiate the framed protocol
+    string json_path;    // empty = stdout
+
+    LoadConfig()
+        : tcp(true), host("127.0.0.1"), port(0), clients(100), senders(10), rate(10), payload(64),
+          duration(10), drain(2), threads(4), framed(false) {}
+};
+
+static LoadConfig g_config;
+
+static uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Log-linear histogram in the style of HdrHistogram: 1024 linear
+// sub-buckets per power of two, i.e. about three significant digits, for
+// values up to 2^40 ns. Recording is a shift and an increment.
+class LatencyHistogram {
+public:
+    static const int SUB_BITS = 10;
+    static const int MAX_EXPONENT = 40 - SUB_BITS;
+    static const size_t BUCKETS = (size_t)(MAX_EXPONENT + 2) << SUB_BITS;
+
+    LatencyHistogram() : counts_(BUCKETS, 0), total_(0), max_(0), sum_(0) {}
+
+    void record(uint64_t value) {
+        if (value >= (1ULL << 40)) value = (1ULL << 40) - 1;
+        counts_[index_of(value)]++;
+        total_++;
+        sum_ += value;
+        if (value > max_) max_ = value;
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < BUCKETS; i++) counts_[i] += other.counts_[i];
+        total_ += other.total_;
+        sum_ += other.sum_;
+        if (other.max_ > max_) max_ = other.max_;
+    }
+
+    uint64_t count() const { return total_; }
+    uint64_t max() const { return max_; }
+    double mean() const { return total_ == 0 ? 0 : (double)sum_ / total_; }
+
+    // Highest value equivalent to the bucket holding the given percentile
+    uint64_t percentile(double pct) const {
+        if (total_ == 0) return 0;
+        uint64_t rank = (uint64_t)(pct / 100.0 * total_ + 0.5);
+        if (rank < 1) rank = 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; i++) {
+            seen += counts_[i];
+            if (seen >= rank) return min(highest_equivalent(i), max_);
+        }
+        return max_;
+    }
+
+private:
+    static size_t index_of(uint64_t value) {
+        int exponent = 63 - __builtin_clzll(value | 1) - SUB_BITS;
+        if (exponent < 0) exponent = 0;
+        return ((size_t)exponent << SUB_BITS) + (size_t)(value >> exponent);
+    }
+
+    static uint64_t highest_equivalent(size_t index) {
+        int exponent = (index < (2u << SUB_BITS)) ? 0 : (int)(index >> SUB_BITS) - 1;
+        uint64_t sub = index - ((size_t)exponent << SUB_BITS);
+        return ((sub + 1) << exponent) - 1;
+    }
+
+    vector<uint64_t> counts_;
+    uint64_t total_;
+    uint64_t max_;
+    uint64_t sum_;
+};
+
+// Sequence numbers seen from one sender by one receiver: the highest seq
+// and a bitmap of the LG_WINDOW_BITS below it
+struct SeenWindow {
+    int64_t highest;
+    uint64_t bits[LG_WINDOW_BITS / 64];
+
+    SeenWindow() : highest(-1) { memset(bits, 0, sizeof(bits)); }
+
+    // Returns false for a duplicate (or a seq too old to tell)
+    bool mark(uint64_t seq) {
+        if ((int64_t)seq > highest) {
+            uint64_t shift = (highest < 0) ? LG_WINDOW_BITS : seq - highest;
+            if (shift >= LG_WINDOW_BITS) {
+                memset(bits, 0, sizeof(bits));
+            } else {
+                for (uint64_t s = highest + 1; s <= seq; s++) clear_bit(s);
+            }
+            highest = (int64_t)seq;
+            set_bit(seq);
+            return true;
+        }
+        if (highest - (int64_t)seq >= (int64_t)LG_WINDOW_BITS) return false;
+        if (test_bit(seq)) return false;
+        set_bit(seq);
+        return true;
+    }
+
+private:
+    void set_bit(uint64_t seq) { bits[(seq / 64) % (LG_WINDOW_BITS / 64)] |= 1ULL << (seq % 64); }
+    void clear_bit(uint64_t seq) { bits[(seq / 64) % (LG_WINDOW_BITS / 64)] &= ~(1ULL << (seq % 64)); }
+    bool test_bit(uint64_t seq) const { return bits[(seq / 64) % (LG_WINDOW_BITS / 64)] & (1ULL << (seq % 64)); }
+};
+
+struct LoadClient {
+    int index;
+    int fd;
+    bool sender;
+    uint64_t next_send_ns;
+    uint64_t seq;
+    TcpFrameDecoder decoder;  // TCP only
+    string pending;           // TCP only: bytes not yet accepted by the socket
+    bool want_write;
+    vector<SeenWindow> seen;  // indexed by sender
+
+    LoadClient() : index(0), fd(-1), sender(false), next_send_ns(0), seq(0), want_write(false) {}
+};
+
+struct WorkerStats {
+    uint64_t sent;
+    uint64_t send_errors;
+    uint64_t received;     // chat deliveries carrying a load generator payload
+    uint64_t duplicates;
+    uint64_t connect_failures;
+    uint64_t disconnects;
+    LatencyHistogram latency;
+
+    WorkerStats() : sent(0), send_errors(0), received(0), duplicates(0), connect_failures(0), disconnects(0) {}
+};
+
+struct Worker {
+    int index;
+    pthread_t thread_id;
+    int epoll_fd;
+    vector<LoadClient*> clients;
+    WorkerStats stats;
+};
+
+// Start barrier: workers connect their clients, then wait for the start time
+static atomic<int> g_ready(0);
+static atomic<uint64_t> g_start_ns(0);
+static vector<uint64_t> g_sent_by_sender; // written by the owning worker before it exits
+
+static sockaddr_in server_address() {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(g_config.port);
+    inet_pton(AF_INET, g_config.host.c_str(), &addr.sin_addr);
+    return addr;
+}
+
+static void set_nonblocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+// Blocking connect plus optional framing negotiation, like TCPClient does
+static bool connect_tcp(LoadClient* client) {
+    sockaddr_in addr = server_address();
+    client->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (client->fd < 0) return false;
+    if (connect(client->fd, (sockaddr*)&addr, sizeof(addr)) < 0) return false;
+    int one = 1;
+    setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (g_config.framed) {
+        string hello;
+        encode_message(hello, false, MSG_HELLO, 0, TCP_FRAMED_HELLO, sizeof(TCP_FRAMED_HELLO) - 1);
+        if (send(client->fd, hello.data(), hello.size(), MSG_NOSIGNAL) != (ssize_t)hello.size()) return false;
+
+        timeval timeout = {1, 0};
+        setsockopt(client->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        char reply[sizeof(TcpMessage)];
+        size_t got = 0;
+        while (got < sizeof(reply)) {
+            ssize_t n = recv(client->fd, reply + got, sizeof(reply) - got, 0);
+            if (n <= 0) return false;
+            got += n;
+        }
+        const TcpMessage* msg = reinterpret_cast<const TcpMessage*>(reply);
+        if (msg->type != MSG_HELLO) return false;
+        client->decoder.set_framed(true);
+    }
+    set_nonblocking(client->fd);
+    return true;
+}
+
+// Register with a "hello" and wait for its ACK, retrying a few times
+static bool connect_udp(LoadClient* client) {
+    sockaddr_in addr = server_address();
+    client->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (client->fd < 0) return false;
+    if (connect(client->fd, (sockaddr*)&addr, sizeof(addr)) < 0) return false;
+
+    timeval timeout = {0, 200000};
+    setsockopt(client->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    vector<uint8_t> hello;
+    udp::build_packet(hello, udp::MSG_CHAT, 0, 0, 0, reinterpret_cast<const uint8_t*>("hello"), 5);
+    for (int attempt = 0; attempt < 5; attempt++) {
+        if (send(client->fd, hello.data(), hello.size(), 0) < 0) return false;
+        uint8_t buffer[2048];
+        while (true) {
+            ssize_t n = recv(client->fd, buffer, sizeof(buffer), 0);
+            if (n < 0) break;
+            uint16_t type, flags;
+            uint32_t seq, client_id, length;
+            const uint8_t* payload;
+            if (udp::parse_packet(buffer, n, type, flags, seq, client_id, payload, length) &&
+                (flags & udp::FLAG_ACK) && seq == 0) {
+                set_nonblocking(client->fd);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// "lg <sender> <seq> <send ns>" padded with 'x' to the configured size
+static size_t build_payload(char* out, size_t capacity, const LoadClient* client, uint64_t send_ns) {
+    int len = snprintf(out, capacity, "lg %d %" PRIu64 " %" PRIu64 " ", client->index, client->seq, send_ns);
+    size_t size = max<size_t>(len, min<size_t>(g_config.payload, capacity - 1));
+    memset(out + len, 'x', size - len);
+    return size;
+}
+
+static void update_events(Worker* worker, LoadClient* client) {
+    epoll_event ev{};
+    ev.events = EPOLLIN | (client->want_write ? (uint32_t)EPOLLOUT : 0u);
+    ev.data.ptr = client;
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, client->fd, &ev);
+}
+
+static void flush_tcp(Worker* worker, LoadClient* client) {
+    while (!client->pending.empty()) {
+        ssize_t n = send(client->fd, client->pending.data(), client->pending.size(), MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                worker->stats.send_errors++;
+                client->pending.clear();
+            }
+            break;
+        }
+        client->pending.erase(0, n);
+    }
+    bool want_write = !client->pending.empty();
+    if (want_write != client->want_write) {
+        client->want_write = want_write;
+        update_events(worker, client);
+    }
+}
+
+static void send_chat(Worker* worker, LoadClient* client, uint64_t send_ns) {
+    char payload[65536];
+    size_t length = build_payload(payload, g_config.tcp ? TCP_MAX_FRAME_PAYLOAD : udp::UDP_MAX_PAYLOAD,
+                                  client, send_ns);
+
+    if (g_config.tcp) {
+        encode_message(client->pending, client->decoder.framed(), MSG_CHAT, 0, payload, (uint32_t)length);
+        flush_tcp(worker, client);
+    } else {
+        vector<uint8_t> packet;
+        udp::build_packet(packet, udp::MSG_CHAT, 0, (uint32_t)client->seq + 1, 0,
+                          reinterpret_cast<const uint8_t*>(payload), (uint32_t)length);
+        if (send(client->fd, packet.data(), packet.size(), 0) < 0) {
+            worker->stats.send_errors++;
+        }
+    }
+    client->seq++;
+    worker->stats.sent++;
+}
+
+// Account one received chat payload; anything not from us is ignored
+static void on_chat(Worker* worker, LoadClient* client, const char* payload, size_t length, uint64_t now) {
+    const char* mark = static_cast<const char*>(memmem(payload, length, "lg ", 3));
+    if (mark == nullptr) return;
+
+    char text[96];
+    size_t copy = min<size_t>(sizeof(text) - 1, length - (mark - payload));
+    memcpy(text, mark, copy);
+    text[copy] = '\0';
+
+    int sender;
+    uint64_t seq, send_ns;
+    if (sscanf(text, "lg %d %" SCNu64 " %" SCNu64, &sender, &seq, &send_ns) != 3) return;
+    if (sender < 0 || sender >= g_config.senders) return;
+
+    if (!client->seen[sender].mark(seq)) {
+        worker->stats.duplicates++;
+        return;
+    }
+    worker->stats.received++;
+    if (now > send_ns) worker->stats.latency.record(now - send_ns);
+}
+
+static void read_tcp(Worker* worker, LoadClient* client, uint64_t now) {
+    char buffer[16384];
+    while (true) {
+        ssize_t n = recv(client->fd, buffer, sizeof(buffer), 0);
+        if (n > 0) {
+            client->decoder.feed(buffer, n);
+            TcpFrame frame;
+            int result;
+            while ((result = client->decoder.next(frame)) == 1) {
+                if (frame.type == MSG_CHAT) on_chat(worker, client, frame.payload, frame.payload_length, now);
+            }
+            if (result < 0) n = 0; // corrupt stream, drop the connection
+            else continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+        worker->stats.disconnects++;
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+        close(client->fd);
+        client->fd = -1;
+        return;
+    }
+}
+
+static void read_udp(Worker* worker, LoadClient* client, uint64_t now) {
+    uint8_t buffer[4096];
+    while (true) {
+        ssize_t n = recv(client->fd, buffer, sizeof(buffer), 0);
+        if (n < 0) return;
+        uint16_t type, flags;
+        uint32_t seq, client_id, length;
+        const uint8_t* payload;
+        if (!udp::parse_packet(buffer, n, type, flags, seq, client_id, payload, length)) continue;
+        if (type == udp::MSG_PING) {
+            // Receive-only clients would otherwise look idle to the server
+            vector<uint8_t> pong;
+            udp::build_packet(pong, udp::MSG_PING, 0, 0, 0, nullptr, 0);
+            send(client->fd, pong.data(), pong.size(), 0);
+            continue;
+        }
+        if (type != udp::MSG_CHAT || (flags & udp::FLAG_ACK)) continue;
+        on_chat(worker, client, reinterpret_cast<const char*>(payload), length, now);
+    }
+}
+
+static void* run_worker(void* arg) {
+    Worker* worker = static_cast<Worker*>(arg);
+    worker->epoll_fd = epoll_create1(0);
+
+    for (LoadClient* client : worker->clients) {
+        bool ok = g_config.tcp ? connect_tcp(client) : connect_udp(client);
+        if (!ok) {
+            worker->stats.connect_failures++;
+            if (client->fd >= 0) close(client->fd);
+            client->fd = -1;
+            continue;
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.ptr = client;
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, client->fd, &ev);
+    }
+    g_ready++;
+
+    uint64_t start;
+    while ((start = g_start_ns.load()) == 0) usleep(1000);
+
+    uint64_t interval = (uint64_t)(1e9 / g_config.rate);
+    uint64_t send_end = start + (uint64_t)(g_config.duration * 1e9);
+    uint64_t stop = send_end + (uint64_t)(g_config.drain * 1e9);
+    for (LoadClient* client : worker->clients) {
+        // Spread senders over the first interval so they don't fire in lockstep
+        client->next_send_ns = start + (interval * (uint64_t)client->index) / max(1, g_config.senders);
+    }
+
+    epoll_event events[LG_MAX_EVENTS];
+    while (true) {
+        uint64_t now = now_ns();
+        if (now >= stop) break;
+
+        uint64_t next_due = stop;
+        if (now < send_end) {
+            for (LoadClient* client : worker->clients) {
+                if (!client->sender || client->fd < 0) continue;
+                while (client->next_send_ns <= now && client->next_send_ns < send_end) {
+                    send_chat(worker, client, now);
+                    client->next_send_ns += interval;
+                }
+                next_due = min(next_due, client->next_send_ns);
+            }
+        }
+
+        int timeout_ms = (int)((min(next_due, stop) - now) / 1000000);
+        int n = epoll_wait(worker->epoll_fd, events, LG_MAX_EVENTS, timeout_ms);
+        now = now_ns();
+        for (int i = 0; i < n; i++) {
+            LoadClient* client = static_cast<LoadClient*>(events[i].data.ptr);
+            if (client->fd < 0) continue;
+            if (events[i].events & EPOLLOUT) flush_tcp(worker, client);
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                if (g_config.tcp) read_tcp(worker, client, now);
+                else read_udp(worker, client, now);
+            }
+        }
+    }
+
+    for (LoadClient* client : worker->clients) {
+        if (client->sender) g_sent_by_sender[client->index] = client->seq;
+        if (client->fd >= 0) close(client->fd);
+    }
+    close(worker->epoll_fd);
+    return nullptr;
+}
+
+static void print_usage(const char* prog) {
+    cerr << "Usage: " << prog << " --proto tcp|udp [--host IP] [--port N] [--clients N]" << endl
+         << "       [--senders N] [--rate MSGS_PER_SEC] [--payload BYTES] [--duration SEC]" << endl
+         << "       [--drain SEC] [--threads N] [--framed] [--json FILE]" << endl;
+}
+
+static void raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    bool proto_given = false;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--proto" && has_value) {
+            string proto = argv[++i];
+            if (proto != "tcp" && proto != "udp") {
+                print_usage(argv[0]);
+                return 1;
+            }
+            g_config.tcp = (proto == "tcp");
+            proto_given = true;
+        } else if (arg == "--host" && has_value) {
+            g_config.host = argv[++i];
+        } else if (arg == "--port" && has_value) {
+            g_config.port = atoi(argv[++i]);
+        } else if (arg == "--clients" && has_value) {
+            g_config.clients = atoi(argv[++i]);
+        } else if (arg == "--senders" && has_value) {
+            g_config.senders = atoi(argv[++i]);
+        } else if (arg == "--rate" && has_value) {
+            g_config.rate = atof(argv[++i]);
+        } else if (arg == "--payload" && has_value) {
+            g_config.payload = atoi(argv[++i]);
+        } else if (arg == "--duration" && has_value) {
+            g_config.duration = atof(argv[++i]);
+        } else if (arg == "--drain" && has_value) {
+            g_config.drain = atof(argv[++i]);
+        } else if (arg == "--threads" && has_value) {
+            g_config.threads = atoi(argv[++i]);
+        } else if (arg == "--framed") {
+            g_config.framed = true;
+        } else if (arg == "--json" && has_value) {
+            g_config.json_path = argv[++i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!proto_given || g_config.clients <= 0 || g_config.senders <= 0 || g_config.rate <= 0 ||
+        g_config.threads <= 0 || g_config.duration <= 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (g_config.port == 0) g_config.port = g_config.tcp ? 5000 : 5001;
+    g_config.senders = min(g_config.senders, g_config.clients);
+    g_config.threads = min(g_config.threads, g_config.clients);
+
+    raise_fd_limit();
+    g_sent_by_sender.assign(g_config.senders, 0);
+
+    vector<Worker*> workers;
+    for (int i = 0; i < g_config.threads; i++) {
+        workers.push_back(new Worker());
+        workers.back()->index = i;
+    }
+    vector<LoadClient*> clients;
+    for (int i = 0; i < g_config.clients; i++) {
+        LoadClient* client = new LoadClient();
+        client->index = i;
+        client->sender = i < g_config.senders;
+        client->seen.resize(g_config.senders);
+        clients.push_back(client);
+        workers[i % g_config.threads]->clients.push_back(client);
+    }
+
+    for (Worker* worker : workers) pthread_create(&worker->thread_id, NULL, run_worker, worker);
+    while (g_ready.load() < g_config.threads) usleep(1000);
+
+    // Give the server a moment to register the last connections
+    usleep(500000);
+    g_start_ns.store(now_ns());
+    for (Worker* worker : workers) pthread_join(worker->thread_id, NULL);
+
+    WorkerStats total;
+    for (Worker* worker : workers) {
+        total.sent += worker->stats.sent;
+        total.send_errors += worker->stats.send_errors;
+        total.received += worker->stats.received;
+        total.duplicates += worker->stats.duplicates;
+        total.connect_failures += worker->stats.connect_failures;
+        total.disconnects += worker->stats.disconnects;
+        total.latency.merge(worker->stats.latency);
+    }
+
+    // Every message should reach every connected client except its sender
+    uint64_t connected = g_config.clients - total.connect_failures;
+    uint64_t expected = 0;
+    for (int i = 0; i < g_config.senders; i++) {
+        expected += g_sent_by_sender[i] * (connected - 1);
+    }
+    uint64_t lost = expected > total.received ? expected - total.received : 0;
+    double loss_rate = expected == 0 ? 0 : (double)lost / expected;
+    double dup_rate = total.received == 0 ? 0 : (double)total.duplicates / total.received;
+
+    char json[2048];
+    snprintf(json, sizeof(json),
+             "{\n"
+             "  \"protocol\": \"%s\",\n"
+             "  \"framed\": %s,\n"
+             "  \"clients\": %d,\n"
+             "  \"senders\": %d,\n"
+             "  \"rate_per_sender\": %.3f,\n"
+             "  \"payload_bytes\": %d,\n"
+             "  \"duration_s\": %.3f,\n"
+             "  \"threads\": %d,\n"
+             "  \"connect_failures\": %" PRIu64 ",\n"
+             "  \"disconnects\": %" PRIu64 ",\n"
+             "  \"sent\": %" PRIu64 ",\n"
+             "  \"send_errors\": %" PRIu64 ",\n"
+             "  \"send_throughput_msgs\": %.1f,\n"
+             "  \"expected_deliveries\": %" PRIu64 ",\n"
+             "  \"received\": %" PRIu64 ",\n"
+             "  \"delivery_throughput_msgs\": %.1f,\n"
+             "  \"lost\": %" PRIu64 ",\n"
+             "  \"loss_rate\": %.6f,\n"
+             "  \"duplicates\": %" PRIu64 ",\n"
+             "  \"duplicate_rate\": %.6f,\n"
+             "  \"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p99_9\": %.1f, \"max\": %.1f, \"mean\": %.1f}\n"
+             "}\n",
+             g_config.tcp ? "tcp" : "udp", g_config.framed ? "true" : "false", g_config.clients,
+             g_config.senders, g_config.rate, g_config.payload, g_config.duration, g_config.threads,
+             total.connect_failures, total.disconnects, total.sent, total.send_errors,
+             total.sent / g_config.duration, expected, total.received, total.received / g_config.duration,
+             lost, loss_rate, total.duplicates, dup_rate,
+             total.latency.percentile(50) / 1000.0, total.latency.percentile(99) / 1000.0,
+             total.latency.percentile(99.9) / 1000.0, total.latency.max() / 1000.0,
+             total.latency.mean() / 1000.0);
+
+    if (g_config.json_path.empty()) {
+        fputs(json, stdout);
+    } else {
+        FILE* out = fopen(g_config.json_path.c_str(), "w");
+        if (out == nullptr) {
+            cerr << "Cannot write " << g_config.json_path << endl;
+            return 1;
+        }
+        fputs(json, out);
+        fclose(out);
+    }
+
+    for (LoadClient* client : clients) delete client;
+    for (Worker* worker : workers) delete worker;
+    return 0;
+}
@@ -0,0 +1,79 @@
+#!/usr/bin/env bash
+# compare_tcp_backends.sh
+# Runs the same loopback load against the original thread-per-client TCP
+# server (built from the repository's first commit), the epoll reactor and
+# the io_uring reactor, and prints the results side by side.
+# Usage:
+#   ./compare_tcp_backends.sh [CLIENTS] [SENDERS] [RATE] [DURATION] [SHARDS]
+# Example:
+#   ./compare_tcp_backends.sh 200 20 50 5 1
+
+CLIENTS=${1:-200}
+SENDERS=${2:-20}
+RATE=${3:-50}       # messages per second per sender
+DURATION=${4:-5}    # seconds
+SHARDS=${5:-1}      # reactor threads for epoll/io_uring
+PORT=${PORT:-5600}
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# The thread-per-client server as it was before the reactor rewrite
+BASELINE=$(git -C "$ROOT" rev-list --max-parents=0 HEAD)
+mkdir -p "$WORK/baseline"
+git -C "$ROOT" show "$BASELINE:tcp_server/TCPServer.cpp" > "$WORK/baseline/TCPServer.cpp" || exit 1
+git -C "$ROOT" show "$BASELINE:tcp_server/TCPCommon.h" > "$WORK/baseline/TCPCommon.h" || exit 1
+
+echo "Building..."
+g++ -O2 "$WORK/baseline/TCPServer.cpp" -o "$WORK/thread_server" -pthread || exit 1
+g++ -O2 "$ROOT/tcp_server/TCPServer.cpp" -o "$WORK/tcp_server" -pthread || exit 1
+g++ -O2 "$ROOT/bench/LoadGenerator.cpp" -o "$WORK/load_generator" -pthread || exit 1
+
+# Legacy fixed-size MSG_STATS request (type 2); prints the reply text
+query_stats() {
+  { exec 3<>"/dev/tcp/127.0.0.1/$1"; } 2> /dev/null || return
+  { printf '\x02\x00\x00\x00'; head -c 1032 /dev/zero; } >&3
+  timeout 1 cat <&3 | tr -d '\000'
+  exec 3<&-
+}
+
+json_field() {
+  grep -o "\"$2\": *[0-9.]*" "$1" | head -1 | sed 's/.*: *//'
+}
+
+run_one() {
+  local name=$1
+  shift
+  "$@" > "$WORK/$name.server.log" 2>&1 &
+  local pid=$!
+  sleep 0.5
+
+  "$WORK/load_generator" --proto tcp --port "$PORT" --clients "$CLIENTS" --senders "$SENDERS" \
+    --rate "$RATE" --duration "$DURATION" --json "$WORK/$name.json" > /dev/null
+  local stats
+  stats=$(query_stats "$PORT")
+  kill "$pid" 2> /dev/null
+  wait "$pid" 2> /dev/null
+
+  local syscalls broadcasts per_broadcast="-"
+  syscalls=$(echo "$stats" | grep -o 'send syscalls: [0-9]*' | grep -o '[0-9]*$')
+  broadcasts=$(echo "$stats" | grep -o 'Broadcasts: [0-9]*' | grep -o '[0-9]*$')
+  if [ -n "$syscalls" ] && [ "${broadcasts:-0}" -gt 0 ]; then
+    per_broadcast=$(awk -v s="$syscalls" -v b="$broadcasts" 'BEGIN { printf "%.3f", s / b }')
+  elif [ "$name" = "thread" ]; then
+    per_broadcast="~$((CLIENTS - 1))"   # one send() per recipient
+  fi
+
+  local f="$WORK/$name.json"
+  printf "%-8s %12s %10s %10s %10s %10s %14s\n" "$name" "$(json_field "$f" delivery_throughput_msgs)" \
+    "$(json_field "$f" lost)" "$(json_field "$f" p50)" "$(json_field "$f" p99)" "$(json_field "$f" p99_9)" \
+    "$per_broadcast"
+  PORT=$((PORT + 1))
+}
+
+echo "$CLIENTS clients, $SENDERS senders x $RATE msg/s, ${DURATION}s on loopback, $SHARDS shard(s)"
+printf "%-8s %12s %10s %10s %10s %10s %14s\n" backend "deliveries/s" lost "p50 us" "p99 us" "p99.9 us" "sends/bcast"
+run_one thread "$WORK/thread_server" "$PORT"
+run_one epoll "$WORK/tcp_server" "$PORT" --shards "$SHARDS" --backend epoll
+run_one uring "$WORK/tcp_server" "$PORT" --shards "$SHARDS" --backend uring
@@ -0,0 +1,392 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "EpochReclaimer.h"
+
+using namespace std;
+
+// Pack an IPv4 address and port (both in network order, as stored in
+// sockaddr_in) into a registry endpoint key. Never 0 for a real peer.
+inline uint64_t pack_endpoint(uint32_t addr_net, uint16_t port_net) {
+    return ((uint64_t)addr_net << 16) | port_net;
+}
+
+inline uint64_t pack_endpoint(const sockaddr_in& addr) {
+    return pack_endpoint(addr.sin_addr.s_addr, addr.sin_port);
+}
+
+inline sockaddr_in unpack_endpoint(uint64_t endpoint) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = (uint32_t)(endpoint >> 16);
+    addr.sin_port = (uint16_t)endpoint;
+    return addr;
+}
+
+// Client table shared by the TCP and UDP servers, keyed by client id and by
+// endpoint.
+//
+// Writers (register/unregister, rare) serialize on a mutex. Readers (lookup
+// per packet, iteration per broadcast) never lock: they run inside an
+// EpochGuard and see entries through atomically published pointers. Erased
+// entries and replaced tables are retired to the EpochReclaimer, so a reader
+// can keep using anything it found until its guard ends.
+//
+// Insert, lookup and erase are O(1): two open-addressing indexes map keys to
+// entries, and a slot array with a free list holds the entries for iteration.
+// The indexes keep a tag byte per cell in a control word per group of 8
+// cells, so a probe checks 8 cells with a few word operations and follows
+// an entry pointer only where the tag matches; insert finds out whether the
+// key is present and where it goes in the same probe.
+template <typename T>
+class ClientRegistry {
+public:
+    ClientRegistry() : count_(0) {
+        pthread_mutex_init(&write_mutex_, NULL);
+        ids_.store(new Index(16));
+        endpoints_.store(new Index(16));
+        slots_.store(new SlotArray(16));
+    }
+
+    ~ClientRegistry() {
+        SlotArray* slots = slots_.load();
+        size_t used = slots->used.load();
+        for (size_t i = 0; i < used; i++) {
+            delete slots->slots[i].load();
+        }
+        delete slots;
+        delete ids_.load();
+        delete endpoints_.load();
+        pthread_mutex_destroy(&write_mutex_);
+    }
+
+    ClientRegistry(const ClientRegistry&) = delete;
+    ClientRegistry& operator=(const ClientRegistry&) = delete;
+
+    // Returns false if the id or the endpoint is already registered.
+    // Pass endpoint 0 for clients that are only addressed by id.
+    bool insert(uint32_t id, uint64_t endpoint, const T& value) {
+        pthread_mutex_lock(&write_mutex_);
+        reserve(ids_);
+        if (endpoint != 0) reserve(endpoints_);
+        Position by_id, by_endpoint;
+        if (!locate(ids_, ids_.load(memory_order_relaxed), id, by_id) ||
+            (endpoint != 0 && !locate(endpoints_, endpoints_.load(memory_order_relaxed), endpoint, by_endpoint))) {
+            pthread_mutex_unlock(&write_mutex_);
+            return false;
+        }
+
+        Entry* entry = new Entry{id, endpoint, 0, value};
+        entry->slot = take_slot();
+        slots_.load(memory_order_relaxed)->slots[entry->slot].store(entry, memory_order_release);
+        publish(ids_, by_id, id, entry);
+        if (endpoint != 0) publish(endpoints_, by_endpoint, endpoint, entry);
+        count_.fetch_add(1, memory_order_relaxed);
+
+        pthread_mutex_unlock(&write_mutex_);
+        return true;
+    }
+
+    bool erase(uint32_t id) {
+        pthread_mutex_lock(&write_mutex_);
+        Entry* entry = find(ids_, id);
+        if (entry == nullptr) {
+            pthread_mutex_unlock(&write_mutex_);
+            return false;
+        }
+
+        index_erase(ids_, id);
+        if (entry->endpoint != 0) index_erase(endpoints_, entry->endpoint);
+        slots_.load(memory_order_relaxed)->slots[entry->slot].store(nullptr, memory_order_release);
+        free_slots_.push_back(entry->slot);
+        count_.fetch_sub(1, memory_order_relaxed);
+        pthread_mutex_unlock(&write_mutex_);
+
+        EpochReclaimer::instance().retire(entry);
+        return true;
+    }
+
+    // Run f(T&) on the client with this id. Returns false if there is none.
+    template <typename F>
+    bool with_id(uint32_t id, F f) {
+        EpochGuard guard;
+        Entry* entry = find(ids_, id);
+        if (entry == nullptr) return false;
+        f(entry->value);
+        return true;
+    }
+
+    template <typename F>
+    bool with_endpoint(uint64_t endpoint, F f) {
+        EpochGuard guard;
+        Entry* entry = find(endpoints_, endpoint);
+        if (entry == nullptr) return false;
+        f(entry->value);
+        return true;
+    }
+
+    // Run f(T&) on every registered client without blocking writers.
+    // Clients added or removed during the walk may or may not be visited.
+    template <typename F>
+    void for_each(F f) {
+        for_each_in(0, SIZE_MAX, f);
+    }
+
+    // As for_each(), restricted to slots [begin, end), so a walk can be
+    // split into independent pieces of up to slot_count() slots
+    template <typename F>
+    void for_each_in(size_t begin, size_t end, F f) {
+        EpochGuard guard;
+        SlotArray* slots = slots_.load(memory_order_acquire);
+        size_t used = min(slots->used.load(memory_order_acquire), slots->capacity);
+        for (size_t i = begin; i < min(end, used); i++) {
+            Entry* entry = slots->slots[i].load(memory_order_acquire);
+            if (entry != nullptr) f(entry->value);
+        }
+    }
+
+    size_t slot_count() const {
+        EpochGuard guard;
+        SlotArray* slots = slots_.load(memory_order_acquire);
+        return min(slots->used.load(memory_order_acquire), slots->capacity);
+    }
+
+    size_t size() const {
+        return count_.load(memory_order_relaxed);
+    }
+
+private:
+    struct Entry {
+        uint32_t id;
+        uint64_t endpoint;
+        size_t slot;
+        T value;
+    };
+
+    // Control bytes: EMPTY and DELETED have the top bit set, a used cell
+    // holds the top 7 bits of its key's hash
+    static const size_t GROUP_SIZE = 8;
+    static const uint8_t CTRL_EMPTY = 0x80;
+    static const uint8_t CTRL_DELETED = 0xfe;
+    static const uint64_t BYTES_LOW = 0x0101010101010101ULL;
+    static const uint64_t BYTES_HIGH = 0x8080808080808080ULL;
+
+    // A group's cells fill one cache line; the key is checked on the entry
+    struct alignas(64) Group {
+        atomic<Entry*> entries[GROUP_SIZE];
+    };
+
+    // Open addressing over groups, probed one group after the other. A
+    // probe ends at the first group with an empty cell. The control words
+    // sit in their own array, so a probe mostly reads that dense array and
+    // then one group line. Readers validate the entry they land on, so a
+    // cell recycled under them only causes a miss.
+    struct Index {
+        size_t group_mask;
+        size_t occupied;  // live + deleted cells, writer only
+        size_t live;      // writer only
+        atomic<uint64_t>* control; // per group, byte i describes cell i
+        Group* groups;
+
+        explicit Index(size_t cells) : group_mask(cells / GROUP_SIZE - 1), occupied(0), live(0) {
+            control = new atomic<uint64_t>[group_mask + 1];
+            groups = new Group[group_mask + 1];
+            for (size_t g = 0; g <= group_mask; g++) {
+                control[g].store(BYTES_LOW * CTRL_EMPTY, memory_order_relaxed);
+                for (size_t i = 0; i < GROUP_SIZE; i++) groups[g].entries[i].store(nullptr, memory_order_relaxed);
+            }
+        }
+        ~Index() {
+            delete[] control;
+            delete[] groups;
+        }
+
+        size_t cells() const { return (group_mask + 1) * GROUP_SIZE; }
+    };
+
+    // Where locate() found room for a key
+    struct Position {
+        size_t group;
+        size_t cell;
+    };
+
+    struct SlotArray {
+        size_t capacity;
+        atomic<size_t> used;  // high-water mark of slots handed out
+        atomic<Entry*>* slots;
+
+        explicit SlotArray(size_t cap) : capacity(cap), used(0) {
+            slots = new atomic<Entry*>[cap];
+            for (size_t i = 0; i < cap; i++) slots[i].store(nullptr, memory_order_relaxed);
+        }
+        ~SlotArray() { delete[] slots; }
+    };
+
+    static size_t hash_key(uint64_t key) {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ULL;
+        key ^= key >> 33;
+        return (size_t)key;
+    }
+
+    // The low bits of the hash pick the first group, the top 7 the tag
+    static uint8_t tag_of(size_t hash) { return (uint8_t)(hash >> 57); }
+
+    // Byte-parallel compares on a control word; each returns the top bit
+    // of every byte that qualifies. match_tag() may also flag a used cell
+    // right above a match, which the key comparison then rejects.
+    static uint64_t match_tag(uint64_t control, uint8_t tag) {
+        uint64_t diff = control ^ (BYTES_LOW * tag);
+        return (diff - BYTES_LOW) & ~diff & BYTES_HIGH;
+    }
+
+    static uint64_t match_empty(uint64_t control) { return control & ~(control << 6) & BYTES_HIGH; }
+    static uint64_t match_free(uint64_t control) { return control & BYTES_HIGH; } // empty or deleted
+    static size_t first_cell(uint64_t matches) { return (size_t)__builtin_ctzll(matches) / 8; }
+
+    // Writer only; publishes the control word after the cell it describes
+    static void set_control(Index* index, size_t group, size_t cell, uint8_t value) {
+        uint64_t control = index->control[group].load(memory_order_relaxed);
+        control = (control & ~(0xffULL << (cell * 8))) | ((uint64_t)value << (cell * 8));
+        index->control[group].store(control, memory_order_release);
+    }
+
+    uint64_t key_of(const atomic<Index*>& which, const Entry* entry) const {
+        return (&which == &ids_) ? entry->id : entry->endpoint;
+    }
+
+    Entry* find(const atomic<Index*>& which, uint64_t key) {
+        Index* index = which.load(memory_order_acquire);
+        size_t hash = hash_key(key);
+        uint8_t tag = tag_of(hash);
+        for (size_t g = hash & index->group_mask, probes = 0; probes <= index->group_mask;
+             g = (g + 1) & index->group_mask, probes++) {
+            uint64_t control = index->control[g].load(memory_order_acquire);
+            for (uint64_t matches = match_tag(control, tag); matches != 0; matches &= matches - 1) {
+                Entry* entry = index->groups[g].entries[first_cell(matches)].load(memory_order_acquire);
+                if (entry != nullptr && key_of(which, entry) == key) return entry;
+            }
+            if (match_empty(control) != 0) return nullptr;
+        }
+        return nullptr;
+    }
+
+    // Writer only. Grow the index if one more key would fill it past 3/4;
+    // a locate() after this stays valid until the matching publish().
+    void reserve(atomic<Index*>& which) {
+        Index* index = which.load(memory_order_relaxed);
+        if ((index->occupied + 1) * 4 > index->cells() * 3) rebuild(which, max<size_t>(16, (index->live + 1) * 2));
+    }
+
+    // Writer only. One probe that both looks for the key and remembers the
+    // first free cell on the way; returns false if the key is present.
+    bool locate(const atomic<Index*>& which, Index* index, uint64_t key, Position& position) const {
+        size_t hash = hash_key(key);
+        uint8_t tag = tag_of(hash);
+        bool found_free = false;
+        position.group = position.cell = 0;
+        for (size_t g = hash & index->group_mask;; g = (g + 1) & index->group_mask) {
+            uint64_t control = index->control[g].load(memory_order_relaxed);
+            for (uint64_t matches = match_tag(control, tag); matches != 0; matches &= matches - 1) {
+                Entry* entry = index->groups[g].entries[first_cell(matches)].load(memory_order_relaxed);
+                if (key_of(which, entry) == key) return false;
+            }
+            if (!found_free && match_free(control) != 0) {
+                found_free = true;
+                position.group = g;
+                position.cell = first_cell(match_free(control));
+            }
+            if (match_empty(control) != 0) return true;
+        }
+    }
+
+    // Writer only. Publishes the entry pointer before the tag.
+    void publish(atomic<Index*>& which, const Position& position, uint64_t key, Entry* entry) {
+        Index* index = which.load(memory_order_relaxed);
+        uint8_t previous = (uint8_t)(index->control[position.group].load(memory_order_relaxed) >> (position.cell * 8));
+        if (previous == CTRL_EMPTY) index->occupied++;
+        index->live++;
+        index->groups[position.group].entries[position.cell].store(entry, memory_order_release);
+        set_control(index, position.group, position.cell, tag_of(hash_key(key)));
+    }
+
+    void index_erase(atomic<Index*>& which, uint64_t key) {
+        Index* index = which.load(memory_order_relaxed);
+        size_t hash = hash_key(key);
+        uint8_t tag = tag_of(hash);
+        for (size_t g = hash & index->group_mask;; g = (g + 1) & index->group_mask) {
+            uint64_t control = index->control[g].load(memory_order_relaxed);
+            for (uint64_t matches = match_tag(control, tag); matches != 0; matches &= matches - 1) {
+                size_t cell = first_cell(matches);
+                if (key_of(which, index->groups[g].entries[cell].load(memory_order_relaxed)) != key) continue;
+                set_control(index, g, cell, CTRL_DELETED);
+                index->live--;
+                return;
+            }
+            if (match_empty(control) != 0) return;
+        }
+    }
+
+    // Copy live cells into a fresh index (dropping deleted ones) and swap it in
+    void rebuild(atomic<Index*>& which, size_t min_cells) {
+        Index* old_index = which.load(memory_order_relaxed);
+        size_t cells = 16;
+        while (cells < min_cells) cells <<= 1;
+
+        Index* index = new Index(cells);
+        for (size_t g = 0; g <= old_index->group_mask; g++) {
+            uint64_t used = ~old_index->control[g].load(memory_order_relaxed) & BYTES_HIGH;
+            for (; used != 0; used &= used - 1) {
+                Entry* entry = old_index->groups[g].entries[first_cell(used)].load(memory_order_relaxed);
+                uint64_t key = key_of(which, entry);
+                Position position;
+                locate(which, index, key, position);
+                // Published as a whole by the store of the index below
+                index->groups[position.group].entries[position.cell].store(entry, memory_order_relaxed);
+                set_control(index, position.group, position.cell, tag_of(hash_key(key)));
+                index->occupied++;
+                index->live++;
+            }
+        }
+        which.store(index, memory_order_release);
+        EpochReclaimer::instance().retire(old_index);
+    }
+
+    // Reuse a freed slot, or extend the array (doubling it when full)
+    size_t take_slot() {
+        if (!free_slots_.empty()) {
+            size_t slot = free_slots_.back();
+            free_slots_.pop_back();
+            return slot;
+        }
+
+        SlotArray* slots = slots_.load(memory_order_relaxed);
+        size_t used = slots->used.load(memory_order_relaxed);
+        if (used == slots->capacity) {
+            SlotArray* grown = new SlotArray(slots->capacity * 2);
+            for (size_t i = 0; i < used; i++) {
+                grown->slots[i].store(slots->slots[i].load(memory_order_relaxed), memory_order_relaxed);
+            }
+            grown->used.store(used, memory_order_relaxed);
+            slots_.store(grown, memory_order_release);
+            EpochReclaimer::instance().retire(slots);
+            slots = grown;
+        }
+        slots->used.store(used + 1, memory_order_release);
+        return used;
+    }
+
+    pthread_mutex_t write_mutex_;
+    atomic<Index*> ids_;
+    atomic<Index*> endpoints_;
+    atomic<SlotArray*> slots_;
+    vector<size_t> free_slots_;  // writer only
+    atomic<size_t> count_;
+};
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <pthread.h>
+
+using namespace std;
+
+// Epoch-based reclamation for read-mostly shared structures.
+//
+// Readers pin the current epoch with an EpochGuard (a couple of atomic
+// stores, no locks) for as long as they hold pointers into the structure.
+// Writers unlink objects and retire() them; a retired object is freed only
+// once the global epoch has advanced twice, which cannot happen while any
+// reader that might still see it is inside its guard.
+class EpochReclaimer {
+public:
+    static const int MAX_THREADS = 512;
+
+    static EpochReclaimer& instance() {
+        static EpochReclaimer reclaimer;
+        return reclaimer;
+    }
+
+    void enter() {
+        ThreadState& state = thread_state();
+        if (state.depth++ > 0) return;
+
+        // Publish the epoch we read, then make sure it is still current so
+        // the epoch cannot move two steps past us unnoticed.
+        atomic<uint64_t>& slot = slots_[state.index].epoch;
+        uint64_t epoch = global_epoch_.load(memory_order_seq_cst);
+        while (true) {
+            slot.store(epoch | ACTIVE, memory_order_seq_cst);
+            uint64_t current = global_epoch_.load(memory_order_seq_cst);
+            if (current == epoch) break;
+            epoch = current;
+        }
+    }
+
+    void leave() {
+        ThreadState& state = thread_state();
+        if (--state.depth > 0) return;
+        slots_[state.index].epoch.store(0, memory_order_release);
+    }
+
+    // Hand over an object that is no longer reachable by new readers
+    void retire(void* object, void (*deleter)(void*)) {
+        pthread_mutex_lock(&retired_mutex_);
+        retired_.push_back(Retired{object, deleter, global_epoch_.load(memory_order_seq_cst)});
+        collect_locked();
+        pthread_mutex_unlock(&retired_mutex_);
+    }
+
+    ~EpochReclaimer() {
+        for (const Retired& item : retired_) item.deleter(item.object);
+        pthread_mutex_destroy(&retired_mutex_);
+    }
+
+    template <typename T>
+    void retire(T* object) {
+        retire(object, [](void* p) { delete static_cast<T*>(p); });
+    }
+
+    size_t pending() {
+        pthread_mutex_lock(&retired_mutex_);
+        size_t count = retired_.size();
+        pthread_mutex_unlock(&retired_mutex_);
+        return count;
+    }
+
+private:
+    static const uint64_t ACTIVE = 1ULL << 63;
+
+    struct alignas(64) Slot {
+        atomic<uint64_t> epoch;  // 0 when idle, epoch | ACTIVE inside a guard
+        atomic<bool> claimed;
+    };
+
+    struct Retired {
+        void* object;
+        void (*deleter)(void*);
+        uint64_t epoch;
+    };
+
+    // Per-thread slot ownership, released when the thread exits
+    struct ThreadState {
+        int index;
+        int depth;
+        EpochReclaimer* owner;
+
+        ThreadState() : index(-1), depth(0), owner(nullptr) {}
+        ~ThreadState() {
+            if (owner != nullptr && index >= 0) {
+                owner->slots_[index].epoch.store(0, memory_order_release);
+                owner->slots_[index].claimed.store(false, memory_order_release);
+            }
+        }
+    };
+
+    EpochReclaimer() : global_epoch_(1), slot_high_water_(0) {
+        for (int i = 0; i < MAX_THREADS; i++) {
+            slots_[i].epoch.store(0);
+            slots_[i].claimed.store(false);
+        }
+        pthread_mutex_init(&retired_mutex_, NULL);
+    }
+
+    ThreadState& thread_state() {
+        static thread_local ThreadState state;
+        if (state.index < 0) {
+            for (int i = 0; i < MAX_THREADS; i++) {
+                bool expected = false;
+                if (slots_[i].claimed.compare_exchange_strong(expected, true)) {
+                    state.index = i;
+                    state.owner = this;
+                    int high = slot_high_water_.load();
+                    while (high < i + 1 && !slot_high_water_.compare_exchange_weak(high, i + 1)) {
+                    }
+                    break;
+                }
+            }
+            if (state.index < 0) {
+                cerr << "EpochReclaimer: more than " << MAX_THREADS << " threads" << endl;
+                abort();
+            }
+        }
+        return state;
+    }
+
+    // Advance the epoch if every active reader has caught up with it, then
+    // free whatever was retired at least two epochs ago.
+    void collect_locked() {
+        uint64_t epoch = global_epoch_.load(memory_order_seq_cst);
+        bool can_advance = true;
+        int slot_count = slot_high_water_.load(memory_order_seq_cst);
+        for (int i = 0; i < slot_count; i++) {
+            uint64_t value = slots_[i].epoch.load(memory_order_seq_cst);
+            if ((value & ACTIVE) && (value & ~ACTIVE) != epoch) {
+                can_advance = false;
+                break;
+            }
+        }
+        if (can_advance) {
+            global_epoch_.compare_exchange_strong(epoch, epoch + 1, memory_order_seq_cst);
+            epoch = global_epoch_.load(memory_order_seq_cst);
+        }
+
+        size_t kept = 0;
+        for (size_t i = 0; i < retired_.size(); i++) {
+            if (retired_[i].epoch + 2 <= epoch) {
+                retired_[i].deleter(retired_[i].object);
+            } else {
+                retired_[kept++] = retired_[i];
+            }
+        }
+        retired_.resize(kept);
+    }
+
+    atomic<uint64_t> global_epoch_;
+    atomic<int> slot_high_water_;  // slots above this were never claimed
+    Slot slots_[MAX_THREADS];
+    pthread_mutex_t retired_mutex_;
+    vector<Retired> retired_;
+};
+
+// Keeps the calling thread's epoch pinned for the guard's lifetime
+class EpochGuard {
+public:
+    EpochGuard() { EpochReclaimer::instance().enter(); }
+    ~EpochGuard() { EpochReclaimer::instance().leave(); }
+
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator=(const EpochGuard&) = delete;
+};
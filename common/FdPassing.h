@@ -0,0 +1,121 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using namespace std;
+
+// Handing open file descriptors to another process on the same host.
+//
+// Both ends use a Unix-domain SOCK_SEQPACKET socket, so every send arrives
+// as exactly one message and the descriptors attached to it (SCM_RIGHTS)
+// arrive with that message. The receiver gets its own descriptors for the
+// same open files; the sender may close its copies afterwards.
+
+static const size_t FD_PASSING_MAX_FDS = 250; // per message; the kernel allows SCM_MAX_FD (253)
+
+inline bool unix_address(const string& path, sockaddr_un& addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) return false;
+    memcpy(addr.sun_path, path.data(), path.size());
+    return true;
+}
+
+// Listen on path, replacing whatever socket file is left there. Returns -1
+// on failure.
+inline int listen_unix(const string& path) {
+    sockaddr_un addr;
+    if (!unix_address(path, addr)) return -1;
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    unlink(path.c_str());
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 1) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+inline int connect_unix(const string& path) {
+    sockaddr_un addr;
+    if (!unix_address(path, addr)) return -1;
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Send one message with up to FD_PASSING_MAX_FDS descriptors attached
+inline bool send_with_fds(int sock, const void* data, size_t length, const int* fds, size_t fd_count) {
+    if (fd_count > FD_PASSING_MAX_FDS) return false;
+    char control[CMSG_SPACE(sizeof(int) * FD_PASSING_MAX_FDS)];
+    struct iovec iov;
+    iov.iov_base = const_cast<void*>(data);
+    iov.iov_len = length;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd_count > 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+    }
+
+    while (true) {
+        ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (sent == (ssize_t)length) return true;
+        if (sent == -1 && errno == EINTR) continue;
+        return false;
+    }
+}
+
+// Receive one message of up to capacity bytes, appending the descriptors
+// it carries (close-on-exec) to fds. Returns the message length, 0 when the
+// peer has gone and -1 on error, including a truncated message.
+inline ssize_t recv_with_fds(int sock, void* data, size_t capacity, vector<int>& fds) {
+    char control[CMSG_SPACE(sizeof(int) * FD_PASSING_MAX_FDS)];
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = capacity;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t received;
+    do {
+        received = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (received == -1 && errno == EINTR);
+    if (received == -1) return -1;
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            fds.push_back(fd);
+        }
+    }
+    if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) return -1;
+    return received;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <string>
+
+using namespace std;
+
+// History requests, shared by the chat clients and servers.
+//
+// On the wire a request is plain text: "last N" for the room's N most
+// recent messages, or "range FROM TO" for the messages sent between two
+// wall-clock times in milliseconds since the epoch (inclusive).
+
+static const uint32_t HISTORY_MAX_MESSAGES = 200; // per request
+static const uint32_t HISTORY_ON_JOIN = 20;       // replayed on connect and on /join
+
+struct HistoryQuery {
+    bool by_time;
+    uint32_t limit;
+    int64_t from_ms;
+    int64_t to_ms;
+};
+
+inline int64_t wall_clock_ms() {
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+inline string history_last_request(uint32_t count) {
+    return "last " + to_string(count);
+}
+
+// Server side. Limits are clamped to HISTORY_MAX_MESSAGES.
+inline bool parse_history_request(const char* text, size_t length, HistoryQuery& query) {
+    char request[64];
+    if (length >= sizeof(request)) return false;
+    memcpy(request, text, length);
+    request[length] = '\0';
+
+    unsigned count;
+    long long from, to;
+    if (sscanf(request, "last %u", &count) == 1) {
+        query.by_time = false;
+        query.limit = count < HISTORY_MAX_MESSAGES ? count : HISTORY_MAX_MESSAGES;
+        query.from_ms = 0;
+        query.to_ms = 0;
+        return true;
+    }
+    if (sscanf(request, "range %lld %lld", &from, &to) == 2 && from <= to) {
+        query.by_time = true;
+        query.limit = HISTORY_MAX_MESSAGES;
+        query.from_ms = from;
+        query.to_ms = to;
+        return true;
+    }
+    return false;
+}
+
+// "HH:MM" or "HH:MM:SS" today, local time, as milliseconds since the epoch
+inline bool parse_clock_time(const string& text, int64_t& ms) {
+    int hour, minute, second = 0;
+    char extra;
+    int fields = sscanf(text.c_str(), "%d:%d:%d%c", &hour, &minute, &second, &extra);
+    if (fields != 2 && fields != 3) return false;
+    if (hour < 0 || hour > 23 || minute < 0 || minute > 59 || second < 0 || second > 59) return false;
+
+    time_t now = time(NULL);
+    struct tm local;
+    localtime_r(&now, &local);
+    local.tm_hour = hour;
+    local.tm_min = minute;
+    local.tm_sec = second;
+    local.tm_isdst = -1;
+    ms = (int64_t)mktime(&local) * 1000;
+    return true;
+}
+
+// Client side: turn the arguments of "/history N" or
+// "/history HH:MM[:SS] [HH:MM[:SS]]" (until now if the end is left out)
+// into a request. Returns false if they are malformed.
+inline bool make_history_request(const string& args, string& request) {
+    unsigned count;
+    char extra;
+    if (sscanf(args.c_str(), "%u%c", &count, &extra) == 1) {
+        request = history_last_request(count);
+        return true;
+    }
+
+    size_t space = args.find(' ');
+    int64_t from, to = wall_clock_ms();
+    if (!parse_clock_time(args.substr(0, space), from)) return false;
+    if (space != string::npos) {
+        if (!parse_clock_time(args.substr(space + 1), to)) return false;
+        to += 999; // through the end of that second
+    }
+    if (from > to) return false;
+    request = "range " + to_string(from) + " " + to_string(to);
+    return true;
+}
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <algorithm>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Minimal io_uring wrapper over the raw syscalls (no liburing dependency).
+//
+// One instance per thread: get_sqe() fills submission entries in user
+// memory, submit_and_wait() hands all of them to the kernel with a single
+// io_uring_enter(), and for_each_cqe() walks the completions. A provided
+// buffer ring lets multishot receives pick their own buffers, which are
+// handed back with recycle_buffer() once consumed.
+class IoUring {
+public:
+    IoUring()
+        : ring_fd_(-1), sq_ring_(nullptr), cq_ring_(nullptr), sqes_(nullptr), sq_ring_size_(0),
+          cq_ring_size_(0), sqes_size_(0), sq_tail_(0), to_submit_(0), buf_ring_(nullptr),
+          buf_ring_size_(0), buf_memory_(nullptr), buf_count_(0), buf_size_(0), buf_group_(0) {}
+
+    ~IoUring() {
+        if (buf_ring_ != nullptr) munmap(buf_ring_, buf_ring_size_);
+        free(buf_memory_);
+        if (sqes_ != nullptr) munmap(sqes_, sqes_size_);
+        if (cq_ring_ != nullptr && cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+        if (sq_ring_ != nullptr) munmap(sq_ring_, sq_ring_size_);
+        if (ring_fd_ >= 0) close(ring_fd_);
+    }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    // Returns 0 or -errno. The completion queue is sized 4x the submission
+    // queue so bursts of multishot completions do not overflow it.
+    int init(unsigned entries) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4;
+        ring_fd_ = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (ring_fd_ < 0) return -errno;
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+            return -ENOSYS;
+        }
+
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (cq_ring_size_ > sq_ring_size_) sq_ring_size_ = cq_ring_size_;
+        cq_ring_size_ = sq_ring_size_;
+
+        sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring_fd_, IORING_OFF_SQ_RING);
+        if (sq_ring_ == MAP_FAILED) {
+            sq_ring_ = nullptr;
+            return -errno;
+        }
+        cq_ring_ = sq_ring_;
+
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring_fd_, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) return -errno;
+        sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+        char* sq = static_cast<char*>(sq_ring_);
+        sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail_ptr_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_entries_ = params.sq_entries;
+        sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sq_tail_ = *sq_tail_ptr_;
+
+        char* cq = static_cast<char*>(cq_ring_);
+        cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return 0;
+    }
+
+    // Next free submission entry, zeroed. Flushes queued entries to the
+    // kernel first if the submission queue is full.
+    io_uring_sqe* get_sqe() {
+        unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+        if (sq_tail_ - head >= sq_entries_) {
+            if (enter(to_submit_, 0) < 0) return nullptr;
+            head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+            if (sq_tail_ - head >= sq_entries_) return nullptr;
+        }
+        unsigned index = sq_tail_ & sq_mask_;
+        io_uring_sqe* sqe = &sqes_[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array_[index] = index;
+        sq_tail_++;
+        to_submit_++;
+        __atomic_store_n(sq_tail_ptr_, sq_tail_, __ATOMIC_RELEASE);
+        return sqe;
+    }
+
+    unsigned pending_submissions() const { return to_submit_; }
+
+    // Submit everything queued and wait for at least wait_nr completions.
+    // Returns the number submitted or -errno (-EINTR is not an error).
+    int submit_and_wait(unsigned wait_nr) {
+        return enter(to_submit_, wait_nr);
+    }
+
+    unsigned ready_completions() const {
+        return __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE) - *cq_head_;
+    }
+
+    // Call f(const io_uring_cqe&) for up to `limit` available completions,
+    // then release them to the kernel. Returns the number handled.
+    template <typename F>
+    unsigned for_each_cqe(F f, unsigned limit = ~0u) {
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        unsigned count = 0;
+        for (; head != tail && count < limit; head++, count++) {
+            f(cqes_[head & cq_mask_]);
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        return count;
+    }
+
+    // Register `count` buffers of `size` bytes (count a power of two) as
+    // provided-buffer group `group` for IOSQE_BUFFER_SELECT receives.
+    int setup_buffer_ring(uint16_t group, unsigned count, unsigned size) {
+        buf_ring_size_ = count * sizeof(io_uring_buf);
+        void* ring = mmap(nullptr, buf_ring_size_, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (ring == MAP_FAILED) return -errno;
+        buf_ring_ = static_cast<io_uring_buf*>(ring);
+        if (posix_memalign(reinterpret_cast<void**>(&buf_memory_), 4096, (size_t)count * size) != 0) return -ENOMEM;
+        buf_count_ = count;
+        buf_size_ = size;
+        buf_group_ = group;
+
+        io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring_);
+        reg.ring_entries = count;
+        reg.bgid = group;
+        if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return -errno;
+
+        for (unsigned i = 0; i < count; i++) add_buffer(i, i);
+        buf_tail_ = (uint16_t)count;
+        __atomic_store_n(&buf_ring_[0].resv, buf_tail_, __ATOMIC_RELEASE);
+        return 0;
+    }
+
+    uint16_t buffer_group() const { return buf_group_; }
+    char* buffer(unsigned id) { return buf_memory_ + (size_t)id * buf_size_; }
+
+    // Give a consumed receive buffer back to the kernel
+    void recycle_buffer(unsigned id) {
+        add_buffer(id, buf_tail_);
+        buf_tail_++;
+        __atomic_store_n(&buf_ring_[0].resv, buf_tail_, __ATOMIC_RELEASE);
+    }
+
+private:
+    int enter(unsigned to_submit, unsigned wait_nr) {
+        unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+        int ret = (int)syscall(__NR_io_uring_enter, ring_fd_, to_submit, wait_nr, flags, nullptr, 0);
+        if (ret < 0) return -errno;
+        to_submit_ -= min<unsigned>((unsigned)ret, to_submit_);
+        return ret;
+    }
+
+    void add_buffer(unsigned id, uint16_t position) {
+        io_uring_buf& buf = buf_ring_[position & (buf_count_ - 1)];
+        buf.addr = reinterpret_cast<uint64_t>(buffer(id));
+        buf.len = buf_size_;
+        buf.bid = (uint16_t)id;
+    }
+
+    int ring_fd_;
+    void* sq_ring_;
+    void* cq_ring_;
+    io_uring_sqe* sqes_;
+    size_t sq_ring_size_;
+    size_t cq_ring_size_;
+    size_t sqes_size_;
+
+    unsigned* sq_head_;
+    unsigned* sq_tail_ptr_;
+    unsigned* sq_array_;
+    unsigned sq_mask_;
+    unsigned sq_entries_;
+    unsigned sq_tail_;     // local copy, published on every get_sqe()
+    unsigned to_submit_;
+
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    unsigned cq_mask_;
+    io_uring_cqe* cqes_;
+
+    // The kernel's io_uring_buf_ring is an array of io_uring_buf whose first
+    // entry's resv field doubles as the ring tail. Its flex-array declaration
+    // lays out differently in C++, so the array is addressed directly.
+    io_uring_buf* buf_ring_;
+    size_t buf_ring_size_;
+    char* buf_memory_;
+    unsigned buf_count_;
+    unsigned buf_size_;
+    uint16_t buf_group_;
+    uint16_t buf_tail_;
+};
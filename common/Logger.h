@@ -0,0 +1,228 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <cstdio>
+#include <cstdarg>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <pthread.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Asynchronous leveled logging shared by the servers and clients.
+//
+// LOG_DEBUG/LOG_INFO/LOG_WARN/LOG_ERROR format straight into a slot of the
+// calling thread's lock-free ring buffer (no allocation, no lock, no
+// syscall). A background writer thread drains every ring and emits the lines
+// with one write(2) per batch. When a ring is full the record is dropped and
+// counted rather than blocking the caller.
+//
+// Build with -DLOG_MIN_LEVEL=1 (or higher) to compile debug logging out
+// entirely: the macro and its arguments disappear from the binary.
+
+enum LogLevel {
+    LOG_LEVEL_DEBUG = 0,
+    LOG_LEVEL_INFO  = 1,
+    LOG_LEVEL_WARN  = 2,
+    LOG_LEVEL_ERROR = 3
+};
+
+// Numeric because the preprocessor cannot see enum values: 0 = debug and up
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 0
+#endif
+
+class Logger {
+public:
+    static const size_t RING_SIZE = 1024;    // records per thread, power of two
+    static const size_t RECORD_TEXT = 232;   // longer messages are truncated
+
+    static Logger& instance() {
+        static Logger logger;
+        return logger;
+    }
+
+    void log(LogLevel level, const char* fmt, ...) __attribute__((format(printf, 3, 4))) {
+        Ring* ring = thread_ring();
+        uint64_t head = ring->head.load(memory_order_relaxed);
+        if (head - ring->tail.load(memory_order_acquire) >= RING_SIZE) {
+            dropped_.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+
+        Record& record = ring->records[head & (RING_SIZE - 1)];
+        timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        record.seconds = now.tv_sec;
+        record.millis = (uint32_t)(now.tv_nsec / 1000000);
+        record.level = (uint8_t)level;
+
+        va_list args;
+        va_start(args, fmt);
+        int len = vsnprintf(record.text, RECORD_TEXT, fmt, args);
+        va_end(args);
+        record.length = (uint16_t)(len < 0 ? 0 : (len >= (int)RECORD_TEXT ? RECORD_TEXT - 1 : len));
+
+        ring->head.store(head + 1, memory_order_release);
+    }
+
+    // Block until everything logged so far has been written
+    void flush() {
+        pthread_mutex_lock(&drain_mutex_);
+        drain();
+        pthread_mutex_unlock(&drain_mutex_);
+    }
+
+    uint64_t dropped() const { return dropped_.load(memory_order_relaxed); }
+
+    ~Logger() {
+        running_.store(false);
+        pthread_join(writer_, NULL);
+        flush();
+    }
+
+private:
+    struct Record {
+        int64_t seconds;
+        uint32_t millis;
+        uint8_t level;
+        uint16_t length;
+        char text[RECORD_TEXT];
+    };
+
+    // Single producer (the owning thread), single consumer (the writer)
+    struct Ring {
+        alignas(64) atomic<uint64_t> head;  // next slot the producer fills
+        alignas(64) atomic<uint64_t> tail;  // next slot the consumer reads
+        atomic<bool> abandoned;             // owning thread has exited
+        Record records[RING_SIZE];
+
+        Ring() : head(0), tail(0), abandoned(false) {}
+    };
+
+    // Marks the thread's ring abandoned on exit; the writer frees it once drained
+    struct RingHolder {
+        Ring* ring;
+        RingHolder() : ring(nullptr) {}
+        ~RingHolder() {
+            if (ring != nullptr) ring->abandoned.store(true, memory_order_release);
+        }
+    };
+
+    Logger() : running_(true), dropped_(0) {
+        pthread_mutex_init(&rings_mutex_, NULL);
+        pthread_mutex_init(&drain_mutex_, NULL);
+        pthread_create(&writer_, NULL, writer_thread, this);
+    }
+
+    Ring* thread_ring() {
+        static thread_local RingHolder holder;
+        if (holder.ring == nullptr) {
+            holder.ring = new Ring();
+            pthread_mutex_lock(&rings_mutex_);
+            rings_.push_back(holder.ring);
+            pthread_mutex_unlock(&rings_mutex_);
+        }
+        return holder.ring;
+    }
+
+    static void* writer_thread(void* arg) {
+        Logger* self = static_cast<Logger*>(arg);
+        while (self->running_.load()) {
+            pthread_mutex_lock(&self->drain_mutex_);
+            size_t written = self->drain();
+            pthread_mutex_unlock(&self->drain_mutex_);
+            if (written == 0) usleep(2000);
+        }
+        return nullptr;
+    }
+
+    // Copy every pending record into one buffer and write it out at once.
+    // Caller holds drain_mutex_.
+    size_t drain() {
+        static const char* const names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+        size_t total = 0;
+
+        pthread_mutex_lock(&rings_mutex_);
+        vector<Ring*> rings = rings_;
+        pthread_mutex_unlock(&rings_mutex_);
+
+        for (Ring* ring : rings) {
+            bool abandoned = ring->abandoned.load(memory_order_acquire);
+            uint64_t tail = ring->tail.load(memory_order_relaxed);
+            uint64_t head = ring->head.load(memory_order_acquire);
+
+            for (; tail != head; tail++) {
+                const Record& record = ring->records[tail & (RING_SIZE - 1)];
+                time_t seconds = (time_t)record.seconds;
+                struct tm local;
+                localtime_r(&seconds, &local);
+
+                char line[RECORD_TEXT + 48];
+                int len = snprintf(line, sizeof(line), "%02d:%02d:%02d.%03u [%s] %.*s\n",
+                                   local.tm_hour, local.tm_min, local.tm_sec, record.millis,
+                                   names[record.level & 3], (int)record.length, record.text);
+                if (len > (int)sizeof(line) - 1) len = sizeof(line) - 1;
+                if (out_.size() + len > 65536) write_out();
+                out_.insert(out_.end(), line, line + len);
+                total++;
+            }
+            ring->tail.store(tail, memory_order_release);
+
+            if (abandoned && tail == ring->head.load(memory_order_acquire)) {
+                pthread_mutex_lock(&rings_mutex_);
+                for (size_t i = 0; i < rings_.size(); i++) {
+                    if (rings_[i] == ring) {
+                        rings_.erase(rings_.begin() + i);
+                        break;
+                    }
+                }
+                pthread_mutex_unlock(&rings_mutex_);
+                delete ring;
+            }
+        }
+        write_out();
+        return total;
+    }
+
+    void write_out() {
+        size_t offset = 0;
+        while (offset < out_.size()) {
+            ssize_t n = write(STDERR_FILENO, out_.data() + offset, out_.size() - offset);
+            if (n <= 0) break;
+            offset += n;
+        }
+        out_.clear();
+    }
+
+    atomic<bool> running_;
+    atomic<uint64_t> dropped_;
+    pthread_t writer_;
+    pthread_mutex_t rings_mutex_;  // guards rings_ membership only
+    pthread_mutex_t drain_mutex_;  // one drainer at a time
+    vector<Ring*> rings_;
+    vector<char> out_;             // writer-side line buffer
+};
+
+#if LOG_MIN_LEVEL <= 0
+#define LOG_DEBUG(...) Logger::instance().log(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do {} while (0)
+#endif
+
+#if LOG_MIN_LEVEL <= 1
+#define LOG_INFO(...) Logger::instance().log(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do {} while (0)
+#endif
+
+#if LOG_MIN_LEVEL <= 2
+#define LOG_WARN(...) Logger::instance().log(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) do {} while (0)
+#endif
+
+#define LOG_ERROR(...) Logger::instance().log(LOG_LEVEL_ERROR, __VA_ARGS__)
@@ -0,0 +1,521 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <pthread.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "HistoryQuery.h"
+#include "MessagePool.h"
+#include "RoomIndex.h"
+#include "Logger.h"
+
+using namespace std;
+
+// Persistent chat history, shared by the TCP and UDP servers.
+//
+// The log is a directory of fixed-size segment files, each mapped into
+// memory and filled with records back to back. Broadcast paths never touch
+// the files: append() takes a reference to the pooled payload, stamps it
+// and puts it on a queue that a dedicated appender thread drains into the
+// active segment. When a segment is full the next one is created, and the
+// oldest is deleted once more than max_segments exist.
+//
+// Readers replay straight from the mappings. Each segment publishes how
+// many bytes of it are complete with a release store, so a reader never
+// sees a half-written record, and holds its segments through shared_ptrs
+// so one deleted meanwhile stays mapped until the reader is done. Every
+// INDEX_STRIDE-th record goes into a small in-memory index of (sequence,
+// timestamp, offset); a time-range query binary-searches it and scans at
+// most INDEX_STRIDE records to reach its start. Each segment also lists the
+// offsets of every room's records (8 bytes of memory per record), so a
+// "last N" replay picks its N records without scanning other rooms' chat.
+// Sequences and timestamps only grow, across restarts too: open() rebuilds
+// both indexes by scanning the existing segments and carries on where they
+// end.
+//
+// Records store the room by name, since room ids are not stable across
+// restarts, and only the raw payload: replay formats the "[time] Client N:"
+// prefix from the stored timestamp and client id.
+
+class MessageLog {
+public:
+    static const size_t DEFAULT_SEGMENT_BYTES = 16 * 1024 * 1024;
+    static const size_t DEFAULT_MAX_SEGMENTS = 16;
+    static const size_t MAX_PENDING = 65536;  // queued appends beyond which new ones are dropped
+    static const uint32_t INDEX_STRIDE = 16;  // records per index entry
+
+    // One stored message; payload points into a mapped segment and stays
+    // valid during the replay callback
+    struct Record {
+        uint64_t seq;
+        int64_t timestamp_ms;
+        uint32_t client_id;
+        const char* payload;
+        uint32_t payload_length;
+    };
+
+    MessageLog(RoomDirectory& rooms, const string& directory,
+               size_t segment_bytes = DEFAULT_SEGMENT_BYTES, size_t max_segments = DEFAULT_MAX_SEGMENTS)
+        : rooms_(rooms), directory_(directory), segment_bytes_(segment_bytes),
+          max_segments_(max(max_segments, (size_t)1)), next_seq_(1), last_timestamp_(0),
+          running_(false), stored_(0), dropped_(0) {
+        pthread_mutex_init(&queue_mutex_, NULL);
+        pthread_cond_init(&queue_cv_, NULL);
+        pthread_mutex_init(&segments_mutex_, NULL);
+    }
+
+    // Drains the queue, then trims the active segment file to its records
+    ~MessageLog() {
+        if (running_) {
+            pthread_mutex_lock(&queue_mutex_);
+            running_ = false;
+            pthread_cond_signal(&queue_cv_);
+            pthread_mutex_unlock(&queue_mutex_);
+            pthread_join(thread_, NULL);
+        }
+        if (active_ && ftruncate(active_->fd, (off_t)active_->end.load()) != 0) {
+            LOG_WARN("Failed to trim %s: %s", active_->path.c_str(), strerror(errno));
+        }
+        pthread_cond_destroy(&queue_cv_);
+        pthread_mutex_destroy(&queue_mutex_);
+        pthread_mutex_destroy(&segments_mutex_);
+    }
+
+    MessageLog(const MessageLog&) = delete;
+    MessageLog& operator=(const MessageLog&) = delete;
+
+    // Create the directory or recover the segments already in it, then
+    // start the appender. Returns false with a reason if the log is unusable.
+    bool open(string& error) {
+        if (mkdir(directory_.c_str(), 0755) != 0 && errno != EEXIST) {
+            error = "cannot create " + directory_ + ": " + strerror(errno);
+            return false;
+        }
+        if (!recover(error)) return false;
+        if (!active_ && !roll(error)) return false;
+
+        running_ = true;
+        if (pthread_create(&thread_, NULL, appender_thread, this) != 0) {
+            running_ = false;
+            error = "cannot start the appender thread";
+            return false;
+        }
+        return true;
+    }
+
+    // Queue a message for the log; never blocks on disk. The payload is
+    // shared, not copied.
+    void append(uint32_t room, uint32_t client_id, BufferRef payload) {
+        int64_t now = wall_clock_ms();
+        pthread_mutex_lock(&queue_mutex_);
+        bool accepted = pending_.size() < MAX_PENDING;
+        if (accepted) {
+            if (pending_.empty()) pthread_cond_signal(&queue_cv_);
+            pending_.push_back(Pending{room, client_id, now, move(payload)});
+        }
+        pthread_mutex_unlock(&queue_mutex_);
+        if (!accepted) dropped_.fetch_add(1, memory_order_relaxed);
+    }
+
+    void append(uint32_t room, uint32_t client_id, const void* payload, uint32_t length) {
+        BufferRef copy = BufferRef::allocate(length);
+        if (!copy) {
+            dropped_.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+        copy.append(payload, length);
+        append(room, client_id, move(copy));
+    }
+
+    // Run f(const Record&) on the messages of one room that match the
+    // query, oldest first. Returns how many were replayed.
+    template <typename F>
+    size_t replay(uint32_t room_id, const HistoryQuery& query, F f) {
+        string room = rooms_.name(room_id);
+        vector<shared_ptr<Segment>> segments;
+        vector<pair<size_t, size_t>> picked; // last-N replay: (segment, offset), oldest first
+        size_t first = 0, offset = 0;
+        pthread_mutex_lock(&segments_mutex_);
+        segments = segments_;
+        if (query.by_time) {
+            locate(segments, query.from_ms, first, offset);
+        } else {
+            pick_last(segments, room, query.limit, picked);
+        }
+        pthread_mutex_unlock(&segments_mutex_);
+
+        if (!query.by_time) {
+            for (const pair<size_t, size_t>& at : picked) {
+                RecordHeader header;
+                memcpy(&header, segments[at.first]->base + at.second, sizeof(header));
+                emit(*segments[at.first], at.second, header, f);
+            }
+            return picked.size();
+        }
+
+        size_t replayed = 0;
+        bool done = query.limit == 0;
+        for (size_t s = first; s < segments.size() && !done; s++) {
+            const Segment& segment = *segments[s];
+            scan(segment, s == first ? offset : 0, [&](size_t at, const RecordHeader& header) {
+                if (header.timestamp_ms < query.from_ms) return true;
+                if (header.timestamp_ms > query.to_ms) {
+                    done = true;
+                    return false;
+                }
+                if (in_room(segment, at, header, room)) {
+                    emit(segment, at, header, f);
+                    done = ++replayed == query.limit;
+                }
+                return !done;
+            });
+        }
+        return replayed;
+    }
+
+    // History line appended to the MSG_STATS replies
+    int format_report(char* out, size_t capacity) {
+        pthread_mutex_lock(&segments_mutex_);
+        size_t segments = segments_.size();
+        pthread_mutex_unlock(&segments_mutex_);
+        return snprintf(out, capacity, "\n History: %llu messages in %zu segments, dropped %llu",
+                        (unsigned long long)stored_.load(memory_order_relaxed), segments,
+                        (unsigned long long)dropped_.load(memory_order_relaxed));
+    }
+
+private:
+    static const uint32_t RECORD_MAGIC = 0x4D4C4843; // "CHLM", written last
+
+    // On-disk record: this header, the room name, the payload, then padding
+    // to the next 8-byte boundary. Host byte order.
+    struct RecordHeader {
+        uint32_t magic;
+        uint32_t payload_length;
+        uint64_t seq;
+        int64_t timestamp_ms;
+        uint32_t client_id;
+        uint16_t room_length;
+        uint16_t reserved;
+    };
+
+    struct IndexEntry {
+        uint64_t seq;
+        int64_t timestamp_ms;
+        size_t offset;
+    };
+
+    struct Segment {
+        string path;
+        int fd;
+        char* base;
+        size_t capacity;
+        atomic<size_t> end;        // bytes of complete records
+        uint64_t records;          // appender only
+        vector<IndexEntry> index;  // guarded by segments_mutex_
+        unordered_map<string, vector<size_t>> rooms; // record offsets per room, oldest first; guarded by segments_mutex_
+
+        Segment() : fd(-1), base(nullptr), capacity(0), end(0), records(0) {}
+        ~Segment() {
+            if (base != nullptr) munmap(base, capacity);
+            if (fd != -1) close(fd);
+        }
+    };
+
+    struct Pending {
+        uint32_t room;
+        uint32_t client_id;
+        int64_t timestamp_ms;
+        BufferRef payload;
+    };
+
+    static size_t record_size(size_t room_length, size_t payload_length) {
+        return (sizeof(RecordHeader) + room_length + payload_length + 7) & ~(size_t)7;
+    }
+
+    static void* appender_thread(void* arg) {
+        static_cast<MessageLog*>(arg)->run();
+        return nullptr;
+    }
+
+    void run() {
+        vector<Pending> batch;
+        pthread_mutex_lock(&queue_mutex_);
+        while (true) {
+            while (pending_.empty() && running_) pthread_cond_wait(&queue_cv_, &queue_mutex_);
+            if (pending_.empty()) break;
+            batch.swap(pending_);
+            pthread_mutex_unlock(&queue_mutex_);
+
+            for (const Pending& message : batch) write_record(message);
+            batch.clear();
+            pthread_mutex_lock(&queue_mutex_);
+        }
+        pthread_mutex_unlock(&queue_mutex_);
+    }
+
+    void write_record(const Pending& message) {
+        const string& room = room_name(message.room);
+        size_t size = record_size(room.size(), message.payload.size());
+        string error;
+        if (size > segment_bytes_ ||
+            (active_->end.load(memory_order_relaxed) + size > active_->capacity && !roll(error))) {
+            if (!error.empty()) LOG_WARN("Message log: %s", error.c_str());
+            dropped_.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+
+        Segment* segment = active_.get();
+        size_t offset = segment->end.load(memory_order_relaxed);
+        char* at = segment->base + offset;
+        RecordHeader header;
+        header.magic = 0;
+        header.payload_length = (uint32_t)message.payload.size();
+        header.seq = next_seq_;
+        header.timestamp_ms = max(message.timestamp_ms, last_timestamp_); // keep the index sorted
+        header.client_id = message.client_id;
+        header.room_length = (uint16_t)room.size();
+        header.reserved = 0;
+        memcpy(at, &header, sizeof(header));
+        memcpy(at + sizeof(header), room.data(), room.size());
+        memcpy(at + sizeof(header) + room.size(), message.payload.data(), message.payload.size());
+        uint32_t magic = RECORD_MAGIC;
+        memcpy(at, &magic, sizeof(magic));
+
+        pthread_mutex_lock(&segments_mutex_);
+        if (segment->records % INDEX_STRIDE == 0) {
+            segment->index.push_back(IndexEntry{header.seq, header.timestamp_ms, offset});
+        }
+        segment->rooms[room].push_back(offset);
+        pthread_mutex_unlock(&segments_mutex_);
+        segment->records++;
+        segment->end.store(offset + size, memory_order_release);
+        next_seq_++;
+        last_timestamp_ = header.timestamp_ms;
+        stored_.fetch_add(1, memory_order_relaxed);
+    }
+
+    // Room ids never change their name, so the appender keeps its own copy
+    // instead of asking the directory for every record
+    const string& room_name(uint32_t room) {
+        if (room >= room_names_.size()) room_names_.resize(room + 1);
+        if (room_names_[room].empty()) room_names_[room] = rooms_.name(room);
+        return room_names_[room];
+    }
+
+    // Map a segment file, growing it to at least min_size bytes
+    shared_ptr<Segment> map_segment(const string& path, size_t min_size, string& error) {
+        shared_ptr<Segment> segment = make_shared<Segment>();
+        segment->path = path;
+        segment->fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        struct stat info;
+        if (segment->fd == -1 || fstat(segment->fd, &info) != 0) {
+            error = "cannot open " + path + ": " + strerror(errno);
+            return nullptr;
+        }
+        segment->capacity = max((size_t)info.st_size, min_size);
+        if ((size_t)info.st_size < segment->capacity && ftruncate(segment->fd, (off_t)segment->capacity) != 0) {
+            error = "cannot grow " + path + ": " + strerror(errno);
+            return nullptr;
+        }
+        if (segment->capacity == 0) return segment;
+        void* base = mmap(NULL, segment->capacity, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0);
+        if (base == MAP_FAILED) {
+            error = "cannot map " + path + ": " + strerror(errno);
+            return nullptr;
+        }
+        segment->base = static_cast<char*>(base);
+        return segment;
+    }
+
+    // Start a new active segment named after its first sequence number.
+    // The full one is trimmed to its records; readers never look past them.
+    bool roll(string& error) {
+        char name[64];
+        snprintf(name, sizeof(name), "/segment-%020llu.log", (unsigned long long)next_seq_);
+        shared_ptr<Segment> segment = map_segment(directory_ + name, segment_bytes_, error);
+        if (!segment) return false;
+
+        if (active_ && ftruncate(active_->fd, (off_t)active_->end.load()) != 0) {
+            LOG_WARN("Failed to trim %s: %s", active_->path.c_str(), strerror(errno));
+        }
+        active_ = segment;
+        pthread_mutex_lock(&segments_mutex_);
+        segments_.push_back(segment);
+        vector<shared_ptr<Segment>> expired = trim_locked();
+        pthread_mutex_unlock(&segments_mutex_);
+        remove_segments(expired);
+        return true;
+    }
+
+    // Drop the oldest segments beyond max_segments_ from the list
+    vector<shared_ptr<Segment>> trim_locked() {
+        vector<shared_ptr<Segment>> expired;
+        while (segments_.size() > max_segments_) {
+            expired.push_back(segments_.front());
+            segments_.erase(segments_.begin());
+        }
+        return expired;
+    }
+
+    void remove_segments(const vector<shared_ptr<Segment>>& expired) {
+        for (const shared_ptr<Segment>& segment : expired) {
+            stored_.fetch_sub(segment->records, memory_order_relaxed);
+            if (unlink(segment->path.c_str()) != 0) {
+                LOG_WARN("Failed to remove %s: %s", segment->path.c_str(), strerror(errno));
+            }
+        }
+    }
+
+    // Map every existing segment in name (= sequence) order and rebuild the
+    // index. Each segment ends at its first incomplete or out-of-sequence
+    // record; the last one becomes the active segment again.
+    bool recover(string& error) {
+        DIR* dir = opendir(directory_.c_str());
+        if (dir == nullptr) {
+            error = "cannot read " + directory_ + ": " + strerror(errno);
+            return false;
+        }
+        vector<string> names;
+        while (dirent* entry = readdir(dir)) {
+            string name = entry->d_name;
+            if (name.size() == 32 && name.compare(0, 8, "segment-") == 0 && name.compare(28, 4, ".log") == 0) {
+                names.push_back(name);
+            }
+        }
+        closedir(dir);
+        sort(names.begin(), names.end());
+
+        for (size_t i = 0; i < names.size(); i++) {
+            bool last = i + 1 == names.size();
+            shared_ptr<Segment> segment = map_segment(directory_ + "/" + names[i], last ? segment_bytes_ : 0, error);
+            if (!segment) return false;
+
+            size_t offset = 0;
+            RecordHeader header;
+            while (offset + sizeof(header) <= segment->capacity) {
+                memcpy(&header, segment->base + offset, sizeof(header));
+                size_t size = record_size(header.room_length, header.payload_length);
+                if (header.magic != RECORD_MAGIC || offset + size > segment->capacity ||
+                    header.seq < next_seq_) {
+                    break;
+                }
+                if (segment->records % INDEX_STRIDE == 0) {
+                    segment->index.push_back(IndexEntry{header.seq, header.timestamp_ms, offset});
+                }
+                segment->rooms[string(segment->base + offset + sizeof(header), header.room_length)].push_back(offset);
+                segment->records++;
+                next_seq_ = header.seq + 1;
+                last_timestamp_ = header.timestamp_ms;
+                offset += size;
+            }
+            segment->end.store(offset);
+            stored_.fetch_add(segment->records, memory_order_relaxed);
+
+            if (segment->records == 0 && !last) {
+                unlink(segment->path.c_str());
+                continue;
+            }
+            segments_.push_back(segment);
+            if (last) active_ = segment;
+        }
+        remove_segments(trim_locked());
+        if (!segments_.empty()) {
+            LOG_INFO("Message log: recovered %llu messages in %zu segments from %s",
+                     (unsigned long long)stored_.load(), segments_.size(), directory_.c_str());
+        }
+        return true;
+    }
+
+    // Where a scan for messages at or after from_ms starts: the last index
+    // entry before from_ms. Called with segments_mutex_ held.
+    static void locate(const vector<shared_ptr<Segment>>& segments, int64_t from_ms, size_t& first, size_t& offset) {
+        for (size_t s = segments.size(); s-- > 0;) {
+            const vector<IndexEntry>& index = segments[s]->index;
+            if (index.empty() || index.front().timestamp_ms >= from_ms) continue;
+            auto after = lower_bound(index.begin(), index.end(), from_ms,
+                                     [](const IndexEntry& entry, int64_t ms) { return entry.timestamp_ms < ms; });
+            first = s;
+            offset = (after - 1)->offset;
+            return;
+        }
+        first = 0;
+        offset = 0;
+    }
+
+    // The room's last `limit` messages as (segment, offset), oldest first,
+    // straight from the per-room offsets. Called with segments_mutex_ held.
+    static void pick_last(const vector<shared_ptr<Segment>>& segments, const string& room, size_t limit,
+                          vector<pair<size_t, size_t>>& picked) {
+        for (size_t s = segments.size(); s-- > 0 && picked.size() < limit;) {
+            auto found = segments[s]->rooms.find(room);
+            if (found == segments[s]->rooms.end()) continue;
+            const vector<size_t>& offsets = found->second;
+            for (size_t i = offsets.size(); i-- > 0 && picked.size() < limit;) picked.push_back(make_pair(s, offsets[i]));
+        }
+        reverse(picked.begin(), picked.end());
+    }
+
+    // Run f(offset, header) on the complete records from `begin` on until
+    // it returns false
+    template <typename F>
+    static void scan(const Segment& segment, size_t begin, F f) {
+        size_t end = segment.end.load(memory_order_acquire);
+        RecordHeader header;
+        for (size_t offset = begin; offset < end; offset += record_size(header.room_length, header.payload_length)) {
+            memcpy(&header, segment.base + offset, sizeof(header));
+            if (!f(offset, header)) return;
+        }
+    }
+
+    static bool in_room(const Segment& segment, size_t offset, const RecordHeader& header, const string& room) {
+        return header.room_length == room.size() &&
+               memcmp(segment.base + offset + sizeof(header), room.data(), room.size()) == 0;
+    }
+
+    template <typename F>
+    static void emit(const Segment& segment, size_t offset, const RecordHeader& header, F& f) {
+        Record record;
+        record.seq = header.seq;
+        record.timestamp_ms = header.timestamp_ms;
+        record.client_id = header.client_id;
+        record.payload = segment.base + offset + sizeof(header) + header.room_length;
+        record.payload_length = header.payload_length;
+        f(record);
+    }
+
+    RoomDirectory& rooms_;
+    string directory_;
+    size_t segment_bytes_;
+    size_t max_segments_;
+
+    // Appender only (and open(), before the appender starts)
+    shared_ptr<Segment> active_;
+    uint64_t next_seq_;
+    int64_t last_timestamp_;
+    vector<string> room_names_;
+
+    pthread_t thread_;
+    bool running_;                      // guarded by queue_mutex_ once started
+    pthread_mutex_t queue_mutex_;       // guards pending_
+    pthread_cond_t queue_cv_;
+    vector<Pending> pending_;
+
+    pthread_mutex_t segments_mutex_;    // guards segments_ and their indexes
+    vector<shared_ptr<Segment>> segments_;
+
+    atomic<uint64_t> stored_;
+    atomic<uint64_t> dropped_;
+};
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <new>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <pthread.h>
+
+using namespace std;
+
+// Pooled, reference-counted message buffers for the chat hot path.
+//
+// A message is encoded once into a PooledBuffer and shared by every queue it
+// is placed on through BufferRef handles. When the last handle goes away the
+// buffer returns to the pool instead of the heap, so steady-state traffic
+// does no allocation at all. Each thread keeps a small free list per size
+// class; surplus buffers move to a shared list in batches, which is the only
+// place a lock is taken.
+
+struct PooledBuffer {
+    atomic<uint32_t> refs;
+    uint32_t size;         // bytes in use
+    uint32_t capacity;     // bytes available after the header
+    uint8_t size_class;
+    PooledBuffer* next_free;
+
+    char* data() { return reinterpret_cast<char*>(this + 1); }
+};
+
+class MessagePool {
+public:
+    static const int CLASS_COUNT = 4;
+    static const size_t LOCAL_CACHE_MAX = 256;  // buffers per class kept per thread
+
+    static MessagePool& instance() {
+        static MessagePool pool;
+        return pool;
+    }
+
+    static size_t class_capacity(int size_class) {
+        static const size_t capacities[CLASS_COUNT] = {512, 4096, 32768, 131072};
+        return capacities[size_class];
+    }
+
+    // Returns a buffer with refs == 1 and at least min_capacity bytes, or
+    // nullptr if min_capacity exceeds the largest size class
+    PooledBuffer* acquire(size_t min_capacity) {
+        int size_class = 0;
+        while (size_class < CLASS_COUNT && class_capacity(size_class) < min_capacity) size_class++;
+        if (size_class == CLASS_COUNT) return nullptr;
+
+        LocalCache& cache = local_cache();
+        FreeList& local = cache.lists[size_class];
+        if (local.head == nullptr) refill(local, size_class);
+
+        PooledBuffer* buffer = local.head;
+        if (buffer != nullptr) {
+            local.head = buffer->next_free;
+            local.count--;
+        } else {
+            void* memory = ::operator new(sizeof(PooledBuffer) + class_capacity(size_class));
+            buffer = new (memory) PooledBuffer();
+            buffer->capacity = (uint32_t)class_capacity(size_class);
+            buffer->size_class = (uint8_t)size_class;
+            allocated_.fetch_add(1, memory_order_relaxed);
+        }
+        buffer->refs.store(1, memory_order_relaxed);
+        buffer->size = 0;
+        buffer->next_free = nullptr;
+        return buffer;
+    }
+
+    void release(PooledBuffer* buffer) {
+        FreeList& local = local_cache().lists[buffer->size_class];
+        buffer->next_free = local.head;
+        local.head = buffer;
+        local.count++;
+        if (local.count > LOCAL_CACHE_MAX) spill(local, buffer->size_class, LOCAL_CACHE_MAX / 2);
+    }
+
+    // Buffers ever taken from the heap (grows only during warm-up)
+    uint64_t allocated() const { return allocated_.load(memory_order_relaxed); }
+
+private:
+    struct FreeList {
+        PooledBuffer* head;
+        size_t count;
+        FreeList() : head(nullptr), count(0) {}
+    };
+
+    // Hands the thread's cached buffers back to the shared lists on exit
+    struct LocalCache {
+        FreeList lists[CLASS_COUNT];
+        MessagePool* owner;
+        LocalCache() : owner(nullptr) {}
+        ~LocalCache() {
+            if (owner == nullptr) return;
+            for (int i = 0; i < CLASS_COUNT; i++) owner->spill(lists[i], i, 0);
+        }
+    };
+
+    MessagePool() : allocated_(0) {
+        pthread_mutex_init(&shared_mutex_, NULL);
+    }
+
+    LocalCache& local_cache() {
+        static thread_local LocalCache cache;
+        cache.owner = this;
+        return cache;
+    }
+
+    // Move all but `keep` buffers from a thread list to the shared list
+    void spill(FreeList& local, int size_class, size_t keep) {
+        if (local.count <= keep) return;
+        PooledBuffer* first = local.head;
+        PooledBuffer* last = first;
+        size_t moved = 1;
+        while (local.count - moved > keep) {
+            last = last->next_free;
+            moved++;
+        }
+        local.head = last->next_free;
+        local.count -= moved;
+
+        pthread_mutex_lock(&shared_mutex_);
+        last->next_free = shared_[size_class].head;
+        shared_[size_class].head = first;
+        shared_[size_class].count += moved;
+        pthread_mutex_unlock(&shared_mutex_);
+    }
+
+    // Pull up to half a cache worth of buffers from the shared list
+    void refill(FreeList& local, int size_class) {
+        pthread_mutex_lock(&shared_mutex_);
+        FreeList& shared = shared_[size_class];
+        size_t want = LOCAL_CACHE_MAX / 2;
+        while (shared.head != nullptr && want-- > 0) {
+            PooledBuffer* buffer = shared.head;
+            shared.head = buffer->next_free;
+            shared.count--;
+            buffer->next_free = local.head;
+            local.head = buffer;
+            local.count++;
+        }
+        pthread_mutex_unlock(&shared_mutex_);
+    }
+
+    atomic<uint64_t> allocated_;
+    pthread_mutex_t shared_mutex_;
+    FreeList shared_[CLASS_COUNT];
+};
+
+// Shared handle to a pooled buffer. Copying bumps the reference count; the
+// buffer goes back to the pool when the last handle is destroyed.
+class BufferRef {
+public:
+    BufferRef() : buffer_(nullptr) {}
+
+    static BufferRef allocate(size_t min_capacity) {
+        BufferRef ref;
+        ref.buffer_ = MessagePool::instance().acquire(min_capacity);
+        return ref;
+    }
+
+    BufferRef(const BufferRef& other) : buffer_(other.buffer_) {
+        if (buffer_ != nullptr) buffer_->refs.fetch_add(1, memory_order_relaxed);
+    }
+
+    BufferRef(BufferRef&& other) noexcept : buffer_(other.buffer_) {
+        other.buffer_ = nullptr;
+    }
+
+    BufferRef& operator=(BufferRef other) noexcept {
+        PooledBuffer* tmp = buffer_;
+        buffer_ = other.buffer_;
+        other.buffer_ = tmp;
+        return *this;
+    }
+
+    ~BufferRef() { reset(); }
+
+    void reset() {
+        if (buffer_ != nullptr && buffer_->refs.fetch_sub(1, memory_order_acq_rel) == 1) {
+            MessagePool::instance().release(buffer_);
+        }
+        buffer_ = nullptr;
+    }
+
+    explicit operator bool() const { return buffer_ != nullptr; }
+
+    const char* data() const { return buffer_->data(); }
+    char* mutable_data() { return buffer_->data(); }
+    size_t size() const { return buffer_->size; }
+    size_t capacity() const { return buffer_->capacity; }
+    void set_size(size_t size) { buffer_->size = (uint32_t)size; }
+
+    // Handles sharing this buffer, including this one
+    uint32_t use_count() const { return buffer_->refs.load(memory_order_acquire); }
+
+    // Append bytes; the caller sized the buffer when allocating it
+    void append(const void* bytes, size_t len) {
+        memcpy(buffer_->data() + buffer_->size, bytes, len);
+        buffer_->size += (uint32_t)len;
+    }
+
+private:
+    PooledBuffer* buffer_;
+};
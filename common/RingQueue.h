@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+
+using namespace std;
+
+// Growable circular FIFO. Unlike deque it never frees or allocates storage
+// once it has reached its working size, so steady-state push/pop is
+// allocation free. Not thread-safe.
+template <typename T>
+class RingQueue {
+public:
+    RingQueue() : items_(nullptr), capacity_(0), head_(0), size_(0) {}
+    ~RingQueue() { delete[] items_; }
+
+    RingQueue(const RingQueue&) = delete;
+    RingQueue& operator=(const RingQueue&) = delete;
+
+    bool empty() const { return size_ == 0; }
+    size_t size() const { return size_; }
+
+    T& front() { return items_[head_]; }
+    T& back() { return items_[(head_ + size_ - 1) & (capacity_ - 1)]; }
+    T& operator[](size_t i) { return items_[(head_ + i) & (capacity_ - 1)]; }
+
+    void push_back(T item) {
+        if (size_ == capacity_) grow();
+        items_[(head_ + size_) & (capacity_ - 1)] = move(item);
+        size_++;
+    }
+
+    void pop_front() {
+        items_[head_] = T();
+        head_ = (head_ + 1) & (capacity_ - 1);
+        size_--;
+    }
+
+    void pop_back() {
+        back() = T();
+        size_--;
+    }
+
+    // Remove the element at position i by shifting the i elements in front
+    // of it back one place. O(1) for the second element.
+    void erase_at(size_t i) {
+        for (size_t j = i; j > 0; j--) {
+            (*this)[j] = move((*this)[j - 1]);
+        }
+        pop_front();
+    }
+
+    void clear() {
+        while (size_ > 0) pop_front();
+    }
+
+private:
+    void grow() {
+        size_t capacity = capacity_ == 0 ? 16 : capacity_ * 2;
+        T* items = new T[capacity];
+        for (size_t i = 0; i < size_; i++) {
+            items[i] = move((*this)[i]);
+        }
+        delete[] items_;
+        items_ = items;
+        capacity_ = capacity;
+        head_ = 0;
+    }
+
+    T* items_;
+    size_t capacity_;  // always a power of two
+    size_t head_;
+    size_t size_;
+};
@@ -0,0 +1,284 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+#include <pthread.h>
+
+#include "EpochReclaimer.h"
+
+using namespace std;
+
+// Chat rooms shared by the TCP and UDP servers.
+//
+// RoomDirectory turns room names into small ids. Every client starts in
+// the lobby (id 0); rooms are created on first join and their ids are never
+// reused, so an id can be carried around without holding any lock.
+//
+// RoomMembers is the subscription index: per room, a packed array of
+// 64-bit member words (a client pointer or a packed endpoint, never 0)
+// that a broadcast walks instead of the whole client table, so fan-out
+// costs O(room size). Like ClientRegistry, writers (join/leave) serialize
+// on a mutex and readers never lock: they walk the array inside an
+// EpochGuard, and arrays replaced by growth or compaction are retired to
+// the EpochReclaimer. A leave only clears its slot; the slot is reused by
+// the next join, and the array is compacted once more than half of it is
+// holes. A walk split into pieces that run on other threads, where one
+// EpochGuard cannot cover it, pins the array instead: a pinned array is
+// freed only after its last unpin(), and it never changes its layout, so
+// every piece sees the members where the pin found them.
+
+class RoomDirectory {
+public:
+    static const uint32_t LOBBY = 0;
+    static const uint32_t MAX_ROOMS = 65536;
+    static const size_t MAX_NAME = 32;
+
+    RoomDirectory() {
+        pthread_mutex_init(&mutex_, NULL);
+        ids_["lobby"] = LOBBY;
+        names_.push_back("lobby");
+    }
+
+    ~RoomDirectory() { pthread_mutex_destroy(&mutex_); }
+
+    RoomDirectory(const RoomDirectory&) = delete;
+    RoomDirectory& operator=(const RoomDirectory&) = delete;
+
+    // Letters, digits, '-', '_' and '.', at most MAX_NAME of them
+    static bool valid_name(const string& name) {
+        if (name.empty() || name.size() > MAX_NAME) return false;
+        for (char c : name) {
+            bool ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+                      c == '-' || c == '_' || c == '.';
+            if (!ok) return false;
+        }
+        return true;
+    }
+
+    // Id of the named room, created on first use. Returns false for an
+    // invalid name or once MAX_ROOMS rooms exist.
+    bool lookup(const string& name, uint32_t& id) {
+        if (!valid_name(name)) return false;
+        pthread_mutex_lock(&mutex_);
+        auto it = ids_.find(name);
+        bool found = it != ids_.end() || names_.size() < MAX_ROOMS;
+        if (it != ids_.end()) {
+            id = it->second;
+        } else if (found) {
+            id = (uint32_t)names_.size();
+            ids_[name] = id;
+            names_.push_back(name);
+        }
+        pthread_mutex_unlock(&mutex_);
+        return found;
+    }
+
+    string name(uint32_t id) {
+        pthread_mutex_lock(&mutex_);
+        string result = id < names_.size() ? names_[id] : string();
+        pthread_mutex_unlock(&mutex_);
+        return result;
+    }
+
+    size_t size() {
+        pthread_mutex_lock(&mutex_);
+        size_t count = names_.size();
+        pthread_mutex_unlock(&mutex_);
+        return count;
+    }
+
+private:
+    pthread_mutex_t mutex_;
+    unordered_map<string, uint32_t> ids_;
+    vector<string> names_;
+};
+
+class RoomMembers {
+public:
+    struct Slots {
+        size_t capacity;
+        atomic<size_t> used;        // high-water mark of slots handed out
+        atomic<uint64_t>* words;    // 0 marks a hole
+        atomic<size_t> pins;        // the room's own reference plus one per pin()
+
+        explicit Slots(size_t cap) : capacity(cap), used(0), pins(1) {
+            words = new atomic<uint64_t>[cap];
+            for (size_t i = 0; i < cap; i++) words[i].store(0, memory_order_relaxed);
+        }
+        ~Slots() { delete[] words; }
+    };
+
+    RoomMembers() {
+        pthread_mutex_init(&write_mutex_, NULL);
+        rooms_ = new atomic<Room*>[RoomDirectory::MAX_ROOMS];
+        for (uint32_t i = 0; i < RoomDirectory::MAX_ROOMS; i++) rooms_[i].store(nullptr, memory_order_relaxed);
+    }
+
+    ~RoomMembers() {
+        for (uint32_t i = 0; i < RoomDirectory::MAX_ROOMS; i++) {
+            Room* room = rooms_[i].load();
+            if (room == nullptr) continue;
+            delete room->slots.load();
+            delete room;
+        }
+        delete[] rooms_;
+        pthread_mutex_destroy(&write_mutex_);
+    }
+
+    RoomMembers(const RoomMembers&) = delete;
+    RoomMembers& operator=(const RoomMembers&) = delete;
+
+    // Returns false if the member is already in the room
+    bool join(uint32_t room_id, uint64_t member) {
+        pthread_mutex_lock(&write_mutex_);
+        Room* room = room_for_write(room_id);
+        bool added = room->positions.find(member) == room->positions.end();
+        if (added) {
+            size_t slot = take_slot(room);
+            room->slots.load(memory_order_relaxed)->words[slot].store(member, memory_order_release);
+            room->positions[member] = slot;
+            room->count.fetch_add(1, memory_order_relaxed);
+        }
+        pthread_mutex_unlock(&write_mutex_);
+        return added;
+    }
+
+    // Returns false if the member was not in the room
+    bool leave(uint32_t room_id, uint64_t member) {
+        pthread_mutex_lock(&write_mutex_);
+        Room* room = room_for_write(room_id);
+        auto it = room->positions.find(member);
+        bool removed = it != room->positions.end();
+        if (removed) {
+            room->slots.load(memory_order_relaxed)->words[it->second].store(0, memory_order_release);
+            room->free_slots.push_back(it->second);
+            room->positions.erase(it);
+            room->count.fetch_sub(1, memory_order_relaxed);
+            maybe_compact(room);
+        }
+        pthread_mutex_unlock(&write_mutex_);
+        return removed;
+    }
+
+    // Current members of the room; safe from any thread
+    size_t size(uint32_t room_id) const {
+        Room* room = rooms_[room_id].load(memory_order_acquire);
+        return room == nullptr ? 0 : room->count.load(memory_order_relaxed);
+    }
+
+    // Run f(uint64_t member) on every member of the room. Members joining
+    // or leaving during the walk may or may not be visited.
+    template <typename F>
+    void for_each(uint32_t room_id, F f) {
+        Room* room = rooms_[room_id].load(memory_order_acquire);
+        if (room == nullptr) return;
+        EpochGuard guard;
+        for_each_in(room->slots.load(memory_order_acquire), 0, SIZE_MAX, f);
+    }
+
+    // The room's current array, pinned for a walk split into pieces of up
+    // to slot_count() slots with for_each_in(); nullptr for a room nobody
+    // ever joined. Members joining or leaving after the pin may or may not
+    // be visited, but no member moves between pieces. Every pin must be
+    // released with unpin().
+    Slots* pin(uint32_t room_id) {
+        Room* room = rooms_[room_id].load(memory_order_acquire);
+        if (room == nullptr) return nullptr;
+        EpochGuard guard;
+        while (true) {
+            Slots* slots = room->slots.load(memory_order_acquire);
+            size_t pins = slots->pins.load(memory_order_relaxed);
+            while (pins > 0 && !slots->pins.compare_exchange_weak(pins, pins + 1, memory_order_acquire)) {}
+            if (pins > 0) return slots;
+            // Replaced and released since the load; the room has a newer one
+        }
+    }
+
+    static void unpin(Slots* slots) {
+        if (slots->pins.fetch_sub(1, memory_order_acq_rel) == 1) EpochReclaimer::instance().retire(slots);
+    }
+
+    // Slots [begin, end) of a pinned (or epoch-protected) array
+    template <typename F>
+    static void for_each_in(const Slots* slots, size_t begin, size_t end, F f) {
+        size_t used = slot_count(slots);
+        for (size_t i = begin; i < min(end, used); i++) {
+            uint64_t member = slots->words[i].load(memory_order_acquire);
+            if (member != 0) f(member);
+        }
+    }
+
+    static size_t slot_count(const Slots* slots) {
+        return min(slots->used.load(memory_order_acquire), slots->capacity);
+    }
+
+private:
+
+    // Rooms are allocated on first join and live as long as the index
+    struct Room {
+        atomic<size_t> count;
+        atomic<Slots*> slots;
+        vector<size_t> free_slots;                 // writer only
+        unordered_map<uint64_t, size_t> positions; // member -> slot, writer only
+
+        Room() : count(0), slots(new Slots(8)) {}
+    };
+
+    Room* room_for_write(uint32_t room_id) {
+        Room* room = rooms_[room_id].load(memory_order_relaxed);
+        if (room == nullptr) {
+            room = new Room();
+            rooms_[room_id].store(room, memory_order_release);
+        }
+        return room;
+    }
+
+    size_t take_slot(Room* room) {
+        if (!room->free_slots.empty()) {
+            size_t slot = room->free_slots.back();
+            room->free_slots.pop_back();
+            return slot;
+        }
+        Slots* slots = room->slots.load(memory_order_relaxed);
+        size_t used = slots->used.load(memory_order_relaxed);
+        if (used == slots->capacity) {
+            Slots* grown = new Slots(slots->capacity * 2);
+            for (size_t i = 0; i < used; i++) {
+                grown->words[i].store(slots->words[i].load(memory_order_relaxed), memory_order_relaxed);
+            }
+            grown->used.store(used, memory_order_relaxed);
+            room->slots.store(grown, memory_order_release);
+            unpin(slots);
+            slots = grown;
+        }
+        slots->used.store(used + 1, memory_order_release);
+        return used;
+    }
+
+    // Repack the members into a fresh array once holes outnumber them
+    void maybe_compact(Room* room) {
+        Slots* slots = room->slots.load(memory_order_relaxed);
+        size_t used = slots->used.load(memory_order_relaxed);
+        size_t count = room->positions.size();
+        if (used < 64 || count * 2 >= used) return;
+
+        size_t capacity = 8;
+        while (capacity < count * 2) capacity *= 2;
+        Slots* packed = new Slots(capacity);
+        size_t next = 0;
+        for (auto& entry : room->positions) {
+            packed->words[next].store(entry.first, memory_order_relaxed);
+            entry.second = next++;
+        }
+        packed->used.store(next, memory_order_relaxed);
+        room->free_slots.clear();
+        room->slots.store(packed, memory_order_release);
+        unpin(slots);
+    }
+
+    atomic<Room*>* rooms_;   // indexed by room id
+    pthread_mutex_t write_mutex_;
+};
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <pthread.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Server counters shared by the TCP and UDP servers.
+//
+// Every thread that counts something owns a cache-line aligned block of
+// counters and is its only writer, so add() is a plain relaxed
+// load/store with no lock and no contended cache line. Readers sum all
+// blocks. A sampler thread snapshots the totals once a second into a
+// small ring, from which one-second and one-minute rates are derived;
+// readers never wait on it.
+
+enum MetricCounter {
+    METRIC_MESSAGES_IN,
+    METRIC_MESSAGES_OUT,
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    METRIC_BROADCASTS,    // broadcast messages originated
+    METRIC_FANOUT,        // copies queued for recipients across all broadcasts
+    METRIC_DISCONNECTS,
+    METRIC_SEND_ERRORS,
+    METRIC_SEND_SYSCALLS, // syscalls that put data on the wire (sendmsg/sendto/io_uring_enter)
+    METRIC_ZEROCOPY_SENDS,  // sends that asked for zero-copy transmission
+    METRIC_ZEROCOPY_COPIED, // ... of which the kernel copied the data anyway
+    METRIC_COUNT
+};
+
+struct MetricSnapshot {
+    uint64_t values[METRIC_COUNT];
+};
+
+class ServerMetrics {
+public:
+    static const int MAX_THREADS = 256;
+    static const int HISTORY = 64;  // one-second samples kept, > 60 for the minute rate
+
+    static ServerMetrics& instance() {
+        static ServerMetrics metrics;
+        return metrics;
+    }
+
+    void add(MetricCounter counter, uint64_t amount = 1) {
+        atomic<uint64_t>& value = thread_block()->values[counter];
+        value.store(value.load(memory_order_relaxed) + amount, memory_order_relaxed);
+    }
+
+    MetricSnapshot snapshot() const {
+        MetricSnapshot total = {};
+        int count = block_count_.load(memory_order_acquire);
+        for (int i = 0; i < count; i++) {
+            for (int c = 0; c < METRIC_COUNT; c++) {
+                total.values[c] += blocks_[i].values[c].load(memory_order_relaxed);
+            }
+        }
+        return total;
+    }
+
+    // Per-second rate of a counter over the last `seconds` seconds (1..60),
+    // or over the whole uptime while fewer samples exist
+    double rate(MetricCounter counter, int seconds) const {
+        uint64_t newest_tick = ticks_.load(memory_order_acquire);
+        if (newest_tick == 0) return 0;
+        int span = (int)min<uint64_t>((uint64_t)seconds, newest_tick);
+
+        uint64_t newer, older;
+        if (!read_sample(newest_tick, counter, newer) || !read_sample(newest_tick - span, counter, older)) {
+            return 0;
+        }
+        return (double)(newer - older) / span;
+    }
+
+    // Counter lines appended to the MSG_STATS replies; returns snprintf's length
+    int format_report(char* out, size_t capacity) const {
+        MetricSnapshot now = snapshot();
+        const uint64_t* v = now.values;
+        double avg_fanout = v[METRIC_BROADCASTS] == 0 ? 0 : (double)v[METRIC_FANOUT] / v[METRIC_BROADCASTS];
+        return snprintf(out, capacity,
+                        "\n Messages: in %llu, out %llu (1s: %.0f/s in, %.0f/s out; 1m: %.1f/s in, %.1f/s out)"
+                        "\n Bytes: in %llu, out %llu (1s: %.0f/s in, %.0f/s out; 1m: %.0f/s in, %.0f/s out)"
+                        "\n Broadcasts: %llu, fan-out %llu (avg %.1f recipients)"
+                        "\n Disconnects: %llu, send errors: %llu, send syscalls: %llu"
+                        "\n Zero-copy sends: %llu (%llu copied by the kernel)",
+                        (unsigned long long)v[METRIC_MESSAGES_IN], (unsigned long long)v[METRIC_MESSAGES_OUT],
+                        rate(METRIC_MESSAGES_IN, 1), rate(METRIC_MESSAGES_OUT, 1),
+                        rate(METRIC_MESSAGES_IN, 60), rate(METRIC_MESSAGES_OUT, 60),
+                        (unsigned long long)v[METRIC_BYTES_IN], (unsigned long long)v[METRIC_BYTES_OUT],
+                        rate(METRIC_BYTES_IN, 1), rate(METRIC_BYTES_OUT, 1),
+                        rate(METRIC_BYTES_IN, 60), rate(METRIC_BYTES_OUT, 60),
+                        (unsigned long long)v[METRIC_BROADCASTS], (unsigned long long)v[METRIC_FANOUT], avg_fanout,
+                        (unsigned long long)v[METRIC_DISCONNECTS], (unsigned long long)v[METRIC_SEND_ERRORS],
+                        (unsigned long long)v[METRIC_SEND_SYSCALLS],
+                        (unsigned long long)v[METRIC_ZEROCOPY_SENDS], (unsigned long long)v[METRIC_ZEROCOPY_COPIED]);
+    }
+
+    ~ServerMetrics() {
+        running_.store(false);
+        pthread_join(sampler_, NULL);
+    }
+
+private:
+    struct alignas(64) Block {
+        atomic<uint64_t> values[METRIC_COUNT];
+    };
+
+    // Written by the sampler only; version is odd while a write is in progress
+    struct Sample {
+        atomic<uint64_t> version;
+        atomic<uint64_t> tick;
+        atomic<uint64_t> values[METRIC_COUNT];
+    };
+
+    ServerMetrics() : block_count_(0), ticks_(0), running_(true) {
+        for (int i = 0; i < MAX_THREADS; i++) {
+            for (int c = 0; c < METRIC_COUNT; c++) blocks_[i].values[c].store(0, memory_order_relaxed);
+        }
+        for (int i = 0; i < HISTORY; i++) {
+            history_[i].version.store(0, memory_order_relaxed);
+            history_[i].tick.store(0, memory_order_relaxed);
+            for (int c = 0; c < METRIC_COUNT; c++) history_[i].values[c].store(0, memory_order_relaxed);
+        }
+        pthread_create(&sampler_, NULL, sampler_thread, this);
+    }
+
+    // Blocks outlive their threads so totals never go backwards
+    Block* thread_block() {
+        static thread_local Block* block = nullptr;
+        if (block == nullptr) {
+            int index = block_count_.fetch_add(1);
+            if (index >= MAX_THREADS) {
+                cerr << "ServerMetrics: more than " << MAX_THREADS << " threads" << endl;
+                abort();
+            }
+            block = &blocks_[index];
+        }
+        return block;
+    }
+
+    bool read_sample(uint64_t tick, MetricCounter counter, uint64_t& value) const {
+        const Sample& sample = history_[tick % HISTORY];
+        for (int attempt = 0; attempt < 4; attempt++) {
+            uint64_t before = sample.version.load(memory_order_acquire);
+            if (before & 1) continue;
+            uint64_t sample_tick = sample.tick.load(memory_order_relaxed);
+            value = sample.values[counter].load(memory_order_relaxed);
+            atomic_thread_fence(memory_order_acquire);
+            if (sample.version.load(memory_order_relaxed) == before) return sample_tick == tick;
+        }
+        return false;
+    }
+
+    // Tick 0 is the all-zero state at startup; tick n is taken n seconds later
+    static void* sampler_thread(void* arg) {
+        ServerMetrics* self = static_cast<ServerMetrics*>(arg);
+        while (self->running_.load()) {
+            for (int i = 0; i < 10 && self->running_.load(); i++) usleep(100000);
+
+            MetricSnapshot now = self->snapshot();
+            uint64_t tick = self->ticks_.load(memory_order_relaxed) + 1;
+            Sample& sample = self->history_[tick % HISTORY];
+            uint64_t version = sample.version.load(memory_order_relaxed);
+            sample.version.store(version + 1, memory_order_relaxed);
+            atomic_thread_fence(memory_order_release);
+            sample.tick.store(tick, memory_order_relaxed);
+            for (int c = 0; c < METRIC_COUNT; c++) sample.values[c].store(now.values[c], memory_order_relaxed);
+            sample.version.store(version + 2, memory_order_release);
+            self->ticks_.store(tick, memory_order_release);
+        }
+        return nullptr;
+    }
+
+    Block blocks_[MAX_THREADS];
+    atomic<int> block_count_;
+    Sample history_[HISTORY];
+    atomic<uint64_t> ticks_;   // newest complete sample
+    atomic<bool> running_;
+    pthread_t sampler_;
+};
+
+inline void metric_add(MetricCounter counter, uint64_t amount = 1) {
+    ServerMetrics::instance().add(counter, amount);
+}
@@ -0,0 +1,299 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "MessagePool.h"
+#include "RingQueue.h"
+
+using namespace std;
+
+// Fixed pool of worker threads with per-worker deques and work stealing.
+//
+// A worker pushes the tasks it spawns onto the back of its own deque and
+// pops from the back, newest first while the data is still in its cache.
+// An idle worker steals from the front of another worker's deque, taking
+// the oldest task. Tasks submitted from outside the pool (reactors, receive
+// loops) go to a shared injection queue. Each deque has its own mutex, which
+// is contended only while a thief is at it; idle workers sleep on a
+// condition variable that submitters signal only when someone is asleep.
+//
+// submit_ordered() runs tasks that share a key one at a time and in
+// submission order. Keys hash onto a fixed set of lanes; a lane is
+// scheduled as a single task that drains it, so different keys (usually on
+// different lanes) still spread over all workers.
+//
+// A Task is a small value -- a function, a pooled buffer and two words of
+// argument -- stored in RingQueues, so steady-state submission does not
+// allocate.
+
+struct Task {
+    void (*run)(Task& task);
+    BufferRef buffer;   // released once the task has run
+    uint64_t arg;
+    void* context;
+};
+
+class TaskScheduler {
+public:
+    static const int LANES = 1024;     // power of two
+    static const int LANE_BATCH = 32;  // tasks a lane runs before yielding its worker
+
+    explicit TaskScheduler(int worker_count)
+        : workers_(worker_count), queued_(0), unfinished_(0), sleepers_(0), running_(true) {
+        pthread_mutex_init(&inject_mutex_, NULL);
+        pthread_mutex_init(&idle_mutex_, NULL);
+        pthread_cond_init(&idle_cv_, NULL);
+        for (int i = 0; i < LANES; i++) {
+            pthread_mutex_init(&lanes_[i].mutex, NULL);
+            lanes_[i].scheduled = false;
+            lanes_[i].owner = this;
+        }
+        for (int i = 0; i < worker_count; i++) {
+            workers_[i] = new Worker(this, i);
+        }
+        for (Worker* worker : workers_) {
+            if (pthread_create(&worker->thread, NULL, worker_thread, worker) != 0) {
+                cerr << "TaskScheduler: failed to start worker " << worker->index << endl;
+                abort();
+            }
+        }
+    }
+
+    // Runs whatever is still queued, then stops the workers
+    ~TaskScheduler() {
+        pthread_mutex_lock(&idle_mutex_);
+        running_.store(false);
+        pthread_cond_broadcast(&idle_cv_);
+        pthread_mutex_unlock(&idle_mutex_);
+        for (Worker* worker : workers_) {
+            pthread_join(worker->thread, NULL);
+            pthread_mutex_destroy(&worker->mutex);
+            delete worker;
+        }
+        for (int i = 0; i < LANES; i++) pthread_mutex_destroy(&lanes_[i].mutex);
+        pthread_cond_destroy(&idle_cv_);
+        pthread_mutex_destroy(&idle_mutex_);
+        pthread_mutex_destroy(&inject_mutex_);
+    }
+
+    TaskScheduler(const TaskScheduler&) = delete;
+    TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+    int worker_count() const { return (int)workers_.size(); }
+
+    // Run the task on any worker, with no ordering against other tasks
+    void submit(Task task) {
+        Worker* self = current_worker();
+        enqueue(move(task), (self != nullptr && self->owner == this) ? self : nullptr);
+    }
+
+    // Run the task after every task submitted earlier with the same key
+    void submit_ordered(uint64_t key, Task task) {
+        Lane& lane = lanes_[(key * 0x9E3779B97F4A7C15ULL) >> (64 - LANE_BITS)];
+        pthread_mutex_lock(&lane.mutex);
+        lane.tasks.push_back(move(task));
+        bool schedule = !lane.scheduled;
+        lane.scheduled = true;
+        pthread_mutex_unlock(&lane.mutex);
+
+        if (schedule) submit(Task{run_lane, BufferRef(), 0, &lane});
+    }
+
+    // Wait until every task submitted so far, and every task those spawn,
+    // has run. Only meaningful once nothing outside the pool submits any
+    // more (the TCP server's hot upgrade pauses its reactors first).
+    void wait_idle() const {
+        while (unfinished_.load(memory_order_acquire) > 0) usleep(1000);
+    }
+
+    // Scheduler line appended to the MSG_STATS replies; the spread between
+    // the busiest and the idlest worker shows how evenly work is balanced
+    int format_report(char* out, size_t capacity) const {
+        uint64_t total = 0, stolen = 0, least = ~0ULL, most = 0;
+        for (const Worker* worker : workers_) {
+            uint64_t run = worker->tasks_run.load(memory_order_relaxed);
+            total += run;
+            stolen += worker->tasks_stolen.load(memory_order_relaxed);
+            least = min(least, run);
+            most = max(most, run);
+        }
+        return snprintf(out, capacity, "\n Scheduler: %d workers, tasks %llu (per worker %llu-%llu), stolen %llu",
+                        worker_count(), (unsigned long long)total, (unsigned long long)least,
+                        (unsigned long long)most, (unsigned long long)stolen);
+    }
+
+private:
+    static const int LANE_BITS = 10;  // log2(LANES)
+
+    struct alignas(64) Worker {
+        TaskScheduler* owner;
+        int index;
+        pthread_t thread;
+        pthread_mutex_t mutex;       // guards tasks
+        RingQueue<Task> tasks;
+        unsigned next_victim;        // where the next steal attempt starts
+        atomic<uint64_t> tasks_run;    // written by this worker only
+        atomic<uint64_t> tasks_stolen;
+
+        Worker(TaskScheduler* scheduler, int idx)
+            : owner(scheduler), index(idx), next_victim(idx + 1), tasks_run(0), tasks_stolen(0) {
+            pthread_mutex_init(&mutex, NULL);
+        }
+    };
+
+    struct alignas(64) Lane {
+        pthread_mutex_t mutex;       // guards tasks and scheduled
+        RingQueue<Task> tasks;
+        bool scheduled;              // a run_lane task is queued or running
+        TaskScheduler* owner;
+    };
+
+    static Worker*& current_worker() {
+        static thread_local Worker* worker = nullptr;
+        return worker;
+    }
+
+    static void* worker_thread(void* arg) {
+        Worker* worker = static_cast<Worker*>(arg);
+        current_worker() = worker;
+        worker->owner->work(worker);
+        return nullptr;
+    }
+
+    // Onto the worker's own deque, or the injection queue if local is null
+    void enqueue(Task task, Worker* local) {
+        if (local != nullptr) {
+            pthread_mutex_lock(&local->mutex);
+            local->tasks.push_back(move(task));
+            pthread_mutex_unlock(&local->mutex);
+        } else {
+            pthread_mutex_lock(&inject_mutex_);
+            injected_.push_back(move(task));
+            pthread_mutex_unlock(&inject_mutex_);
+        }
+
+        // Pairs with the sleeper's increment-then-check in wait_for_work()
+        unfinished_.fetch_add(1, memory_order_relaxed);
+        queued_.fetch_add(1, memory_order_seq_cst);
+        if (sleepers_.load(memory_order_seq_cst) > 0) {
+            pthread_mutex_lock(&idle_mutex_);
+            pthread_cond_signal(&idle_cv_);
+            pthread_mutex_unlock(&idle_mutex_);
+        }
+    }
+
+    void work(Worker* self) {
+        while (true) {
+            Task task;
+            if (pop_local(self, task) || pop_injected(task) || steal(self, task)) {
+                queued_.fetch_sub(1, memory_order_relaxed);
+                task.run(task);
+                if (task.run != run_lane) count_run(self); // lanes count their own tasks
+                unfinished_.fetch_sub(1, memory_order_release); // a requeued lane was counted first
+                continue;
+            }
+            if (!wait_for_work()) return;
+        }
+    }
+
+    static void count_run(Worker* self) {
+        self->tasks_run.store(self->tasks_run.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    }
+
+    bool pop_local(Worker* self, Task& task) {
+        pthread_mutex_lock(&self->mutex);
+        bool found = !self->tasks.empty();
+        if (found) {
+            task = move(self->tasks.back());
+            self->tasks.pop_back();
+        }
+        pthread_mutex_unlock(&self->mutex);
+        return found;
+    }
+
+    bool pop_injected(Task& task) {
+        pthread_mutex_lock(&inject_mutex_);
+        bool found = !injected_.empty();
+        if (found) {
+            task = move(injected_.front());
+            injected_.pop_front();
+        }
+        pthread_mutex_unlock(&inject_mutex_);
+        return found;
+    }
+
+    // One pass over the other workers, starting where the last pass left off
+    bool steal(Worker* self, Task& task) {
+        unsigned count = (unsigned)worker_count();
+        unsigned start = self->next_victim++;
+        for (unsigned attempt = 0; attempt < count; attempt++) {
+            Worker* victim = workers_[(start + attempt) % count];
+            if (victim == self) continue;
+
+            pthread_mutex_lock(&victim->mutex);
+            bool found = !victim->tasks.empty();
+            if (found) {
+                task = move(victim->tasks.front());
+                victim->tasks.pop_front();
+            }
+            pthread_mutex_unlock(&victim->mutex);
+            if (found) {
+                self->tasks_stolen.store(self->tasks_stolen.load(memory_order_relaxed) + 1, memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Sleep until a task is submitted. Returns false once the scheduler is
+    // shutting down and nothing is left to run.
+    bool wait_for_work() {
+        pthread_mutex_lock(&idle_mutex_);
+        sleepers_.fetch_add(1, memory_order_seq_cst);
+        while (queued_.load(memory_order_seq_cst) <= 0 && running_.load()) {
+            pthread_cond_wait(&idle_cv_, &idle_mutex_);
+        }
+        sleepers_.fetch_sub(1, memory_order_relaxed);
+        bool keep_going = running_.load() || queued_.load() > 0;
+        pthread_mutex_unlock(&idle_mutex_);
+        return keep_going;
+    }
+
+    // Drain up to LANE_BATCH tasks of one lane, then requeue it at the back
+    // of the injection queue, behind other lanes, if more are waiting
+    static void run_lane(Task& self) {
+        Lane* lane = static_cast<Lane*>(self.context);
+        for (int i = 0; i < LANE_BATCH; i++) {
+            pthread_mutex_lock(&lane->mutex);
+            if (lane->tasks.empty()) {
+                lane->scheduled = false;
+                pthread_mutex_unlock(&lane->mutex);
+                return;
+            }
+            Task task = move(lane->tasks.front());
+            lane->tasks.pop_front();
+            pthread_mutex_unlock(&lane->mutex);
+            task.run(task);
+            count_run(current_worker());
+        }
+        lane->owner->enqueue(Task{run_lane, BufferRef(), 0, lane}, nullptr);
+    }
+
+    vector<Worker*> workers_;
+    pthread_mutex_t inject_mutex_;   // guards injected_
+    RingQueue<Task> injected_;
+    Lane lanes_[LANES];
+    atomic<int64_t> queued_;         // tasks in any deque; may dip below 0 briefly
+    atomic<int64_t> unfinished_;     // tasks queued or running
+    atomic<int> sleepers_;
+    atomic<bool> running_;
+    pthread_mutex_t idle_mutex_;
+    pthread_cond_t idle_cv_;
+};
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+
+// Hierarchical timing wheel for the servers' per-client timers (idle
+// timeouts and keepalive probes), owned and advanced by a single thread.
+//
+// Time is counted in ticks of tick_ms. Level 0 has one slot per tick for the
+// next SLOTS ticks; each level above covers SLOTS times the span of the one
+// below with the same number of slots. A timer goes into the level whose
+// span holds its deadline, and whenever level 0 wraps around, the next slot
+// of level 1 is cascaded down (and so on up), so every timer moves at most
+// LEVELS - 1 times. Timers are intrusive list nodes: schedule and cancel are
+// O(1), and a tick touches only the timers that expire or cascade in it, so
+// the wheel costs nothing per tick for timers that are far away, however
+// many there are.
+//
+// Deadlines are rounded up to whole ticks; a timer never fires early.
+// Deadlines past the top level's span (64^4 ticks) are clamped to it.
+
+inline int64_t monotonic_ms() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+struct WheelTimer {
+    WheelTimer* prev;
+    WheelTimer* next;
+    uint64_t expires; // tick
+    uint64_t data;    // for the owner: which client this timer belongs to
+
+    WheelTimer() : prev(nullptr), next(nullptr), expires(0), data(0) {}
+    bool pending() const { return next != nullptr; }
+};
+
+class TimerWheel {
+public:
+    static const int LEVEL_BITS = 6;
+    static const int SLOTS = 1 << LEVEL_BITS;
+    static const int LEVELS = 4;
+
+    TimerWheel(int64_t tick_ms, int64_t now_ms)
+        : tick_ms_(tick_ms), now_((uint64_t)now_ms / tick_ms), count_(0) {
+        for (int level = 0; level < LEVELS; level++) {
+            for (int slot = 0; slot < SLOTS; slot++) {
+                WheelTimer& head = slots_[level][slot];
+                head.prev = head.next = &head;
+            }
+        }
+    }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    int64_t tick_ms() const { return tick_ms_; }
+    size_t size() const { return count_; }
+
+    // Fire the timer at deadline_ms (monotonic), replacing any pending deadline
+    void schedule(WheelTimer* timer, int64_t deadline_ms) {
+        if (timer->pending()) cancel(timer);
+        timer->expires = (uint64_t)(deadline_ms + tick_ms_ - 1) / tick_ms_;
+        link(timer);
+        count_++;
+    }
+
+    void cancel(WheelTimer* timer) {
+        if (!timer->pending()) return;
+        unlink(timer);
+        count_--;
+    }
+
+    // Move time forward to now_ms, calling f(WheelTimer*) on every timer that
+    // expires, in deadline order. f may schedule or cancel any timer,
+    // including the one it was given.
+    template <typename F>
+    void advance(int64_t now_ms, F f) {
+        uint64_t target = (uint64_t)now_ms / tick_ms_;
+        if (count_ == 0 && target > now_) now_ = target;
+        while (now_ < target) {
+            now_++;
+            cascade();
+            WheelTimer& head = slots_[0][now_ & (SLOTS - 1)];
+            while (head.next != &head) {
+                WheelTimer* timer = head.next;
+                unlink(timer);
+                count_--;
+                f(timer);
+            }
+        }
+    }
+
+private:
+    void link(WheelTimer* timer) {
+        uint64_t expires = timer->expires > now_ ? timer->expires : now_ + 1;
+        uint64_t delta = expires - now_;
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= (1ULL << (LEVEL_BITS * (level + 1)))) level++;
+        if (delta >= (1ULL << (LEVEL_BITS * LEVELS))) expires = now_ + (1ULL << (LEVEL_BITS * LEVELS)) - 1;
+        timer->expires = expires;
+
+        WheelTimer& head = slots_[level][(expires >> (LEVEL_BITS * level)) & (SLOTS - 1)];
+        timer->prev = head.prev;
+        timer->next = &head;
+        head.prev->next = timer;
+        head.prev = timer;
+    }
+
+    static void unlink(WheelTimer* timer) {
+        timer->prev->next = timer->next;
+        timer->next->prev = timer->prev;
+        timer->prev = timer->next = nullptr;
+    }
+
+    // At the start of every level-l span, redistribute the level-(l+1) slot
+    // that covers it; those timers now fit a lower level
+    void cascade() {
+        for (int level = 1; level < LEVELS; level++) {
+            if ((now_ & ((1ULL << (LEVEL_BITS * level)) - 1)) != 0) return;
+            WheelTimer& head = slots_[level][(now_ >> (LEVEL_BITS * level)) & (SLOTS - 1)];
+            if (head.next == &head) continue;
+            // Splice the slot out first: relinking may land in the same level
+            WheelTimer moved;
+            moved.next = head.next;
+            moved.prev = head.prev;
+            moved.next->prev = &moved;
+            moved.prev->next = &moved;
+            head.prev = head.next = &head;
+            while (moved.next != &moved) {
+                WheelTimer* timer = moved.next;
+                unlink(timer);
+                link(timer);
+            }
+        }
+    }
+
+    int64_t tick_ms_;
+    uint64_t now_;   // last tick processed
+    size_t count_;
+    WheelTimer slots_[LEVELS][SLOTS]; // list heads
+};
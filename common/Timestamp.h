@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <ctime>
+
+// "HH:MM:SS.mmm" for the current local time, cached per thread. The text is
+// rebuilt at most once per millisecond; the expensive localtime_r() call
+// happens at most once per second. The returned pointer stays valid until
+// the calling thread's next call.
+inline const char* cached_timestamp() {
+    struct TimestampCache {
+        int64_t second;
+        int64_t millisecond;
+        char text[16];
+    };
+    static thread_local TimestampCache cache = {-1, -1, {0}};
+
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t millisecond = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    if (millisecond == cache.millisecond) return cache.text;
+
+    if (now.tv_sec != cache.second) {
+        time_t seconds = now.tv_sec;
+        struct tm local;
+        localtime_r(&seconds, &local);
+        snprintf(cache.text, sizeof(cache.text), "%02d:%02d:%02d.000",
+                 local.tm_hour % 100, local.tm_min % 100, local.tm_sec % 100);
+        cache.second = now.tv_sec;
+    }
+
+    int ms = (int)(millisecond % 1000);
+    cache.text[9] = (char)('0' + ms / 100);
+    cache.text[10] = (char)('0' + (ms / 10) % 10);
+    cache.text[11] = (char)('0' + ms % 10);
+    cache.millisecond = millisecond;
+    return cache.text;
+}
+
+// "HH:MM:SS.mmm" local time for a wall-clock time in milliseconds since the
+// epoch, e.g. one stored in the message log
+inline void format_timestamp(int64_t millisecond, char out[16]) {
+    time_t seconds = (time_t)(millisecond / 1000);
+    struct tm local;
+    localtime_r(&seconds, &local);
+    snprintf(out, 16, "%02d:%02d:%02d.%03u", local.tm_hour % 100, local.tm_min % 100, local.tm_sec % 100,
+             (unsigned)((uint64_t)millisecond % 1000));
+}
@@ -1,17 +1,49 @@
 #include "TCPCommon.h"
-#include <fcntl.h>
+#include "../common/Logger.h"
+#include "../common/HistoryQuery.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <map>
 
 using namespace std;
 
+// The client is a single poll() loop over the server socket and stdin:
+// server bytes are displayed as soon as they arrive, typed commands are
+// queued as encoded bytes and written whenever the socket accepts them.
+// Frames may arrive split across reads; the decoder keeps the remainder.
+
+static const int HELLO_TIMEOUT_MS = 1000; // how long to wait for a framing reply
+static const size_t OUTPUT_HIGH_WATER = 256 * 1024; // stop reading a file being sent above this
+
 // Global variables for client
 int client_socket = -1;
 bool client_running = true;
-pthread_mutex_t client_mutex = PTHREAD_MUTEX_INITIALIZER;
+TcpFrameDecoder decoder;   // bytes received from the server
+string pending_output;     // encoded messages not yet accepted by the socket
+size_t output_offset = 0;  // bytes of pending_output already written
+string input_line;         // stdin bytes up to the next newline
+bool input_done = false;   // stdin reached its end
 
-void print_debug(const string& message) {
-    cerr << "[DEBUG] " << message << endl;
-}
+// The file being sent with /sendfile, read only as fast as credit allows
+struct OutgoingStream {
+    int fd;
+    uint32_t stream_id;
+    uint64_t credit;  // DATA bytes the server currently accepts
+    uint64_t sent;
+    string name;
+};
+OutgoingStream* outgoing = nullptr;
+uint32_t next_stream_id = 1;
+
+// Files other clients are streaming to us, by sender id and stream id
+struct IncomingStream {
+    FILE* file;
+    string path;
+    uint64_t bytes;
+};
+map<uint64_t, IncomingStream> incoming;
 
 string get_timestamp() {
     auto now = chrono::system_clock::now();
@@ -25,149 +57,390 @@ string get_timestamp() {
     return ss.str();
 }
 
-void send_message(const TcpMessage& msg) {
-    pthread_mutex_lock(&client_mutex);
-    if (client_socket != -1) {
-        ssize_t bytes_sent = send(client_socket, &msg, sizeof(TcpMessage), 0);
-        if (bytes_sent == -1) {
-            print_debug("Failed to send message to server");
-        } else {
-            print_debug("Sent " + to_string(bytes_sent) + " bytes to server");
+void show_prompt() {
+    cout << "Enter command (/say <text> or /stats): ";
+    cout.flush();
+}
+
+void send_message(TcpMessageType type, const string& text) {
+    encode_message(pending_output, decoder.framed(), type, 0, text.data(), (uint32_t)text.size());
+    LOG_DEBUG("Queued %zu bytes for server", pending_output.size() - output_offset);
+}
+
+string stream_payload(uint32_t stream_id, uint32_t value) {
+    char bytes[8];
+    stream_put_u32(bytes, stream_id);
+    stream_put_u32(bytes + 4, value);
+    return string(bytes, sizeof(bytes));
+}
+
+void start_stream(const string& path) {
+    if (!decoder.framed()) {
+        cout << "Sending files needs a server that speaks the framed protocol" << endl;
+        return;
+    }
+    if (outgoing != nullptr) {
+        cout << "Already sending " << outgoing->name << endl;
+        return;
+    }
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd == -1 || fstat(fd, &info) == -1) {
+        cout << "Cannot open " << path << ": " << strerror(errno) << endl;
+        if (fd != -1) close(fd);
+        return;
+    }
+
+    outgoing = new OutgoingStream();
+    outgoing->fd = fd;
+    outgoing->stream_id = next_stream_id++;
+    outgoing->credit = 0; // nothing may be sent before the server's first grant
+    outgoing->sent = 0;
+    outgoing->name = path.substr(path.find_last_of('/') + 1);
+
+    uint64_t total = (uint64_t)info.st_size;
+    string payload = stream_payload(outgoing->stream_id, (uint32_t)(total >> 32));
+    char low[4];
+    stream_put_u32(low, (uint32_t)total);
+    payload.append(low, sizeof(low));
+    payload += outgoing->name;
+    send_message(MSG_STREAM_BEGIN, payload);
+    cout << "Sending " << outgoing->name << " (" << total << " bytes)..." << endl;
+}
+
+void finish_stream(uint32_t status) {
+    send_message(MSG_STREAM_END, stream_payload(outgoing->stream_id, status));
+    if (status == STREAM_COMPLETE) {
+        cout << "\n[SYSTEM] Sent " << outgoing->name << " (" << outgoing->sent << " bytes)" << endl;
+    } else {
+        cout << "\n[SYSTEM] Sending " << outgoing->name << " failed" << endl;
+    }
+    close(outgoing->fd);
+    delete outgoing;
+    outgoing = nullptr;
+}
+
+// Queue more of the outgoing file, limited by credit and by how much
+// output is still unsent
+void pump_stream() {
+    static char chunk[4 + TCP_STREAM_CHUNK];
+    while (outgoing != nullptr && outgoing->credit > 0 &&
+           pending_output.size() - output_offset < OUTPUT_HIGH_WATER) {
+        size_t want = min<uint64_t>(TCP_STREAM_CHUNK, outgoing->credit);
+        ssize_t n = read(outgoing->fd, chunk + 4, want);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            finish_stream(n == 0 ? STREAM_COMPLETE : STREAM_ABORTED);
+            show_prompt();
+            return;
+        }
+        stream_put_u32(chunk, outgoing->stream_id);
+        encode_message(pending_output, true, MSG_STREAM_DATA, 0, chunk, (uint32_t)(4 + n));
+        outgoing->credit -= n;
+        outgoing->sent += n;
+    }
+}
+
+// Stream frames from the server: credit and rejections for our own stream
+// (client_id 0), relayed streams from other clients otherwise
+void handle_stream_frame(const TcpFrame& frame) {
+    if (frame.payload_length < 4) return;
+    uint32_t stream_id = stream_get_u32(frame.payload);
+
+    if (frame.client_id == 0) {
+        if (outgoing == nullptr || outgoing->stream_id != stream_id || frame.payload_length < 8) return;
+        if (frame.type == MSG_STREAM_CREDIT) {
+            outgoing->credit += stream_get_u32(frame.payload + 4);
+        } else if (frame.type == MSG_STREAM_END) {
+            cout << "\n[SYSTEM] Server refused " << outgoing->name << " (another file is still being sent)" << endl;
+            close(outgoing->fd);
+            delete outgoing;
+            outgoing = nullptr;
+            show_prompt();
         }
+        return;
     }
-    pthread_mutex_unlock(&client_mutex);
-}
-
-TcpMessage receive_message() {
-    TcpMessage msg;
-    pthread_mutex_lock(&client_mutex);
-    if (client_socket != -1) {
-        // Set socket to non-blocking mode
-        int flags = fcntl(client_socket, F_GETFL, 0);
-        fcntl(client_socket, F_SETFL, flags | O_NONBLOCK);
-        
-        ssize_t bytes_received = recv(client_socket, &msg, sizeof(TcpMessage), 0);
-        
-        // Restore blocking mode
-        fcntl(client_socket, F_SETFL, flags);
-        
-        if (bytes_received <= 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // No data available, return empty message
-                msg.client_id = 0;
-                msg.type = MSG_CHAT;
-                memset(msg.payload, 0, sizeof(msg.payload));
+
+    uint64_t key = ((uint64_t)frame.client_id << 32) | stream_id;
+    auto it = incoming.find(key);
+    switch (frame.type) {
+        case MSG_STREAM_BEGIN: {
+            if (frame.payload_length < 12 || it != incoming.end()) return;
+            uint64_t total = ((uint64_t)stream_get_u32(frame.payload + 4) << 32) | stream_get_u32(frame.payload + 8);
+            string name(frame.payload + 12, frame.payload_length - 12);
+            replace(name.begin(), name.end(), '/', '_');
+            IncomingStream stream;
+            stream.path = "received_" + to_string(frame.client_id) + "_" + name;
+            stream.file = fopen(stream.path.c_str(), "wb");
+            stream.bytes = 0;
+            if (stream.file == nullptr) {
+                cout << "\n[SYSTEM] Cannot write " << stream.path << ": " << strerror(errno) << endl;
             } else {
-                msg.type = MSG_CHAT; // Invalid message type to indicate error
-                msg.client_id = -1;
+                cout << "\n[STREAM] Client " << frame.client_id << " is sending " << name << " ("
+                     << total << " bytes) -> " << stream.path << endl;
             }
-        } else {
-            print_debug("Received message: type=" + to_string(msg.type) + ", client_id=" + to_string(msg.client_id) + ", content=" + string(msg.payload));
+            incoming[key] = stream;
+            show_prompt();
+            break;
+        }
+
+        case MSG_STREAM_DATA:
+            if (it == incoming.end()) return;
+            if (it->second.file != nullptr) fwrite(frame.payload + 4, 1, frame.payload_length - 4, it->second.file);
+            it->second.bytes += frame.payload_length - 4;
+            break;
+
+        case MSG_STREAM_END: {
+            if (it == incoming.end()) return;
+            uint32_t status = frame.payload_length >= 8 ? stream_get_u32(frame.payload + 4) : 0;
+            if (it->second.file != nullptr) fclose(it->second.file);
+            cout << "\n[STREAM] " << (status == STREAM_COMPLETE ? "Received " : "Incomplete (sender aborted): ")
+                 << it->second.path << " (" << it->second.bytes << " bytes)" << endl;
+            incoming.erase(it);
+            show_prompt();
+            break;
         }
-    } else {
-        msg.client_id = -1;
     }
-    pthread_mutex_unlock(&client_mutex);
-    return msg;
 }
 
-void* receive_thread(void* /*arg*/) {
-    print_debug("Receive thread started");
-    
-    while (client_running) {
-        TcpMessage msg = receive_message();
-        
-        if (msg.client_id == -1) {
-            // Connection lost
-            cout << "\n[SYSTEM] Connection to server lost!" << endl;
-            client_running = false;
-            break;
-        } else if (msg.client_id == 0 && strlen(msg.payload) == 0) {
-            // No message received, just continue
-            usleep(100000); // Sleep for 100ms to avoid busy waiting
+// Write as much queued output as the socket takes. Returns false if the
+// connection is gone.
+bool flush_output() {
+    while (output_offset < pending_output.size()) {
+        ssize_t bytes_sent = send(client_socket, pending_output.data() + output_offset,
+                                  pending_output.size() - output_offset, MSG_NOSIGNAL);
+        if (bytes_sent == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            LOG_WARN("Failed to send message to server");
+            return false;
+        }
+        output_offset += bytes_sent;
+    }
+    pending_output.clear();
+    output_offset = 0;
+    return true;
+}
+
+// Read everything the socket has into the decoder. Returns false if the
+// connection is gone.
+bool receive_bytes() {
+    char buffer[16384];
+    while (true) {
+        ssize_t bytes_received = recv(client_socket, buffer, sizeof(buffer), 0);
+        if (bytes_received > 0) {
+            decoder.feed(buffer, bytes_received);
             continue;
         }
-        
-        // Display received message
-        cout << "\n[RECEIVED] " << msg.payload << endl;
-        cout << "Enter command (/say <text> or /stats): ";
-        cout.flush();
+        if (bytes_received == -1 && errno == EINTR) continue;
+        return bytes_received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
     }
-    
-    print_debug("Receive thread ended");
-    return nullptr;
 }
 
-void* input_thread(void* /*arg*/) {
-    print_debug("Input thread started");
-    
-    string input;
+void display_frame(const TcpFrame& frame) {
+    LOG_DEBUG("Received message: type=%u, client_id=%u, length=%u",
+              frame.type, frame.client_id, frame.payload_length);
+    cout << "\n[RECEIVED] " << string(frame.payload, frame.payload_length) << endl;
+    show_prompt();
+}
+
+// Display every complete frame buffered so far. A MSG_HELLO reply switches
+// the decoder to the framed protocol for all bytes after it. Returns false
+// on a corrupt stream.
+bool process_frames() {
+    TcpFrame frame;
+    int result;
+    while ((result = decoder.next(frame)) == 1) {
+        if (frame.type == MSG_HELLO) {
+            decoder.set_framed(true);
+            LOG_DEBUG("Server accepted framed protocol");
+        } else if (frame.type >= MSG_STREAM_BEGIN && frame.type <= MSG_STREAM_CREDIT) {
+            handle_stream_frame(frame);
+        } else if (frame.type == MSG_PING) {
+            send_message(MSG_PING, ""); // keepalive: show the server we are still here
+        } else if (frame.type == MSG_JOIN || frame.type == MSG_LEAVE ||
+                   (frame.type == MSG_HISTORY && frame.client_id == 0)) {
+            cout << "\n[SYSTEM] " << string(frame.payload, frame.payload_length) << endl;
+            show_prompt();
+        } else if (frame.type == MSG_HISTORY) {
+            cout << "\n[HISTORY] " << string(frame.payload, frame.payload_length) << endl;
+        } else {
+            display_frame(frame);
+        }
+    }
+    return result == 0;
+}
+
+void print_welcome() {
     cout << "TCP Chat Client Connected!" << endl;
     cout << "Commands:" << endl;
     cout << "  /say <text>  - Send chat message" << endl;
     cout << "  /stats       - Request server statistics" << endl;
+    cout << "  /join <room> - Move to a chat room (everyone starts in \"lobby\")" << endl;
+    cout << "  /leave       - Go back to the lobby" << endl;
+    cout << "  /history N   - Replay the room's last N messages" << endl;
+    cout << "  /history HH:MM[:SS] [HH:MM[:SS]] - Replay the room's messages from (to) a time today" << endl;
+    cout << "  /sendfile <path> - Stream a file to everyone else in the room" << endl;
     cout << "  /quit        - Disconnect from server" << endl;
-    cout << "Enter command (/say <text> or /stats): ";
-    cout.flush();
-    
+    show_prompt();
+}
+
+void handle_command(const string& input) {
+    if (input.empty()) {
+        show_prompt();
+
+    } else if (input.substr(0, 5) == "/say ") {
+        // Send chat message
+        string message_text = input.substr(5);
+        if (message_text.empty()) {
+            cout << "Please provide a message after /say" << endl;
+            show_prompt();
+            return;
+        }
+        send_message(MSG_CHAT, message_text);
+        show_prompt();
+
+    } else if (input == "/stats") {
+        // Request server statistics
+        send_message(MSG_STATS, "");
+        show_prompt();
+
+    } else if (input.substr(0, 6) == "/join ") {
+        send_message(MSG_JOIN, input.substr(6));
+        show_prompt();
+
+    } else if (input == "/leave") {
+        send_message(MSG_LEAVE, "");
+        show_prompt();
+
+    } else if (input.substr(0, 9) == "/history ") {
+        string request;
+        if (make_history_request(input.substr(9), request)) {
+            send_message(MSG_HISTORY, request);
+        } else {
+            cout << "Usage: /history N or /history HH:MM[:SS] [HH:MM[:SS]]" << endl;
+        }
+        show_prompt();
+
+    } else if (input.substr(0, 10) == "/sendfile ") {
+        start_stream(input.substr(10));
+        show_prompt();
+
+    } else if (input == "/quit") {
+        // Disconnect from server
+        cout << "Disconnecting from server..." << endl;
+        client_running = false;
+
+    } else {
+        cout << "Unknown command. Use /say <text> or /stats" << endl;
+        show_prompt();
+    }
+}
+
+// Split newly typed bytes into commands. End of input acts like /quit
+// once a file being sent has gone out.
+void read_input() {
+    char buffer[4096];
+    ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+    if (n == -1 && errno == EINTR) return;
+    if (n <= 0) {
+        input_done = true;
+        return;
+    }
+    input_line.append(buffer, n);
+
+    size_t start = 0, newline;
+    while (client_running && (newline = input_line.find('\n', start)) != string::npos) {
+        string line = input_line.substr(start, newline - start);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        handle_command(line);
+        start = newline + 1;
+    }
+    input_line.erase(0, start);
+}
+
+// Half-close and wait briefly for the server to finish. Closing with unread
+// bytes (say, late stream credit) would reset the connection and make the
+// server discard whatever we sent last.
+void close_gracefully() {
+    shutdown(client_socket, SHUT_WR);
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(HELLO_TIMEOUT_MS);
+    char buffer[4096];
+    while (true) {
+        int timeout = (int)chrono::duration_cast<chrono::milliseconds>(
+            deadline - chrono::steady_clock::now()).count();
+        struct pollfd pfd = {client_socket, POLLIN, 0};
+        if (timeout <= 0 || poll(&pfd, 1, timeout) <= 0) break;
+        ssize_t n = recv(client_socket, buffer, sizeof(buffer), 0);
+        if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) break;
+    }
+    close(client_socket);
+}
+
+// Offer the framed protocol, then serve the socket and stdin until either
+// side ends. Commands are only read once the server has answered the
+// offer, or after HELLO_TIMEOUT_MS for old servers that never answer (we
+// keep talking the legacy format with them).
+void run_client() {
+    send_message(MSG_HELLO, TCP_FRAMED_HELLO);
+    bool negotiating = true;
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(HELLO_TIMEOUT_MS);
+
     while (client_running) {
-        getline(cin, input);
-        
-        if (!client_running) break;
-        
-        if (input.empty()) {
-            cout << "Enter command (/say <text> or /stats): ";
-            cout.flush();
-            continue;
+        int timeout = -1;
+        if (negotiating) {
+            timeout = (int)chrono::duration_cast<chrono::milliseconds>(
+                deadline - chrono::steady_clock::now()).count();
+            if (decoder.framed() || timeout <= 0) {
+                if (!decoder.framed()) LOG_DEBUG("No protocol reply, using legacy fixed-size messages");
+                negotiating = false;
+                timeout = -1;
+                print_welcome();
+            }
+        }
+
+        struct pollfd fds[2];
+        fds[0].fd = client_socket;
+        fds[0].events = POLLIN | (output_offset < pending_output.size() ? POLLOUT : 0);
+        fds[0].revents = 0;
+        fds[1].fd = (negotiating || input_done) ? -1 : STDIN_FILENO;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+
+        int ready = poll(fds, 2, timeout);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            cerr << "poll failed: " << strerror(errno) << endl;
+            break;
         }
-        
-        TcpMessage msg;
-        
-        if (input.substr(0, 5) == "/say ") {
-            // Send chat message
-            string message_text = input.substr(5);
-            if (message_text.empty()) {
-                cout << "Please provide a message after /say" << endl;
-                cout << "Enter command (/say <text> or /stats): ";
-                cout.flush();
-                continue;
+
+        if (fds[0].revents & (POLLIN | POLLERR | POLLHUP)) {
+            bool connected = receive_bytes();
+            if (!process_frames()) {
+                cout << "\n[SYSTEM] Corrupt message from server!" << endl;
+                break;
             }
-            
-            msg.type = MSG_CHAT;
-            msg.client_id = 0; // Will be set by server
-            strncpy(msg.payload, message_text.c_str(), sizeof(msg.payload) - 1);
-            msg.payload_length = strlen(msg.payload);
-            
-            send_message(msg);
-            cout << "Enter command (/say <text> or /stats): ";
-            cout.flush();
-            
-        } else if (input == "/stats") {
-            // Request server statistics
-            msg.type = MSG_STATS;
-            msg.client_id = 0;
-            msg.payload_length = 0;
-            memset(msg.payload, 0, sizeof(msg.payload));
-            
-            send_message(msg);
-            cout << "Enter command (/say <text> or /stats): ";
-            cout.flush();
-            
-        } else if (input == "/quit") {
-            // Disconnect from server
-            cout << "Disconnecting from server..." << endl;
-            client_running = false;
+            if (!connected) {
+                cout << "\n[SYSTEM] Connection to server lost!" << endl;
+                break;
+            }
+        }
+
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            read_input();
+        }
+
+        pump_stream();
+        if (!flush_output()) {
+            cout << "\n[SYSTEM] Connection to server lost!" << endl;
             break;
-            
-        } else {
-            cout << "Unknown command. Use /say <text> or /stats" << endl;
-            cout << "Enter command (/say <text> or /stats): ";
-            cout.flush();
         }
+        if (input_done && outgoing == nullptr && pending_output.empty()) break;
+    }
+    client_running = false;
+    for (auto& entry : incoming) {
+        if (entry.second.file != nullptr) fclose(entry.second.file);
     }
-    
-    print_debug("Input thread ended");
-    return nullptr;
 }
 
 int main(int argc, char* argv[]) {
@@ -211,35 +484,15 @@ int main(int argc, char* argv[]) {
     }
     
     cout << "Connected to server " << server_ip << ":" << port << endl;
-    
-    // Create threads
-    pthread_t receive_tid, input_tid;
-    
-    if (pthread_create(&receive_tid, NULL, receive_thread, NULL) != 0) {
-        cerr << "Failed to create receive thread!" << endl;
-        close(client_socket);
-        exit(EXIT_FAILURE);
-    }
-    
-    if (pthread_create(&input_tid, NULL, input_thread, NULL) != 0) {
-        cerr << "Failed to create input thread!" << endl;
-        client_running = false;
-        close(client_socket);
-        exit(EXIT_FAILURE);
-    }
-    
-    // Wait for threads to complete
-    pthread_join(receive_tid, NULL);
-    pthread_join(input_tid, NULL);
-    
+
+    int flags = fcntl(client_socket, F_GETFL, 0);
+    fcntl(client_socket, F_SETFL, flags | O_NONBLOCK);
+
+    run_client();
+
     // Cleanup
-    close(client_socket);
-    pthread_mutex_destroy(&client_mutex);
+    close_gracefully();
     
     cout << "Client disconnected." << endl;
     return 0;
 }
-
-
-
-
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <iostream>
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <pthread.h>
@@ -13,13 +14,41 @@
 #include <algorithm>
 #include <sstream>
 #include <iomanip>
+#include <atomic>
+
+#include "../common/MessagePool.h"
+#include "../common/RingQueue.h"
+#include "../common/TimerWheel.h"
 
 using namespace std;
 
 // Message types
 enum TcpMessageType {
     MSG_CHAT  = 1,
-    MSG_STATS = 2
+    MSG_STATS = 2,
+    MSG_HELLO = 3, // protocol negotiation, always exchanged as a legacy TcpMessage
+
+    // Streams of arbitrary length, framed protocol only (see below)
+    MSG_STREAM_BEGIN  = 4,
+    MSG_STREAM_DATA   = 5,
+    MSG_STREAM_END    = 6,
+    MSG_STREAM_CREDIT = 7,
+
+    // Rooms: the payload is the room name (join) or empty (leave, back to
+    // the lobby). The server answers with the same type and a status text.
+    MSG_JOIN  = 8,
+    MSG_LEAVE = 9,
+
+    // History: the client sends a request (see HistoryQuery.h); the server
+    // answers with one message per stored chat line, from the original
+    // sender, then a summary from client id 0. Also sent unasked, without
+    // the summary if there is nothing to replay, on connect and on join.
+    MSG_HISTORY = 10,
+
+    // Keepalive probe from the server to a client that has gone quiet, empty
+    // payload, framed protocol only. The client echoes it back; anything it
+    // sends resets its idle timer.
+    MSG_PING = 11
 };
 
 // Message structure
@@ -34,24 +63,278 @@ struct TcpMessage {
     }
 };
 
-// Client information structure
+// Legacy fixed-size wire format: every message is sizeof(TcpMessage) bytes
+// regardless of payload, in host byte order.
+
+// Framed wire format: a 12-byte header in network byte order followed by
+// exactly payload_length bytes of payload.
+//
+// Negotiation: a new client sends a legacy MSG_HELLO carrying
+// TCP_FRAMED_HELLO and sends nothing else until it hears back. A server that
+// understands framing answers with the same legacy MSG_HELLO and treats all
+// later bytes in both directions as frames. An old server ignores the unknown
+// type, the client times out and both sides stay on the legacy format.
+static const char TCP_FRAMED_HELLO[] = "FRAMED/1";
+static const uint32_t TCP_MAX_FRAME_PAYLOAD = 64 * 1024;
+
+struct TcpFrameHeader {
+    uint16_t type;           // TcpMessageType
+    uint16_t flags;          // reserved, 0
+    uint32_t client_id;
+    uint32_t payload_length; // bytes of payload following the header
+};
+
+static const size_t TCP_FRAME_HEADER_SIZE = sizeof(TcpFrameHeader);
+
+// Streams carry payloads too large for one frame (files, logs) as a
+// sequence of frames, all starting with the sender's 32-bit stream id:
+//
+//   MSG_STREAM_BEGIN   stream_id, total_bytes (64-bit, 0 if unknown), name
+//   MSG_STREAM_DATA    stream_id, up to TCP_STREAM_CHUNK bytes of data
+//   MSG_STREAM_END     stream_id, status (TcpStreamStatus)
+//   MSG_STREAM_CREDIT  stream_id, bytes (server -> sender only)
+//
+// The server relays BEGIN/DATA/END to every other framed client, stamped
+// with the sender's client_id. Flow control is credit based: the sender may
+// have at most the DATA bytes granted by MSG_STREAM_CREDIT outstanding. The
+// server grants TCP_STREAM_WINDOW after BEGIN and returns credit as relayed
+// chunks are written out to every recipient, so a stream moves at the pace
+// of its slowest reader instead of piling up in server memory. One stream
+// per sender may be open at a time. All fields are in network byte order.
+static const uint32_t TCP_STREAM_CHUNK = 60 * 1024;
+static const uint32_t TCP_STREAM_WINDOW = 1024 * 1024;
+
+enum TcpStreamStatus {
+    STREAM_COMPLETE = 0,
+    STREAM_ABORTED  = 1, // sender went away or gave up mid-stream
+    STREAM_REJECTED = 2  // server refused the BEGIN (another stream is open)
+};
+
+inline uint32_t stream_get_u32(const char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return ntohl(value);
+}
+
+inline void stream_put_u32(char* p, uint32_t value) {
+    value = htonl(value);
+    memcpy(p, &value, sizeof(value));
+}
+
+// A decoded message. payload points into the decoder's buffer and stays
+// valid until the next call to feed().
+struct TcpFrame {
+    uint16_t type;
+    uint16_t flags;
+    uint32_t client_id;
+    const char* payload;
+    uint32_t payload_length;
+};
+
+// Append one message to out in either wire format. Legacy messages are
+// truncated to the fixed payload buffer like before.
+inline void encode_message(string& out, bool framed, uint16_t type, uint32_t client_id,
+                           const char* payload, uint32_t payload_length) {
+    if (framed) {
+        TcpFrameHeader hdr;
+        hdr.type = htons(type);
+        hdr.flags = 0;
+        hdr.client_id = htonl(client_id);
+        hdr.payload_length = htonl(payload_length);
+        out.append(reinterpret_cast<const char*>(&hdr), TCP_FRAME_HEADER_SIZE);
+        out.append(payload, payload_length);
+        return;
+    }
+
+    TcpMessage msg;
+    msg.type = (TcpMessageType)type;
+    msg.client_id = client_id;
+    msg.payload_length = min<uint32_t>(payload_length, sizeof(msg.payload) - 1);
+    memcpy(msg.payload, payload, msg.payload_length);
+    out.append(reinterpret_cast<const char*>(&msg), sizeof(TcpMessage));
+}
+
+// Streaming decoder for one byte stream. A single read may hold a partial
+// message or several of them; incomplete bytes stay buffered until the rest
+// arrives. Starts in the legacy format until set_framed() is called.
+class TcpFrameDecoder {
+public:
+    TcpFrameDecoder() : framed_(false), offset_(0) {}
+
+    bool framed() const { return framed_; }
+    void set_framed(bool framed) { framed_ = framed; }
+    size_t buffered() const { return buffer_.size() - offset_; }
+    string pending() const { return buffer_.substr(offset_); }
+
+    void feed(const char* data, size_t len) {
+        if (offset_ > 0) {
+            buffer_.erase(0, offset_);
+            offset_ = 0;
+        }
+        buffer_.append(data, len);
+    }
+
+    // Returns 1 when frame was filled, 0 when more bytes are needed and -1
+    // when the stream is corrupt (oversized frame).
+    int next(TcpFrame& frame) {
+        size_t available = buffer_.size() - offset_;
+        const char* data = buffer_.data() + offset_;
+
+        if (!framed_) {
+            if (available < sizeof(TcpMessage)) return 0;
+            const TcpMessage* msg = reinterpret_cast<const TcpMessage*>(data);
+            frame.type = (uint16_t)msg->type;
+            frame.flags = 0;
+            frame.client_id = (uint32_t)msg->client_id;
+            frame.payload = msg->payload;
+            frame.payload_length = strnlen(msg->payload, sizeof(msg->payload));
+            offset_ += sizeof(TcpMessage);
+            return 1;
+        }
+
+        if (available < TCP_FRAME_HEADER_SIZE) return 0;
+        TcpFrameHeader hdr;
+        memcpy(&hdr, data, TCP_FRAME_HEADER_SIZE);
+        uint32_t payload_length = ntohl(hdr.payload_length);
+        if (payload_length > TCP_MAX_FRAME_PAYLOAD) return -1;
+        if (available < TCP_FRAME_HEADER_SIZE + payload_length) return 0;
+
+        frame.type = ntohs(hdr.type);
+        frame.flags = ntohs(hdr.flags);
+        frame.client_id = ntohl(hdr.client_id);
+        frame.payload = data + TCP_FRAME_HEADER_SIZE;
+        frame.payload_length = payload_length;
+        offset_ += TCP_FRAME_HEADER_SIZE + payload_length;
+        return 1;
+    }
+
+private:
+    bool framed_;
+    string buffer_;
+    size_t offset_;
+};
+
+// An encoded message shared by every connection it is queued on. Broadcasts
+// serialize once into a pooled buffer and hand out references instead of
+// copying bytes; the buffer returns to the pool after the last write.
+typedef BufferRef TcpSharedBuffer;
+
+// Encode prefix followed by payload as one message straight into a pooled
+// buffer, without building the combined payload first. Returns an empty
+// reference if the message is larger than the biggest pool buffer.
+inline TcpSharedBuffer make_shared_message(bool framed, uint16_t type, uint32_t client_id,
+                                           const char* prefix, uint32_t prefix_length,
+                                           const char* payload, uint32_t payload_length) {
+    if (framed) {
+        TcpSharedBuffer buffer = BufferRef::allocate(TCP_FRAME_HEADER_SIZE + prefix_length + payload_length);
+        if (!buffer) return buffer;
+        TcpFrameHeader hdr;
+        hdr.type = htons(type);
+        hdr.flags = 0;
+        hdr.client_id = htonl(client_id);
+        hdr.payload_length = htonl(prefix_length + payload_length);
+        buffer.append(&hdr, TCP_FRAME_HEADER_SIZE);
+        buffer.append(prefix, prefix_length);
+        buffer.append(payload, payload_length);
+        return buffer;
+    }
+
+    // Lay out a TcpMessage in place, truncating like encode_message()
+    TcpSharedBuffer buffer = BufferRef::allocate(sizeof(TcpMessage));
+    TcpMessage* msg = reinterpret_cast<TcpMessage*>(buffer.mutable_data());
+    uint32_t room = sizeof(msg->payload) - 1;
+    prefix_length = min(prefix_length, room);
+    payload_length = min(payload_length, room - prefix_length);
+    msg->type = (TcpMessageType)type;
+    msg->client_id = client_id;
+    msg->payload_length = prefix_length + payload_length;
+    memcpy(msg->payload, prefix, prefix_length);
+    memcpy(msg->payload + prefix_length, payload, payload_length);
+    memset(msg->payload + msg->payload_length, 0, sizeof(msg->payload) - msg->payload_length);
+    buffer.set_size(sizeof(TcpMessage));
+    return buffer;
+}
+
+inline TcpSharedBuffer make_shared_message(bool framed, uint16_t type, uint32_t client_id,
+                                           const char* payload, uint32_t payload_length) {
+    return make_shared_message(framed, type, client_id, "", 0, payload, payload_length);
+}
+
+// Server side of a client's open stream: relayed chunks still queued for
+// some recipient. A chunk's bytes are credited back to the sender once the
+// stream holds the only reference to it.
+struct TcpStreamChunk {
+    TcpSharedBuffer buffer;
+    uint32_t data_bytes;
+};
+
+struct TcpInboundStream {
+    uint32_t stream_id;
+    uint32_t room;                      // where the stream started; all its frames go there
+    uint64_t credit;                    // DATA bytes the sender may still send
+    RingQueue<TcpStreamChunk> in_flight;
+};
+
+// A buffer passed to a MSG_ZEROCOPY send, kept alive until the kernel
+// reports that send id as finished
+struct TcpZeroCopyHold {
+    uint32_t send_id;
+    TcpSharedBuffer buffer;
+};
+
+// An encoded message in a client's send queue. Only bounded ones (chat
+// broadcasts) may be evicted by the drop-oldest policy; replies and stream
+// frames must all arrive.
+struct TcpQueuedMessage {
+    TcpSharedBuffer buffer;
+    bool bounded;
+};
+
+// Client information structure (one per connection, owned by the reactor)
 struct TcpClientInfo {
     int socket_fd;
     int client_id;
-    pthread_t thread_id;
     string client_ip;
     int client_port;
+    TcpFrameDecoder decoder; // bytes received but not yet parsed into a message
+    RingQueue<TcpQueuedMessage> out_queue; // encoded messages not yet fully written
+    size_t out_offset;       // bytes of out_queue.front() already written
+    size_t out_bytes;        // unwritten bytes across the whole queue
+    bool want_write;    // EPOLLOUT is armed because out_queue is not empty
+    bool dirty;         // queued output waiting for the end-of-batch flush
+    bool closing;       // scheduled for close at the end of the event batch
+    int inflight_sends; // io_uring: queued messages currently submitted as linked sends
+    bool recv_armed;    // io_uring: multishot recv still active
+    bool shut_down;     // shutdown() issued, waiting for in-flight ops or zero-copy sends to finish
+    uint32_t room;                       // room whose chat this client sends and receives
+    TcpInboundStream* stream;            // open stream from this client, if any
+    bool zerocopy;                       // SO_ZEROCOPY enabled on the socket
+    uint32_t zerocopy_next_id;           // epoll: id the kernel gives the next MSG_ZEROCOPY send
+    RingQueue<TcpZeroCopyHold> zerocopy_holds; // epoll: buffers of unfinished zero-copy sends
+    int64_t close_deadline_ms;           // epoll: when a closed client stops waiting for zero-copy sends
+    int64_t last_active_ms;              // when the client last sent anything (monotonic)
+    WheelTimer idle_timer;               // next idle check, on the shard's wheel
 
     TcpClientInfo(int fd, int id, const string& ip, int port)
-        : socket_fd(fd), client_id(id), client_ip(ip), client_port(port) {}
+        : socket_fd(fd), client_id(id), client_ip(ip), client_port(port),
+          out_offset(0), out_bytes(0), want_write(false), dirty(false), closing(false),
+          inflight_sends(0), recv_armed(false), shut_down(false), room(0), stream(nullptr), zerocopy(false),
+          zerocopy_next_id(0), close_deadline_ms(0), last_active_ms(0) {}
 };
 
 // Server statistics
 struct TcpServerStats {
     int client_count;
     chrono::steady_clock::time_point start_time;
+    atomic<uint64_t> dropped_oldest;    // queued messages evicted to make room
+    atomic<uint64_t> dropped_newest;    // new messages refused by a full queue
+    atomic<uint64_t> slow_disconnects;  // clients closed for falling too far behind
+    atomic<uint64_t> keepalive_probes;  // MSG_PING sent to quiet clients
+    atomic<uint64_t> idle_disconnects;  // clients closed for staying silent past the idle timeout
 
-    TcpServerStats() : client_count(0) {
+    TcpServerStats()
+        : client_count(0), dropped_oldest(0), dropped_newest(0), slow_disconnects(0), keepalive_probes(0),
+          idle_disconnects(0) {
         start_time = chrono::steady_clock::now();
     }
 
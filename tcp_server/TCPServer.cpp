@@ -1,243 +1,2292 @@
 #include "TCPCommon.h"
+#include "../common/ClientRegistry.h"
+#include "../common/Logger.h"
+#include "../common/Timestamp.h"
+#include "../common/ServerMetrics.h"
+#include "../common/IoUring.h"
+#include "../common/TaskScheduler.h"
+#include "../common/RoomIndex.h"
+#include "../common/MessageLog.h"
+#include "../common/FdPassing.h"
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unordered_map>
+#include <atomic>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+#include <sys/uio.h>
+#include <signal.h>
 
 using namespace std;
 
+static const int TCP_MAX_EVENTS = 256;   // events (or io_uring completions) handled per batch
+static const int TCP_READ_CHUNK = 16384; // bytes pulled per recv call
+static const int TCP_SEND_BATCH = 64;    // queued messages handed to one sendmsg call
+static const size_t TCP_ZEROCOPY_MIN = 32 * 1024; // smaller sends are cheaper to copy
+static const int TCP_STREAM_POLL_MS = 1; // how often released stream chunks are credited back
+static const int TCP_ZEROCOPY_LINGER_MS = 5000; // epoll: longest wait for a closed client's zero-copy sends
+static const int TCP_WHEEL_TICK_MS = 100; // idle timer resolution
+
+static const unsigned TCP_URING_ENTRIES = 4096;     // submission queue entries per shard
+static const unsigned TCP_URING_RECV_BUFFERS = 1024; // provided receive buffers per shard
+static const unsigned TCP_URING_RECV_BUFFER_SIZE = 4096;
+static const int TCP_URING_SEND_LINKS = 16;          // linked sendmsg batches in flight per client
+
+// io_uring: one sendmsg of up to TCP_SEND_BATCH queued messages. The
+// header and iovecs must stay put until the kernel completes the request;
+// for a zero-copy send the buffers themselves are held until the kernel's
+// notification that it no longer reads them, which may come after the
+// client is gone.
+struct TcpSendBatch {
+    struct msghdr msg;
+    struct iovec iov[TCP_SEND_BATCH];
+    TcpSharedBuffer hold[TCP_SEND_BATCH]; // zero-copy only
+    TcpClientInfo* client;
+    int messages;
+    bool zerocopy;
+};
+
+// io_uring user_data: the client (or, for sends, TcpSendBatch) pointer, 0
+// for shard-level operations, with the operation in the low bits. Cancel
+// requests (hot upgrade) carry plain 0; their completions are ignored.
+enum TcpUringOp {
+    TCP_OP_ACCEPT = 1,
+    TCP_OP_RECV   = 2,
+    TCP_OP_SEND   = 3,
+    TCP_OP_INBOX  = 4,
+    TCP_OP_TICK   = 5,
+    TCP_OP_TIMER  = 6,
+    TCP_OP_WHEEL  = 7,
+    TCP_OP_MASK   = 7
+};
+
+// A message another shard asked us to deliver to our local clients,
+// already encoded in both wire formats (indexed by "framed")
+struct TcpInboxItem {
+    TcpSharedBuffer encoded[2];
+    uint32_t room;
+    int exclude_client_id;
+    bool bounded; // subject to the overflow policy (stream frames are not)
+    int target_client_id; // deliver to this client only instead of the room (history replies)
+};
+
+// One reactor thread with its own SO_REUSEPORT listener, epoll set and
+// connections. Everything except the inbox is touched only by its thread.
+struct TcpShard {
+    int index;
+    int cpu;                     // core to pin the reactor to, -1 = unpinned
+    int epoll_fd;
+    int listen_fd;
+    int inbox_fd;                // eventfd signalled when the inbox goes non-empty
+    int tick_fd;                 // coalescing only: timerfd ending the current window
+    int wheel_fd;                // idle timeouts only: timerfd ticking idle_wheel
+    TimerWheel* idle_wheel;      // idle timeouts only: one timer per client
+    bool tick_armed;             // a window is open
+    bool tick_due;               // the window ended; flush at the end of this batch
+    pthread_t thread_id;
+    unordered_map<int, TcpClientInfo*> clients; // keyed by socket fd
+    RoomMembers rooms;           // local clients per room, as TcpClientInfo pointers; written by this shard only
+    vector<TcpClientInfo*> pending_close;
+    vector<TcpClientInfo*> dirty_clients;       // have queued output to flush
+    pthread_mutex_t inbox_mutex; // guards inbox only, never held during I/O
+    vector<TcpInboxItem> inbox;
+    vector<TcpInboxItem> inbox_spare; // swapped with inbox so neither reallocates
+    IoUring* ring;               // io_uring backend only, replaces epoll_fd
+    bool sends_prepared;         // io_uring: send SQEs waiting for the next submit
+    vector<TcpSendBatch*> free_batches; // io_uring: recycled send batches
+    vector<TcpClientInfo*> streaming_clients; // clients with an open inbound stream
+    bool stream_timer_armed;     // io_uring: timeout pending for the stream credit poll
+    struct __kernel_timespec stream_timer; // io_uring: read by the kernel at submit
+    bool accept_armed;           // io_uring: multishot accept still active
+    int handover_phase;          // last hot-upgrade phase this shard carried out
+    bool input_paused;           // hot upgrade: no accepts or reads
+    bool sends_stopped;          // hot upgrade: output frozen for the snapshot
+    vector<TcpClientInfo*> adopted; // taken over from the previous process, not yet started
+
+    TcpShard(int idx)
+        : index(idx), cpu(-1), epoll_fd(-1), listen_fd(-1), inbox_fd(-1), tick_fd(-1), wheel_fd(-1),
+          idle_wheel(nullptr), tick_armed(false), tick_due(false), ring(nullptr), sends_prepared(false),
+          stream_timer_armed(false), accept_armed(false), handover_phase(0), input_paused(false),
+          sends_stopped(false) {
+        pthread_mutex_init(&inbox_mutex, NULL);
+    }
+};
+
+// What to do when a client's outbound queue would exceed its limits
+enum TcpOverflowPolicy {
+    OVERFLOW_DROP_OLDEST,
+    OVERFLOW_DROP_NEWEST,
+    OVERFLOW_DISCONNECT
+};
+
+// How each reactor waits for and performs I/O
+enum TcpBackend {
+    BACKEND_EPOLL,  // readiness via epoll, one recv/sendmsg syscall per socket
+    BACKEND_URING   // completions via io_uring, one io_uring_enter per batch
+};
+
+struct TcpServerConfig {
+    size_t max_queue_bytes;  // unwritten bytes allowed per client
+    size_t max_queue_msgs;   // unwritten messages allowed per client
+    TcpOverflowPolicy overflow_policy;
+    TcpBackend backend;
+    unsigned coalesce_us;    // 0: flush after every event batch (latency first)
+    int64_t idle_timeout_ms; // 0: never disconnect quiet clients
+
+    TcpServerConfig()
+        : max_queue_bytes(4 * 1024 * 1024), max_queue_msgs(4096),
+          overflow_policy(OVERFLOW_DROP_OLDEST), backend(BACKEND_EPOLL), coalesce_us(0), idle_timeout_ms(0) {}
+};
+
 // Global variables
-vector<TcpClientInfo> g_tcp_clients;
-pthread_mutex_t g_tcp_clients_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t g_tcp_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+TcpServerConfig g_tcp_config;
+vector<TcpShard*> g_tcp_shards;
 TcpServerStats g_tcp_server_stats;
-int g_tcp_next_client_id = 1;
-
-void print_debug(const string& message) {
-         cerr << "[DEBUG] " << message << endl;
-}
-
-string get_timestamp() {
-   auto now = chrono::system_clock::now();
-   auto time_t = chrono::system_clock::to_time_t(now);
-   auto ms = chrono::duration_cast< chrono::milliseconds>(
-     now.time_since_epoch()) % 1000;
-  
-    stringstream ss;
-   ss << put_time( localtime(&time_t), "%H:%M:%S");
-   ss << '.' << setfill('0') << setw(3) << ms.count();
-   return ss.str();
-}  
-
-void send_message(int socket_fd, const TcpMessage& msg) {
-       // Send the message structure
-       ssize_t bytes_sent = send(socket_fd, &msg, sizeof(TcpMessage), 0);
-       if (bytes_sent == -1) {
-        print_debug("Failed to send message to client");
-       } else {
-        print_debug("Sent " + to_string(bytes_sent) + " bytes to client");
-       }
-}
-
-TcpMessage receive_message(int socket_fd) {
-       TcpMessage msg;
-       ssize_t bytes_received = recv(socket_fd, &msg, sizeof(TcpMessage), 0);
-       
-       if (bytes_received <= 0) {
-        msg.type = MSG_CHAT; // Invalid message type to indicate error
-        msg.client_id = -1;
-        print_debug("Failed to receive message or client disconnected");
-       } else {
-        print_debug("Received " + to_string(bytes_received) + " bytes from client");
-       }
-       
-       return msg;
-}
-
-void broadcast_message(const TcpMessage& msg, int exclude_client_id) {
-       pthread_mutex_lock(&g_tcp_clients_mutex);
-       
-       print_debug("Broadcasting to " + to_string(g_tcp_clients.size()) + " clients, excluding " + to_string(exclude_client_id));
-       
-       for (const auto& client : g_tcp_clients) {
-         if (client.client_id != exclude_client_id) {
-          print_debug("Sending message to client " + to_string(client.client_id));
-          send_message(client.socket_fd, msg);
-         }
-       }
-       
-       pthread_mutex_unlock(&g_tcp_clients_mutex);
-}
-
-void* handle_client(void* arg) {
-       TcpClientInfo* client_info = static_cast<TcpClientInfo*>(arg);
-       int client_socket = client_info->socket_fd;
-       int client_id = client_info->client_id;
-       
-       print_debug("Client " + to_string(client_id) + " connected from " + 
-             client_info->client_ip + ":" + to_string(client_info->client_port));
-       
-       while (true) {
-         TcpMessage msg = receive_message(client_socket);
-         
-         if (msg.client_id == -1) {
-           // Client disconnected
-           break;
-         }
-         
-         msg.client_id = client_id; // Ensure correct client ID
-         
-         switch (msg.type) {
-           case MSG_CHAT: {
-                // Broadcast chat message to all other clients
-                string chat_msg = "[" + get_timestamp() + "] Client " + 
-                                  to_string(client_id) + ": " + msg.payload;
-             
-             TcpMessage broadcast_msg;
-             broadcast_msg.type = MSG_CHAT;
-             broadcast_msg.client_id = client_id;
-             strncpy(broadcast_msg.payload, chat_msg.c_str(), sizeof(broadcast_msg.payload) - 1);
-             broadcast_msg.payload_length = strlen(broadcast_msg.payload);
-             
-             broadcast_message(broadcast_msg, client_id);
-             print_debug("Broadcasted message from client " + to_string(client_id));
-             break;
-           }
-           
-           case MSG_STATS: {
-             // Send server statistics to requesting client
-             pthread_mutex_lock(&g_tcp_stats_mutex);
-             pthread_mutex_lock(&g_tcp_clients_mutex);
-             
-             string stats_msg = string("Server Statistics:\n") +
-                        " Clients connected: " + to_string(g_tcp_clients.size()) + "\n" +
-                        " Server uptime: " + to_string((int)g_tcp_server_stats.get_uptime_seconds()) + " seconds";
-             
-             TcpMessage response_msg;
-             response_msg.type = MSG_STATS;
-             response_msg.client_id = 0; // Server response
-                strncpy(response_msg.payload, stats_msg.c_str(), sizeof(response_msg.payload) - 1);
-                response_msg.payload_length = strlen(response_msg.payload);
-             
-             send_message(client_socket, response_msg);
-             
-             pthread_mutex_unlock(&g_tcp_clients_mutex);
-             pthread_mutex_unlock(&g_tcp_stats_mutex);
-             print_debug("Sent stats to client " + to_string(client_id));
-             break;
-           }
-           
-           default:
-             print_debug("Unknown message type from client " + to_string(client_id));
-             break;
-         }
-       }
-       
-       // Client disconnected - remove from clients list
-       pthread_mutex_lock(&g_tcp_clients_mutex);
-       g_tcp_clients.erase( remove_if(g_tcp_clients.begin(), g_tcp_clients.end(),
-        [client_id](const TcpClientInfo& client) { return client.client_id == client_id; }),
-        g_tcp_clients.end());
-       pthread_mutex_unlock(&g_tcp_clients_mutex);
-       
-       print_debug("Client " + to_string(client_id) + " disconnected");
-       close(client_socket);
-       delete client_info;
-       
-       return nullptr;
+atomic<int> g_tcp_next_client_id(1);
+TaskScheduler* g_tcp_scheduler = nullptr; // --workers 0: format chat on the reactors
+RoomDirectory g_tcp_rooms;
+MessageLog* g_tcp_log = nullptr; // --log-dir: chat history on disk
+
+// Where a connected client lives. Shards own the connections themselves;
+// the registry answers "who is connected" from any thread without locking.
+struct TcpClientRef {
+    int client_id;
+    int shard_index;
+    int socket_fd;
+};
+
+ClientRegistry<TcpClientRef> g_tcp_clients; // by client id and by ip:port
+
+// Lift the open file limit to the hard maximum so tens of thousands of
+// mostly idle clients can stay connected at once.
+void raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
+            LOG_WARN("Failed to raise open file limit");
+        }
+    }
 }
 
-int main(int argc, char* argv[]) {
-       int port = 5000; // Default port
-       
-       // Parse command line arguments
-       if (argc > 1) {
-         port = atoi(argv[1]);
-         if (port <= 0 || port > 65535) {
-            cerr << "Invalid port number. Using default port 5000." << endl;
-           port = 5000;
-         }
-       }
-       
-       int server_fd, opt = 1;
-       struct sockaddr_in server_addr;
-       
-       // Create socket
-       server_fd = socket(AF_INET, SOCK_STREAM, 0);
-       if (server_fd == -1) {
-          cerr << "Socket creation failed!" << endl;
-         exit(EXIT_FAILURE);
-       }
-       
-       // Set socket options
-       if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
-          cerr << "Socket setsockopt error!" << endl;
-         exit(EXIT_FAILURE);
-       }
-       
-       // Configure server address
-       server_addr.sin_family = AF_INET;
-       server_addr.sin_addr.s_addr = INADDR_ANY;
-       server_addr.sin_port = htons(port);
-       memset(server_addr.sin_zero, '\0', sizeof(server_addr.sin_zero));
-       
-       // Bind socket
-       if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-          cerr << "Bind failed!" << endl;
-         exit(EXIT_FAILURE);
-       }
-       
-       // Listen for connections
-       if (listen(server_fd, 10) < 0) {
-          cerr << "Listen failed!" << endl;
-         exit(EXIT_FAILURE);
-       }
-       
-        cout << "Multi-threaded TCP Server started on port " << port << endl;
-        cout << "Waiting for connections..." << endl;
-       
-       // Main server loop
-       while (true) {
-         struct sockaddr_in client_addr;
-         socklen_t client_addrlen = sizeof(client_addr);
-         
-         int client_socket = accept(server_fd, (struct sockaddr*)&client_addr, &client_addrlen);
-         if (client_socket < 0) {
-            cerr << "Accept failed!" << endl;
-           continue;
-         }
-         
-         // Get client IP and port
-          string client_ip = inet_ntoa(client_addr.sin_addr);
-         int client_port = ntohs(client_addr.sin_port);
-         
-         // Create client info
-         TcpClientInfo* client_info = new TcpClientInfo(client_socket, g_tcp_next_client_id++, client_ip, client_port);
-         
-         // Add client to list
-         pthread_mutex_lock(&g_tcp_clients_mutex);
-         g_tcp_clients.push_back(*client_info);
-         pthread_mutex_unlock(&g_tcp_clients_mutex);
-         
-         // Create thread for this client
-         if (pthread_create(&client_info->thread_id, NULL, handle_client, client_info) != 0) {
-            cerr << "Failed to create thread for client!" << endl;
-           close(client_socket);
-           delete client_info;
-           
-           // Remove from clients list
-           pthread_mutex_lock(&g_tcp_clients_mutex);
-           g_tcp_clients.erase( remove_if(g_tcp_clients.begin(), g_tcp_clients.end(),
-            [client_info](const TcpClientInfo& client) { return client.client_id == client_info->client_id; }),
-            g_tcp_clients.end());
-           pthread_mutex_unlock(&g_tcp_clients_mutex);
-         }
-       }
-       
-       // Cleanup (this code will never be reached in current implementation)
-       close(server_fd);
-       pthread_mutex_destroy(&g_tcp_clients_mutex);
-       pthread_mutex_destroy(&g_tcp_stats_mutex);
-       
-       return 0;
+// Blocking fds for io_uring, non-blocking for epoll; the flag lives in the
+// open file, so it travels with a handed-over socket
+void set_nonblocking(int fd, bool nonblocking) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, nonblocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK));
+}
+
+void update_events(TcpShard* shard, TcpClientInfo* client) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (shard->input_paused ? 0u : (uint32_t)EPOLLIN) | (client->want_write ? (uint32_t)EPOLLOUT : 0u);
+    ev.data.fd = client->socket_fd;
+    epoll_ctl(shard->epoll_fd, EPOLL_CTL_MOD, client->socket_fd, &ev);
+}
+
+// Close is deferred to the end of the current event batch so that fds are
+// never reused (and client pointers never freed) while events are in flight.
+void schedule_close(TcpShard* shard, TcpClientInfo* client) {
+    if (client->closing) return;
+    client->closing = true;
+    shard->pending_close.push_back(client);
+}
+
+// MSG_ZEROCOPY: the kernel reports finished zero-copy sends on the socket's
+// error queue as ranges of send ids, after which their buffers may be
+// reused. Returns false if the socket also has a real error.
+bool drain_zerocopy(TcpClientInfo* client) {
+    char control[128];
+    while (true) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(client->socket_fd, &msg, MSG_ERRQUEUE) == -1) break;
+
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR) continue;
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+
+            // ids [ee_info, ee_data] are done; TCP completes them in order
+            while (!client->zerocopy_holds.empty() &&
+                   (int32_t)(client->zerocopy_holds.front().send_id - err.ee_data) <= 0) {
+                client->zerocopy_holds.pop_front();
+            }
+            if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                metric_add(METRIC_ZEROCOPY_COPIED, err.ee_data - err.ee_info + 1);
+            }
+        }
+    }
+
+    int error = 0;
+    socklen_t length = sizeof(error);
+    getsockopt(client->socket_fd, SOL_SOCKET, SO_ERROR, &error, &length);
+    return error == 0;
+}
+
+// With io_uring the kernel may still hold the client's buffers, so the
+// socket is shut down first (which completes every pending operation) and
+// the client is freed only once its last completion has arrived. With
+// epoll the same goes for MSG_ZEROCOPY sends: the socket stays open, out of
+// epoll, and its error queue is polled until the kernel has finished with
+// them. A peer that never acknowledges gets TCP_ZEROCOPY_LINGER_MS, then a
+// reset, which drops the unsent data along with the kernel's references.
+void close_pending_clients(TcpShard* shard) {
+    size_t kept = 0;
+    for (TcpClientInfo* client : shard->pending_close) {
+        if (shard->ring != nullptr && (client->recv_armed || client->inflight_sends > 0)) {
+            if (!client->shut_down) {
+                shutdown(client->socket_fd, SHUT_RDWR);
+                client->shut_down = true;
+            }
+            shard->pending_close[kept++] = client;
+            continue;
+        }
+
+        if (shard->ring == nullptr && !client->shut_down) {
+            epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, client->socket_fd, NULL);
+        }
+        if (shard->ring == nullptr && !client->zerocopy_holds.empty()) {
+            if (!client->shut_down) {
+                shutdown(client->socket_fd, SHUT_RDWR);
+                client->shut_down = true;
+                client->close_deadline_ms = monotonic_ms() + TCP_ZEROCOPY_LINGER_MS;
+            }
+            drain_zerocopy(client);
+            if (!client->zerocopy_holds.empty()) {
+                if (monotonic_ms() < client->close_deadline_ms) {
+                    shard->pending_close[kept++] = client;
+                    continue;
+                }
+                struct linger reset = {1, 0};
+                setsockopt(client->socket_fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+            }
+        }
+        if (client->dirty) {
+            // Only while coalescing can a client stay dirty across batches
+            auto& dirty = shard->dirty_clients;
+            dirty.erase(find(dirty.begin(), dirty.end(), client));
+        }
+        if (shard->idle_wheel != nullptr) shard->idle_wheel->cancel(&client->idle_timer);
+        shard->clients.erase(client->socket_fd);
+        shard->rooms.leave(client->room, reinterpret_cast<uint64_t>(client));
+        g_tcp_clients.erase(client->client_id);
+        metric_add(METRIC_DISCONNECTS);
+        LOG_INFO("Client %d disconnected", client->client_id);
+        close(client->socket_fd);
+        delete client;
+    }
+    shard->pending_close.resize(kept);
+}
+
+// Release every queued message the socket has fully accepted
+void consume_sent(TcpClientInfo* client, size_t bytes_sent) {
+    client->out_bytes -= bytes_sent;
+    metric_add(METRIC_BYTES_OUT, bytes_sent);
+    size_t remaining = bytes_sent;
+    while (remaining > 0) {
+        size_t front_left = client->out_queue.front().buffer.size() - client->out_offset;
+        if (remaining < front_left) {
+            client->out_offset += remaining;
+            break;
+        }
+        remaining -= front_left;
+        client->out_queue.pop_front();
+        client->out_offset = 0;
+        metric_add(METRIC_MESSAGES_OUT);
+    }
+}
+
+// Write as much of the client's queued output as the socket accepts with one
+// sendmsg per batch of messages. Arms EPOLLOUT while data remains so the rest
+// goes out when the socket becomes writable again. While coalescing, every
+// batch but the last carries MSG_MORE (a per-call TCP_CORK) so the kernel
+// packs them into full segments. Batches of at least TCP_ZEROCOPY_MIN bytes
+// (stream chunks) are sent with MSG_ZEROCOPY, so the kernel transmits from
+// the shared buffer without copying it for every recipient.
+void flush_client(TcpShard* shard, TcpClientInfo* client) {
+    while (!client->out_queue.empty() && !client->closing) {
+        struct iovec iov[TCP_SEND_BATCH];
+        int iov_count = 0;
+        size_t batch_bytes = 0;
+        size_t queued = client->out_queue.size();
+        for (size_t i = 0; i < queued && iov_count < TCP_SEND_BATCH; i++) {
+            const TcpSharedBuffer& buffer = client->out_queue[i].buffer;
+            size_t skip = (iov_count == 0) ? client->out_offset : 0;
+            iov[iov_count].iov_base = const_cast<char*>(buffer.data()) + skip;
+            iov[iov_count].iov_len = buffer.size() - skip;
+            batch_bytes += iov[iov_count].iov_len;
+            iov_count++;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov_count;
+        int flags = MSG_NOSIGNAL;
+        if (g_tcp_config.coalesce_us > 0 && queued > (size_t)iov_count) flags |= MSG_MORE;
+        bool zerocopy = client->zerocopy && batch_bytes >= TCP_ZEROCOPY_MIN;
+        if (zerocopy) flags |= MSG_ZEROCOPY;
+
+        ssize_t bytes_sent = sendmsg(client->socket_fd, &msg, flags);
+        metric_add(METRIC_SEND_SYSCALLS);
+        if (bytes_sent == -1 && zerocopy && errno == ENOBUFS) {
+            // Out of pinned-page budget (optmem); copy this batch instead
+            bytes_sent = sendmsg(client->socket_fd, &msg, flags & ~MSG_ZEROCOPY);
+            metric_add(METRIC_SEND_SYSCALLS);
+            zerocopy = false;
+        }
+        if (bytes_sent == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            LOG_WARN("Failed to send message to client %d", client->client_id);
+            metric_add(METRIC_SEND_ERRORS);
+            schedule_close(shard, client);
+            return;
+        }
+
+        if (zerocopy) {
+            // Every message the kernel took part of stays alive until
+            // this send id is reported done
+            uint32_t send_id = client->zerocopy_next_id++;
+            size_t remaining = bytes_sent;
+            for (int i = 0; i < iov_count && remaining > 0; i++) {
+                client->zerocopy_holds.push_back(TcpZeroCopyHold{send_id, client->out_queue[i].buffer});
+                remaining -= min(remaining, iov[i].iov_len);
+            }
+            metric_add(METRIC_ZEROCOPY_SENDS);
+        }
+        consume_sent(client, bytes_sent);
+    }
+
+    bool want_write = !client->out_queue.empty();
+    if (want_write != client->want_write && !client->closing) {
+        client->want_write = want_write;
+        update_events(shard, client);
+    }
+}
+
+bool queue_would_overflow(const TcpClientInfo* client, size_t extra_bytes) {
+    return client->out_bytes + extra_bytes > g_tcp_config.max_queue_bytes ||
+           client->out_queue.size() + 1 > g_tcp_config.max_queue_msgs;
+}
+
+// Apply the overflow policy before queueing a broadcast for a slow client.
+// Returns false if the new message must not be queued.
+bool make_room(TcpShard* shard, TcpClientInfo* client, size_t extra_bytes) {
+    if (!queue_would_overflow(client, extra_bytes)) return true;
+
+    switch (g_tcp_config.overflow_policy) {
+        case OVERFLOW_DROP_NEWEST:
+            g_tcp_server_stats.dropped_newest++;
+            return false;
+
+        case OVERFLOW_DISCONNECT:
+            LOG_WARN("Disconnecting slow client %d", client->client_id);
+            g_tcp_server_stats.slow_disconnects++;
+            schedule_close(shard, client);
+            return false;
+
+        case OVERFLOW_DROP_OLDEST:
+        default: {
+            // A partially written front message must finish, or the stream
+            // would be corrupted, and messages submitted to io_uring are in
+            // use by the kernel; evict the ones behind them instead. Only
+            // broadcasts go: replies and file stream frames stay, so a
+            // queue full of those lets the new message in over the limit.
+            size_t next = max<size_t>((client->out_offset > 0) ? 1 : 0, client->inflight_sends);
+            while (next < client->out_queue.size() && queue_would_overflow(client, extra_bytes)) {
+                if (!client->out_queue[next].bounded) {
+                    next++;
+                    continue;
+                }
+                client->out_bytes -= client->out_queue[next].buffer.size();
+                client->out_queue.erase_at(next);
+                g_tcp_server_stats.dropped_oldest++;
+            }
+            return true;
+        }
+    }
+}
+
+// Queue a reference to an encoded message. Nothing is written here; the
+// reactor flushes dirty clients at the end of each event batch, or when the
+// coalescing window closes.
+// Bounded (broadcast) messages are subject to the overflow policy; direct
+// replies to the client's own requests are not. Returns true if queued.
+bool enqueue_message(TcpShard* shard, TcpClientInfo* client, const TcpSharedBuffer& buffer, bool bounded = false) {
+    if (client->closing || !buffer) return false;
+    if (bounded && !make_room(shard, client, buffer.size())) return false;
+    client->out_queue.push_back(TcpQueuedMessage{buffer, bounded});
+    client->out_bytes += buffer.size();
+    if (!client->dirty && !client->want_write) {
+        client->dirty = true;
+        shard->dirty_clients.push_back(client);
+    }
+    return true;
+}
+
+void recycle_batch(TcpShard* shard, TcpSendBatch* batch) {
+    if (batch->zerocopy) {
+        for (int i = 0; i < batch->messages; i++) batch->hold[i].reset();
+    }
+    shard->free_batches.push_back(batch);
+}
+
+// io_uring: submit the client's queue as a chain of linked sendmsg
+// requests, each covering up to TCP_SEND_BATCH messages like flush_client().
+// MSG_WAITALL turns a short send into a failure, which cancels the rest of
+// the chain, so bytes can never go out of order. Only one chain per client
+// is in flight; its last completion submits the next. While coalescing,
+// every link but the last carries MSG_MORE, and large batches go out as
+// zero-copy sends, both as in flush_client().
+void submit_sends(TcpShard* shard, TcpClientInfo* client) {
+    if (client->closing || client->inflight_sends > 0 || shard->sends_stopped) return;
+
+    size_t queued = client->out_queue.size();
+    size_t next = 0;
+    io_uring_sqe* previous = nullptr;
+    for (int link = 0; link < TCP_URING_SEND_LINKS && next < queued; link++) {
+        io_uring_sqe* sqe = shard->ring->get_sqe();
+        if (sqe == nullptr) break; // submission queue exhausted, the rest goes next time
+
+        TcpSendBatch* batch;
+        if (shard->free_batches.empty()) {
+            batch = new TcpSendBatch();
+        } else {
+            batch = shard->free_batches.back();
+            shard->free_batches.pop_back();
+        }
+        batch->client = client;
+        batch->messages = 0;
+        size_t batch_bytes = 0;
+        while (next < queued && batch->messages < TCP_SEND_BATCH) {
+            const TcpSharedBuffer& buffer = client->out_queue[next].buffer;
+            size_t skip = (next == 0) ? client->out_offset : 0;
+            batch->iov[batch->messages].iov_base = const_cast<char*>(buffer.data()) + skip;
+            batch->iov[batch->messages].iov_len = buffer.size() - skip;
+            batch_bytes += buffer.size() - skip;
+            batch->messages++;
+            next++;
+        }
+        memset(&batch->msg, 0, sizeof(batch->msg));
+        batch->msg.msg_iov = batch->iov;
+        batch->msg.msg_iovlen = batch->messages;
+
+        batch->zerocopy = batch_bytes >= TCP_ZEROCOPY_MIN;
+        if (batch->zerocopy) {
+            for (int i = 0; i < batch->messages; i++) batch->hold[i] = client->out_queue[next - batch->messages + i].buffer;
+            sqe->opcode = IORING_OP_SENDMSG_ZC;
+            sqe->ioprio = IORING_SEND_ZC_REPORT_USAGE;
+            metric_add(METRIC_ZEROCOPY_SENDS);
+        } else {
+            sqe->opcode = IORING_OP_SENDMSG;
+        }
+        sqe->fd = client->socket_fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&batch->msg);
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->user_data = reinterpret_cast<uint64_t>(batch) | TCP_OP_SEND;
+        if (previous != nullptr) {
+            previous->flags |= IOSQE_IO_LINK;
+            if (g_tcp_config.coalesce_us > 0) previous->msg_flags |= MSG_MORE;
+        }
+        previous = sqe;
+        client->inflight_sends += batch->messages;
+    }
+    if (client->inflight_sends > 0) shard->sends_prepared = true;
+}
+
+void flush_dirty_clients(TcpShard* shard) {
+    for (TcpClientInfo* client : shard->dirty_clients) {
+        client->dirty = false;
+        if (shard->ring != nullptr) {
+            submit_sends(shard, client);
+        } else {
+            flush_client(shard, client);
+        }
+    }
+    shard->dirty_clients.clear();
+}
+
+// Coalescing: the first output queued after a flush opens a window of
+// coalesce_us; everything queued for the same client until it closes goes
+// out in one flush. Latency-first mode flushes after every event batch.
+void arm_tick(TcpShard* shard) {
+    struct itimerspec window;
+    memset(&window, 0, sizeof(window));
+    window.it_value.tv_sec = g_tcp_config.coalesce_us / 1000000;
+    window.it_value.tv_nsec = (long)(g_tcp_config.coalesce_us % 1000000) * 1000;
+    if (timerfd_settime(shard->tick_fd, 0, &window, NULL) == 0) {
+        shard->tick_armed = true;
+    } else {
+        shard->tick_due = true; // never strand queued output
+    }
+}
+
+void handle_tick(TcpShard* shard) {
+    uint64_t expirations;
+    while (read(shard->tick_fd, &expirations, sizeof(expirations)) > 0) {}
+    shard->tick_armed = false;
+    shard->tick_due = true;
+}
+
+void send_message(TcpShard* shard, TcpClientInfo* client, uint16_t type, int client_id, const string& payload) {
+    enqueue_message(shard, client, make_shared_message(client->decoder.framed(), type, client_id,
+                                                       payload.data(), (uint32_t)payload.size()));
+}
+
+// Idle timeouts: a client's timer fires a third of the timeout after it was
+// last heard from. If it is still quiet it gets a MSG_PING and is checked
+// again a third later; after a whole timeout of silence it is disconnected.
+// Traffic only stamps last_active_ms and never touches the wheel, so the
+// timer of a busy client just moves on when it fires. Legacy clients cannot
+// be probed and are only timed out.
+void check_idle(TcpShard* shard, TcpClientInfo* client, int64_t now) {
+    if (client->closing) return;
+    int64_t timeout = g_tcp_config.idle_timeout_ms;
+    int64_t interval = max<int64_t>(timeout / 3, 1);
+    int64_t idle = now - client->last_active_ms;
+    if (idle >= timeout) {
+        LOG_INFO("Client %d silent for %lld ms, disconnecting", client->client_id, (long long)idle);
+        g_tcp_server_stats.idle_disconnects++;
+        schedule_close(shard, client);
+        return;
+    }
+    if (idle < interval) {
+        shard->idle_wheel->schedule(&client->idle_timer, client->last_active_ms + interval);
+        return;
+    }
+    if (client->decoder.framed()) {
+        send_message(shard, client, MSG_PING, 0, "");
+        g_tcp_server_stats.keepalive_probes++;
+    }
+    shard->idle_wheel->schedule(&client->idle_timer, now + min(interval, timeout - idle));
+}
+
+void advance_idle_timers(TcpShard* shard) {
+    uint64_t expirations;
+    while (read(shard->wheel_fd, &expirations, sizeof(expirations)) > 0) {}
+    int64_t now = monotonic_ms();
+    shard->idle_wheel->advance(now, [shard, now](WheelTimer* timer) {
+        check_idle(shard, reinterpret_cast<TcpClientInfo*>(timer->data), now);
+    });
+}
+
+// Deliver to this shard's own members of the room only; the walk touches
+// the room's member array, never the other clients
+void broadcast_local(TcpShard* shard, const TcpSharedBuffer encoded[2], uint32_t room, int exclude_client_id,
+                     bool bounded) {
+    uint64_t queued = 0;
+    shard->rooms.for_each(room, [&](uint64_t member) {
+        TcpClientInfo* client = reinterpret_cast<TcpClientInfo*>(member);
+        if (client->client_id == exclude_client_id) return;
+        queued += enqueue_message(shard, client, encoded[client->decoder.framed()], bounded);
+    });
+    metric_add(METRIC_FANOUT, queued);
+}
+
+void push_inbox(TcpShard* target, const TcpInboxItem& item) {
+    pthread_mutex_lock(&target->inbox_mutex);
+    bool was_empty = target->inbox.empty();
+    target->inbox.push_back(item);
+    pthread_mutex_unlock(&target->inbox_mutex);
+
+    // Only the first item needs a wakeup; the reactor drains the whole inbox
+    if (was_empty) {
+        uint64_t one = 1;
+        if (write(target->inbox_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            LOG_WARN("Failed to signal shard %d", target->index);
+        }
+    }
+}
+
+// Shards with no member in the room are skipped without taking any lock
+void post_to_shard(TcpShard* target, const TcpSharedBuffer encoded[2], uint32_t room, int exclude_client_id,
+                   bool bounded) {
+    if (target->rooms.size(room) == 0) return;
+    push_inbox(target, TcpInboxItem{{encoded[0], encoded[1]}, room, exclude_client_id, bounded, 0});
+}
+
+// Hand an encoded reply to whichever shard owns the client, from any thread
+void post_to_client(int client_id, bool framed, const TcpSharedBuffer& encoded) {
+    int shard_index = -1;
+    g_tcp_clients.with_id((uint32_t)client_id, [&](TcpClientRef& ref) { shard_index = ref.shard_index; });
+    if (shard_index < 0 || !encoded) return;
+
+    TcpInboxItem item{{TcpSharedBuffer(), TcpSharedBuffer()}, 0, 0, false, client_id};
+    item.encoded[framed] = encoded;
+    push_inbox(g_tcp_shards[shard_index], item);
+}
+
+// Serialize prefix + payload once per wire format, then fan the shared
+// buffers out to the room's local members and to the inbox of every other
+// shard that has members in it.
+void broadcast_message(TcpShard* shard, uint16_t type, int client_id, const char* prefix, uint32_t prefix_length,
+                       const char* payload, uint32_t payload_length, uint32_t room, int exclude_client_id) {
+    LOG_DEBUG("Broadcasting to room %u, excluding %d", room, exclude_client_id);
+
+    TcpSharedBuffer encoded[2];
+    for (int framed = 0; framed < 2; framed++) {
+        encoded[framed] = make_shared_message(framed, type, client_id, prefix, prefix_length,
+                                              payload, payload_length);
+    }
+
+    metric_add(METRIC_BROADCASTS);
+    broadcast_local(shard, encoded, room, exclude_client_id, true);
+    for (TcpShard* other : g_tcp_shards) {
+        if (other != shard) {
+            post_to_shard(other, encoded, room, exclude_client_id, true);
+        }
+    }
+}
+
+// Scheduler task: format and encode one chat message off the reactor, then
+// hand it to every shard with members in the room, the sender's included,
+// for local delivery. buffer holds the payload, arg the room (high word)
+// and the sender's client id.
+void broadcast_chat_task(Task& task) {
+    int client_id = (int)(uint32_t)task.arg;
+    uint32_t room = (uint32_t)(task.arg >> 32);
+    char prefix[64];
+    int prefix_length = snprintf(prefix, sizeof(prefix), "[%s] Client %d: ", cached_timestamp(), client_id);
+
+    TcpSharedBuffer encoded[2];
+    for (int framed = 0; framed < 2; framed++) {
+        encoded[framed] = make_shared_message(framed, MSG_CHAT, client_id, prefix, (uint32_t)prefix_length,
+                                              task.buffer.data(), (uint32_t)task.buffer.size());
+    }
+    metric_add(METRIC_BROADCASTS);
+    for (TcpShard* shard : g_tcp_shards) {
+        post_to_shard(shard, encoded, room, client_id, true);
+    }
+    if (g_tcp_log != nullptr) g_tcp_log->append(room, (uint32_t)client_id, task.buffer);
+    LOG_DEBUG("Broadcasted message from client %d", client_id);
+}
+
+// History replies: arg is (flags << 48) | (room << 32) | client id, buffer
+// the request text
+static const uint64_t TCP_HISTORY_FRAMED = 1; // encode for a framed client
+static const uint64_t TCP_HISTORY_QUIET = 2;  // unasked replay: no summary when empty
+
+// Scheduler task: read the requested history from the log and send it to
+// the client packed into as few pooled buffers as possible
+void replay_history_task(Task& task) {
+    int client_id = (int)(uint32_t)task.arg;
+    uint32_t room = (uint32_t)(task.arg >> 32) & 0xFFFF;
+    bool framed = (task.arg >> 48) & TCP_HISTORY_FRAMED;
+    bool quiet = (task.arg >> 48) & TCP_HISTORY_QUIET;
+
+    HistoryQuery query;
+    char summary[96];
+    int summary_length;
+    if (g_tcp_log == nullptr) {
+        summary_length = snprintf(summary, sizeof(summary), "History is not enabled on this server");
+    } else if (!parse_history_request((const char*)task.buffer.data(), task.buffer.size(), query)) {
+        summary_length = snprintf(summary, sizeof(summary), "Invalid history request");
+    } else {
+        const size_t batch_capacity = MessagePool::class_capacity(MessagePool::CLASS_COUNT - 1);
+        TcpSharedBuffer batch;
+        size_t replayed = g_tcp_log->replay(room, query, [&](const MessageLog::Record& record) {
+            char timestamp[16], prefix[64];
+            format_timestamp(record.timestamp_ms, timestamp);
+            int prefix_length = snprintf(prefix, sizeof(prefix), "[%s] Client %u: ", timestamp, record.client_id);
+            TcpSharedBuffer message = make_shared_message(framed, MSG_HISTORY, record.client_id, prefix,
+                                                          (uint32_t)prefix_length, record.payload,
+                                                          record.payload_length);
+            if (!message) return;
+            if (batch && batch.capacity() - batch.size() < message.size()) {
+                post_to_client(client_id, framed, batch);
+                batch = TcpSharedBuffer();
+            }
+            if (!batch) batch = TcpSharedBuffer::allocate(batch_capacity);
+            batch.append(message.data(), message.size());
+        });
+        if (batch) post_to_client(client_id, framed, batch);
+        if (replayed == 0 && quiet) return;
+        summary_length = snprintf(summary, sizeof(summary), "End of history (%zu messages)", replayed);
+    }
+    post_to_client(client_id, framed, make_shared_message(framed, MSG_HISTORY, 0, summary, (uint32_t)summary_length));
+}
+
+// Replay history to the client on a worker, after the client's earlier
+// chat, or right here without a scheduler
+void request_history(TcpClientInfo* client, const string& request, bool quiet) {
+    TcpSharedBuffer text = TcpSharedBuffer::allocate(request.size());
+    text.append(request.data(), request.size());
+    uint64_t flags = (client->decoder.framed() ? TCP_HISTORY_FRAMED : 0) | (quiet ? TCP_HISTORY_QUIET : 0);
+    Task task{replay_history_task, move(text),
+              (flags << 48) | ((uint64_t)client->room << 32) | (uint32_t)client->client_id, nullptr};
+    if (g_tcp_scheduler != nullptr) {
+        g_tcp_scheduler->submit_ordered((uint64_t)client->client_id, move(task));
+    } else {
+        replay_history_task(task);
+    }
+}
+
+// A reply posted by a worker; dropped if the client has gone meanwhile (its
+// fd may even belong to a newer client by now)
+void deliver_to_client(TcpShard* shard, const TcpInboxItem& item) {
+    int socket_fd = -1;
+    g_tcp_clients.with_id((uint32_t)item.target_client_id, [&](TcpClientRef& ref) { socket_fd = ref.socket_fd; });
+    auto it = shard->clients.find(socket_fd);
+    if (it == shard->clients.end() || it->second->client_id != item.target_client_id) return;
+    TcpClientInfo* client = it->second;
+    enqueue_message(shard, client, item.encoded[client->decoder.framed()]);
+}
+
+void drain_inbox(TcpShard* shard) {
+    uint64_t count;
+    while (read(shard->inbox_fd, &count, sizeof(count)) > 0) {
+    }
+
+    vector<TcpInboxItem>& items = shard->inbox_spare;
+    pthread_mutex_lock(&shard->inbox_mutex);
+    items.swap(shard->inbox);
+    pthread_mutex_unlock(&shard->inbox_mutex);
+
+    for (const TcpInboxItem& item : items) {
+        if (item.target_client_id != 0) {
+            deliver_to_client(shard, item);
+        } else {
+            broadcast_local(shard, item.encoded, item.room, item.exclude_client_id, item.bounded);
+        }
+    }
+    items.clear(); // keeps its capacity for the next swap
+}
+
+// Relay one stream frame from `client` to every other framed client in the
+// stream's room. The frame is encoded once and shared like a broadcast, but
+// never dropped by the overflow policy: sender credit already bounds how
+// much of a stream can be queued. Returns the shared buffer.
+TcpSharedBuffer relay_stream_frame(TcpShard* shard, TcpClientInfo* client, uint32_t room, uint16_t type,
+                                   const char* payload, uint32_t payload_length) {
+    TcpSharedBuffer encoded[2]; // legacy clients cannot receive streams
+    encoded[1] = make_shared_message(true, type, client->client_id, payload, payload_length);
+    broadcast_local(shard, encoded, room, client->client_id, false);
+    for (TcpShard* other : g_tcp_shards) {
+        if (other != shard) {
+            post_to_shard(other, encoded, room, client->client_id, false);
+        }
+    }
+    return encoded[1];
+}
+
+// MSG_STREAM_CREDIT or a server-side MSG_STREAM_END to the stream's sender
+void send_stream_control(TcpShard* shard, TcpClientInfo* client, uint16_t type, uint32_t stream_id,
+                         uint32_t value) {
+    char payload[8];
+    stream_put_u32(payload, stream_id);
+    stream_put_u32(payload + 4, value);
+    enqueue_message(shard, client, make_shared_message(true, type, 0, payload, sizeof(payload)));
+}
+
+void end_stream(TcpShard* shard, TcpClientInfo* client, uint32_t status) {
+    TcpInboundStream* stream = client->stream;
+    char payload[8];
+    stream_put_u32(payload, stream->stream_id);
+    stream_put_u32(payload + 4, status);
+    relay_stream_frame(shard, client, stream->room, MSG_STREAM_END, payload, sizeof(payload));
+    LOG_INFO("Stream %u from client %d ended (status %u)", stream->stream_id, client->client_id, status);
+
+    vector<TcpClientInfo*>& streaming = shard->streaming_clients;
+    streaming.erase(find(streaming.begin(), streaming.end(), client));
+    client->stream = nullptr;
+    delete stream; // chunks still queued elsewhere keep their own references
+}
+
+// Returns false if the client broke the stream protocol
+bool handle_stream_frame(TcpShard* shard, TcpClientInfo* client, const TcpFrame& frame) {
+    if (frame.payload_length < 4) return false;
+    uint32_t stream_id = stream_get_u32(frame.payload);
+    TcpInboundStream* stream = client->stream;
+
+    switch (frame.type) {
+        case MSG_STREAM_BEGIN:
+            if (frame.payload_length < 12) return false;
+            if (stream != nullptr) {
+                send_stream_control(shard, client, MSG_STREAM_END, stream_id, STREAM_REJECTED);
+                return true;
+            }
+            stream = new TcpInboundStream();
+            stream->stream_id = stream_id;
+            stream->room = client->room;
+            stream->credit = TCP_STREAM_WINDOW;
+            client->stream = stream;
+            shard->streaming_clients.push_back(client);
+            relay_stream_frame(shard, client, stream->room, MSG_STREAM_BEGIN, frame.payload, frame.payload_length);
+            send_stream_control(shard, client, MSG_STREAM_CREDIT, stream_id, TCP_STREAM_WINDOW);
+            LOG_INFO("Stream %u from client %d started", stream_id, client->client_id);
+            return true;
+
+        case MSG_STREAM_DATA: {
+            uint32_t data_bytes = frame.payload_length - 4;
+            if (stream == nullptr || stream->stream_id != stream_id || data_bytes > stream->credit) return false;
+            stream->credit -= data_bytes;
+            TcpStreamChunk chunk;
+            chunk.buffer = relay_stream_frame(shard, client, stream->room, MSG_STREAM_DATA, frame.payload,
+                                              frame.payload_length);
+            chunk.data_bytes = data_bytes;
+            stream->in_flight.push_back(chunk);
+            return true;
+        }
+
+        case MSG_STREAM_END:
+            if (stream == nullptr || stream->stream_id != stream_id) return false;
+            end_stream(shard, client,
+                       frame.payload_length >= 8 ? stream_get_u32(frame.payload + 4) : (uint32_t)STREAM_COMPLETE);
+            return true;
+
+        default:
+            return false; // MSG_STREAM_CREDIT only flows from the server
+    }
+}
+
+// Give senders back the credit of chunks every recipient has written (the
+// stream then holds the only reference), and abort the streams of clients
+// that are closing
+void update_streams(TcpShard* shard) {
+    vector<TcpClientInfo*>& streaming = shard->streaming_clients;
+    for (size_t i = 0; i < streaming.size();) {
+        TcpClientInfo* client = streaming[i];
+        if (client->closing) {
+            end_stream(shard, client, STREAM_ABORTED); // removes streaming[i]
+            continue;
+        }
+
+        TcpInboundStream* stream = client->stream;
+        uint32_t released = 0;
+        while (!stream->in_flight.empty() && stream->in_flight.front().buffer.use_count() == 1) {
+            released += stream->in_flight.front().data_bytes;
+            stream->in_flight.pop_front();
+        }
+        if (released > 0) {
+            stream->credit += released;
+            send_stream_control(shard, client, MSG_STREAM_CREDIT, stream->stream_id, released);
+        }
+        i++;
+    }
+}
+
+// Recipients release chunks on their own shards without waking this one,
+// so the reactor polls while any credit is outstanding
+bool streams_waiting(const TcpShard* shard) {
+    for (const TcpClientInfo* client : shard->streaming_clients) {
+        if (!client->stream->in_flight.empty()) return true;
+    }
+    return false;
+}
+
+// End of an event batch: settle streams, flush if due, then free closed
+// clients
+void finish_batch(TcpShard* shard) {
+    update_streams(shard);
+    if (g_tcp_config.coalesce_us == 0 || shard->tick_due) {
+        shard->tick_due = false;
+        flush_dirty_clients(shard);
+    } else if (!shard->dirty_clients.empty() && !shard->tick_armed) {
+        arm_tick(shard);
+    }
+    close_pending_clients(shard);
+}
+
+// Members of the room on all shards. Each shard's count is an atomic, so
+// the total is a snapshot that needs no lock.
+size_t room_population(uint32_t room) {
+    size_t members = 0;
+    for (TcpShard* shard : g_tcp_shards) members += shard->rooms.size(room);
+    return members;
+}
+
+// Chat from the client goes to, and comes from, the new room only. An open
+// stream keeps going to the room it started in.
+void change_room(TcpShard* shard, TcpClientInfo* client, uint32_t room) {
+    if (room == client->room) return;
+    shard->rooms.leave(client->room, reinterpret_cast<uint64_t>(client));
+    shard->rooms.join(room, reinterpret_cast<uint64_t>(client));
+    client->room = room;
+}
+
+void handle_message(TcpShard* shard, TcpClientInfo* client, const TcpFrame& frame) {
+    int client_id = client->client_id; // Ignore whatever ID the client claims
+    metric_add(METRIC_MESSAGES_IN);
+
+    switch (frame.type) {
+        case MSG_CHAT: {
+            // With a scheduler, formatting and fan-out run on a worker. The
+            // sender's id keys the task so its messages stay in order.
+            if (g_tcp_scheduler != nullptr) {
+                TcpSharedBuffer payload = TcpSharedBuffer::allocate(frame.payload_length);
+                payload.append(frame.payload, frame.payload_length);
+                uint64_t arg = ((uint64_t)client->room << 32) | (uint32_t)client_id;
+                g_tcp_scheduler->submit_ordered((uint64_t)client_id, Task{broadcast_chat_task, move(payload), arg, nullptr});
+                break;
+            }
+
+            // Broadcast chat message to everyone else in the sender's room. The
+            // prefix is formatted on the stack and encoded together with the
+            // payload.
+            char prefix[64];
+            int prefix_length = snprintf(prefix, sizeof(prefix), "[%s] Client %d: ",
+                                         cached_timestamp(), client_id);
+            broadcast_message(shard, MSG_CHAT, client_id, prefix, (uint32_t)prefix_length,
+                              frame.payload, frame.payload_length, client->room, client_id);
+            if (g_tcp_log != nullptr) g_tcp_log->append(client->room, (uint32_t)client_id, frame.payload, frame.payload_length);
+            LOG_DEBUG("Broadcasted message from client %d", client_id);
+            break;
+        }
+
+        case MSG_STATS: {
+            // Send server statistics to requesting client. Everything here
+            // is read from atomics; no lock is taken.
+            char stats_msg[1024];
+            int length = snprintf(stats_msg, sizeof(stats_msg),
+                                  "Server Statistics:\n"
+                                  " Clients connected: %zu\n"
+                                  " Server uptime: %d seconds\n"
+                                  " Rooms: %zu\n"
+                                  " Slow consumers: dropped oldest %llu, dropped newest %llu, disconnected %llu",
+                                  g_tcp_clients.size(), (int)g_tcp_server_stats.get_uptime_seconds(), g_tcp_rooms.size(),
+                                  (unsigned long long)g_tcp_server_stats.dropped_oldest.load(),
+                                  (unsigned long long)g_tcp_server_stats.dropped_newest.load(),
+                                  (unsigned long long)g_tcp_server_stats.slow_disconnects.load());
+            length += ServerMetrics::instance().format_report(stats_msg + length, sizeof(stats_msg) - length);
+            length = min(length, (int)sizeof(stats_msg) - 1);
+            if (g_tcp_config.idle_timeout_ms > 0) {
+                length += snprintf(stats_msg + length, sizeof(stats_msg) - length,
+                                   "\n Idle timeout: %lld s, keepalive probes %llu, idle disconnects %llu",
+                                   (long long)(g_tcp_config.idle_timeout_ms / 1000),
+                                   (unsigned long long)g_tcp_server_stats.keepalive_probes.load(),
+                                   (unsigned long long)g_tcp_server_stats.idle_disconnects.load());
+                length = min(length, (int)sizeof(stats_msg) - 1);
+            }
+            if (g_tcp_scheduler != nullptr) {
+                length += g_tcp_scheduler->format_report(stats_msg + length, sizeof(stats_msg) - length);
+                length = min(length, (int)sizeof(stats_msg) - 1);
+            }
+            if (g_tcp_log != nullptr) {
+                length += g_tcp_log->format_report(stats_msg + length, sizeof(stats_msg) - length);
+                length = min(length, (int)sizeof(stats_msg) - 1);
+            }
+
+            // client_id 0 = server response
+            enqueue_message(shard, client, make_shared_message(client->decoder.framed(), MSG_STATS, 0,
+                                                               stats_msg, (uint32_t)length));
+            LOG_DEBUG("Sent stats to client %d", client_id);
+            break;
+        }
+
+        case MSG_HELLO: {
+            // Offer to switch to the framed format. The reply still goes out
+            // in the legacy format; everything after it is framed.
+            string offer(frame.payload, frame.payload_length);
+            if (!client->decoder.framed() && offer == TCP_FRAMED_HELLO) {
+                send_message(shard, client, MSG_HELLO, client_id, offer);
+                client->decoder.set_framed(true);
+                LOG_DEBUG("Client %d switched to framed protocol", client_id);
+                // Catch the new client up on the lobby; legacy clients
+                // would not know what to make of MSG_HISTORY
+                if (g_tcp_log != nullptr) request_history(client, history_last_request(HISTORY_ON_JOIN), true);
+            }
+            break;
+        }
+
+        case MSG_JOIN:
+        case MSG_LEAVE: {
+            // Leaving a room means going back to the lobby
+            string name = (frame.type == MSG_JOIN) ? string(frame.payload, frame.payload_length) : "lobby";
+            uint32_t room;
+            string reply;
+            bool joined = g_tcp_rooms.lookup(name, room);
+            if (joined) {
+                change_room(shard, client, room);
+                reply = "Now in room " + name + " (" + to_string(room_population(room)) + " members)";
+                LOG_DEBUG("Client %d moved to room %s", client_id, name.c_str());
+            } else if (!RoomDirectory::valid_name(name)) {
+                reply = "Invalid room name (up to 32 letters, digits, '-', '_' or '.')";
+            } else {
+                reply = "Too many rooms";
+            }
+            send_message(shard, client, frame.type, 0, reply);
+            if (joined && g_tcp_log != nullptr) {
+                request_history(client, history_last_request(HISTORY_ON_JOIN), true);
+            }
+            break;
+        }
+
+        case MSG_HISTORY:
+            request_history(client, string(frame.payload, frame.payload_length), false);
+            break;
+
+        case MSG_PING:
+            break; // a keepalive answer; receiving it already reset the idle timer
+
+        case MSG_STREAM_BEGIN:
+        case MSG_STREAM_DATA:
+        case MSG_STREAM_END:
+        case MSG_STREAM_CREDIT:
+            if (!client->decoder.framed()) break; // cannot be a stream, ignore like before
+            if (!handle_stream_frame(shard, client, frame)) {
+                LOG_WARN("Stream protocol error from client %d", client_id);
+                schedule_close(shard, client);
+            }
+            break;
+
+        default:
+            LOG_DEBUG("Unknown message type %u from client %d", frame.type, client_id);
+            break;
+    }
+}
+
+// Read one chunk, then dispatch every complete message in it. A single recv
+// may return a partial message or several of them; leftovers stay buffered.
+// Reading only one chunk per readiness event bounds how many broadcasts a
+// flooding sender can queue before the end-of-batch flush, and gives other
+// clients their turn; level-triggered epoll reports the rest next time.
+void dispatch_frames(TcpShard* shard, TcpClientInfo* client) {
+    TcpFrame frame;
+    while (!client->closing) {
+        int result = client->decoder.next(frame);
+        if (result == 0) break;
+        if (result < 0) {
+            LOG_WARN("Protocol error from client %d", client->client_id);
+            schedule_close(shard, client);
+            break;
+        }
+        handle_message(shard, client, frame);
+    }
+}
+
+void read_client(TcpShard* shard, TcpClientInfo* client) {
+    char buffer[TCP_READ_CHUNK];
+    bool peer_closed = false;
+
+    while (true) {
+        ssize_t bytes_received = recv(client->socket_fd, buffer, sizeof(buffer), 0);
+        if (bytes_received > 0) {
+            client->last_active_ms = monotonic_ms();
+            client->decoder.feed(buffer, bytes_received);
+            metric_add(METRIC_BYTES_IN, bytes_received);
+            break;
+        }
+        if (bytes_received == -1 && errno == EINTR) continue;
+        if (bytes_received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        peer_closed = true;
+        break;
+    }
+
+    dispatch_frames(shard, client);
+
+    if (peer_closed) {
+        schedule_close(shard, client);
+    }
+}
+
+// Make a connection known to its shard, its room and the registry
+TcpClientInfo* register_client(TcpShard* shard, int client_socket, const sockaddr_in& client_addr, int client_id,
+                               uint32_t room) {
+    // Get client IP and port
+    string client_ip = inet_ntoa(client_addr.sin_addr);
+    int client_port = ntohs(client_addr.sin_port);
+
+    // Output is already batched per event batch or coalescing window; Nagle
+    // would only hold back the tail of each flush
+    int nodelay = 1;
+    setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    int zerocopy = 1;
+    bool zerocopy_enabled = g_tcp_config.backend == BACKEND_EPOLL &&
+                            setsockopt(client_socket, SOL_SOCKET, SO_ZEROCOPY, &zerocopy, sizeof(zerocopy)) == 0;
+
+    TcpClientInfo* client_info = new TcpClientInfo(client_socket, client_id, client_ip, client_port);
+    client_info->zerocopy = zerocopy_enabled;
+    client_info->room = room;
+    client_info->last_active_ms = monotonic_ms();
+    client_info->idle_timer.data = reinterpret_cast<uint64_t>(client_info);
+    if (shard->idle_wheel != nullptr) {
+        shard->idle_wheel->schedule(&client_info->idle_timer,
+                                    client_info->last_active_ms + max<int64_t>(g_tcp_config.idle_timeout_ms / 3, 1));
+    }
+    shard->clients[client_socket] = client_info;
+    shard->rooms.join(room, reinterpret_cast<uint64_t>(client_info));
+    // The kernel never hands out a live ip:port twice, so an entry already
+    // holding this endpoint belongs to a connection that is closed but not yet
+    // freed (io_uring completions can lag). Replace it; the stale client's own
+    // erase later finds nothing under its id and leaves this entry alone.
+    TcpClientRef ref{client_info->client_id, shard->index, client_socket};
+    if (!g_tcp_clients.insert(client_info->client_id, pack_endpoint(client_addr), ref)) {
+        int stale_id = -1;
+        g_tcp_clients.with_endpoint(pack_endpoint(client_addr),
+                                    [&](TcpClientRef& stale) { stale_id = stale.client_id; });
+        LOG_WARN("Client %d from %s:%d replaces stale registry entry %d", client_info->client_id,
+                 client_ip.c_str(), client_port, stale_id);
+        if (stale_id < 0 || !g_tcp_clients.erase((uint32_t)stale_id) ||
+            !g_tcp_clients.insert(client_info->client_id, pack_endpoint(client_addr), ref)) {
+            LOG_ERROR("Client %d could not be registered", client_info->client_id);
+        }
+    }
+    return client_info;
+}
+
+TcpClientInfo* add_client(TcpShard* shard, int client_socket, const sockaddr_in& client_addr) {
+    TcpClientInfo* client_info = register_client(shard, client_socket, client_addr, g_tcp_next_client_id++,
+                                                 RoomDirectory::LOBBY);
+    LOG_INFO("Client %d connected from %s:%d on shard %d", client_info->client_id,
+             client_info->client_ip.c_str(), client_info->client_port, shard->index);
+    return client_info;
+}
+
+void accept_clients(TcpShard* shard) {
+    while (true) {
+        struct sockaddr_in client_addr;
+        socklen_t client_addrlen = sizeof(client_addr);
+
+        int client_socket = accept4(shard->listen_fd, (struct sockaddr*)&client_addr, &client_addrlen, SOCK_NONBLOCK);
+        if (client_socket < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG_ERROR("Accept failed: %s", strerror(errno));
+            }
+            return;
+        }
+
+        TcpClientInfo* client_info = add_client(shard, client_socket, client_addr);
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = client_socket;
+        if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+            LOG_ERROR("Failed to register client with epoll: %s", strerror(errno));
+            schedule_close(shard, client_info);
+        }
+    }
+}
+
+// io_uring: one multishot accept yields a completion per new connection
+void arm_accept(TcpShard* shard) {
+    io_uring_sqe* sqe = shard->ring->get_sqe();
+    if (sqe == nullptr) return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = shard->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = TCP_OP_ACCEPT;
+    shard->accept_armed = true;
+}
+
+// io_uring: one multishot recv per connection; the kernel picks a buffer
+// from the shard's provided buffer ring for every chunk it delivers
+void arm_recv(TcpShard* shard, TcpClientInfo* client) {
+    if (shard->input_paused) return; // re-armed when the shard resumes or by the next process
+    io_uring_sqe* sqe = shard->ring->get_sqe();
+    if (sqe == nullptr) {
+        schedule_close(shard, client);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->socket_fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = shard->ring->buffer_group();
+    sqe->user_data = reinterpret_cast<uint64_t>(client) | TCP_OP_RECV;
+    client->recv_armed = true;
+}
+
+// io_uring: multishot poll on the inbox eventfd, drained with a plain read
+// Wake the reactor after TCP_STREAM_POLL_MS to credit released stream chunks
+void arm_stream_timer(TcpShard* shard) {
+    io_uring_sqe* sqe = shard->ring->get_sqe();
+    if (sqe == nullptr) return;
+    shard->stream_timer.tv_sec = 0;
+    shard->stream_timer.tv_nsec = TCP_STREAM_POLL_MS * 1000000L;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = reinterpret_cast<uint64_t>(&shard->stream_timer);
+    sqe->len = 1;
+    sqe->user_data = TCP_OP_TIMER;
+    shard->stream_timer_armed = true;
+}
+
+void arm_tick_poll(TcpShard* shard) {
+    io_uring_sqe* sqe = shard->ring->get_sqe();
+    if (sqe == nullptr) return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = shard->tick_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = TCP_OP_TICK;
+}
+
+void arm_wheel_poll(TcpShard* shard) {
+    io_uring_sqe* sqe = shard->ring->get_sqe();
+    if (sqe == nullptr) return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = shard->wheel_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = TCP_OP_WHEEL;
+}
+
+void arm_inbox(TcpShard* shard) {
+    io_uring_sqe* sqe = shard->ring->get_sqe();
+    if (sqe == nullptr) return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = shard->inbox_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = TCP_OP_INBOX;
+}
+
+void handle_completion(TcpShard* shard, const io_uring_cqe& cqe) {
+    uint64_t op = cqe.user_data & TCP_OP_MASK;
+    TcpClientInfo* client = reinterpret_cast<TcpClientInfo*>(cqe.user_data & ~(uint64_t)TCP_OP_MASK);
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+
+    switch (op) {
+        case TCP_OP_ACCEPT: {
+            if (cqe.res >= 0) {
+                struct sockaddr_in client_addr;
+                socklen_t client_addrlen = sizeof(client_addr);
+                memset(&client_addr, 0, sizeof(client_addr));
+                getpeername(cqe.res, (struct sockaddr*)&client_addr, &client_addrlen);
+                arm_recv(shard, add_client(shard, cqe.res, client_addr));
+            } else if (cqe.res != -EAGAIN && cqe.res != -EINTR && cqe.res != -ECANCELED) {
+                LOG_ERROR("Accept failed: %s", strerror(-cqe.res));
+            }
+            if (!more) {
+                shard->accept_armed = false;
+                if (!shard->input_paused) arm_accept(shard);
+            }
+            break;
+        }
+
+        case TCP_OP_RECV: {
+            if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+                unsigned buffer_id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                client->last_active_ms = monotonic_ms();
+                client->decoder.feed(shard->ring->buffer(buffer_id), cqe.res);
+                shard->ring->recycle_buffer(buffer_id);
+                metric_add(METRIC_BYTES_IN, cqe.res);
+                dispatch_frames(shard, client);
+            }
+            if (!more) {
+                client->recv_armed = false;
+                if (client->closing || shard->input_paused) break; // a hot upgrade cancelled it
+                if (cqe.res > 0 || cqe.res == -ENOBUFS) {
+                    arm_recv(shard, client); // ended early, not by the peer
+                } else {
+                    schedule_close(shard, client);
+                }
+            }
+            break;
+        }
+
+        case TCP_OP_SEND: {
+            TcpSendBatch* batch = reinterpret_cast<TcpSendBatch*>(cqe.user_data & ~(uint64_t)TCP_OP_MASK);
+            if (cqe.flags & IORING_CQE_F_NOTIF) {
+                // Zero-copy send: the kernel is done with the buffers. The
+                // client may already be gone, so only the batch is touched.
+                if (cqe.res & IORING_NOTIF_USAGE_ZC_COPIED) metric_add(METRIC_ZEROCOPY_COPIED);
+                recycle_batch(shard, batch);
+                break;
+            }
+            client = batch->client;
+            client->inflight_sends -= batch->messages;
+            // A zero-copy request is always followed by its notification,
+            // even when cancelled without IORING_CQE_F_MORE
+            if (!batch->zerocopy) recycle_batch(shard, batch);
+            if (cqe.res > 0) {
+                consume_sent(client, cqe.res);
+            } else if (cqe.res < 0 && cqe.res != -ECANCELED && !client->closing) {
+                LOG_WARN("Failed to send message to client %d", client->client_id);
+                metric_add(METRIC_SEND_ERRORS);
+                schedule_close(shard, client);
+            }
+            if (client->inflight_sends == 0 && !client->out_queue.empty()) {
+                submit_sends(shard, client); // backlog: do not wait for the next flush
+            }
+            break;
+        }
+
+        case TCP_OP_INBOX:
+            drain_inbox(shard);
+            if (!more) arm_inbox(shard);
+            break;
+
+        case TCP_OP_TICK:
+            handle_tick(shard);
+            if (!more) arm_tick_poll(shard);
+            break;
+
+        case TCP_OP_TIMER:
+            shard->stream_timer_armed = false; // finish_batch() polls the streams
+            break;
+
+        case TCP_OP_WHEEL:
+            advance_idle_timers(shard);
+            if (!more) arm_wheel_poll(shard);
+            break;
+    }
+}
+
+// Hot upgrade. The old process's handover thread walks every reactor
+// through these phases and waits until all of them have carried out each
+// one; the reactors notice a new phase after their next event batch.
+enum TcpHandoverPhase {
+    HANDOVER_NONE,        // serving normally
+    HANDOVER_PAUSE_INPUT, // stop accepting and reading; output keeps flowing
+    HANDOVER_FREEZE,      // inbox drained, sends settled, reactor parked for the snapshot
+    HANDOVER_RESUME       // the new process gave up: undo the pause and carry on
+};
+
+struct TcpHandoverControl {
+    atomic<int> phase;
+    pthread_mutex_t mutex; // guards arrived; parked reactors wait on cv
+    pthread_cond_t cv;
+    int arrived;           // shards that have carried out the current phase
+
+    TcpHandoverControl() : phase(HANDOVER_NONE), arrived(0) {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&cv, NULL);
+    }
+};
+
+TcpHandoverControl g_tcp_handover;
+
+// io_uring: cancel the request with this user_data, or with fd >= 0 every
+// request on that socket
+void cancel_requests(TcpShard* shard, uint64_t user_data, int fd = -1) {
+    io_uring_sqe* sqe = shard->ring->get_sqe();
+    if (sqe == nullptr) return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    if (fd >= 0) {
+        sqe->fd = fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    } else {
+        sqe->fd = -1;
+        sqe->addr = user_data;
+    }
+    sqe->user_data = 0;
 }
 
+// Stop taking connections and reading requests. Bytes already received
+// stay in the decoders and move to the new process unparsed.
+void pause_input(TcpShard* shard) {
+    shard->input_paused = true;
+    if (shard->ring == nullptr) {
+        epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, shard->listen_fd, NULL);
+        for (auto& entry : shard->clients) {
+            if (!entry.second->closing) update_events(shard, entry.second);
+        }
+        return;
+    }
+    if (shard->accept_armed) cancel_requests(shard, TCP_OP_ACCEPT);
+    for (auto& entry : shard->clients) {
+        TcpClientInfo* client = entry.second;
+        if (client->recv_armed) cancel_requests(shard, reinterpret_cast<uint64_t>(client) | TCP_OP_RECV);
+    }
+}
+
+// io_uring: the cancelled accept and receives have all completed
+bool input_stopped(const TcpShard* shard) {
+    if (shard->ring == nullptr) return true;
+    if (shard->accept_armed) return false;
+    for (const auto& entry : shard->clients) {
+        if (entry.second->recv_armed) return false;
+    }
+    return true;
+}
+
+// Deliver whatever the workers posted, then write out what the sockets
+// take. io_uring sends still in flight are cancelled instead of waited for
+// (a client may not be reading); a partly done send reports its bytes like
+// a short one. Returns true once nothing is in flight and every closed
+// client is gone.
+bool freeze_output(TcpShard* shard) {
+    if (!shard->sends_stopped) {
+        drain_inbox(shard);
+        update_streams(shard);
+        if (shard->ring == nullptr) {
+            flush_dirty_clients(shard);
+        } else {
+            for (TcpClientInfo* client : shard->dirty_clients) client->dirty = false;
+            shard->dirty_clients.clear();
+            for (auto& entry : shard->clients) {
+                TcpClientInfo* client = entry.second;
+                if (client->inflight_sends > 0) cancel_requests(shard, 0, client->socket_fd);
+            }
+        }
+        shard->sends_stopped = true;
+    }
+    close_pending_clients(shard);
+    if (!shard->pending_close.empty()) return false;
+    for (const auto& entry : shard->clients) {
+        if (entry.second->inflight_sends > 0) return false;
+    }
+    return true;
+}
+
+void resume_io(TcpShard* shard) {
+    shard->input_paused = false;
+    shard->sends_stopped = false;
+    if (shard->ring == nullptr) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = shard->listen_fd;
+        epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->listen_fd, &ev);
+        for (auto& entry : shard->clients) {
+            if (!entry.second->closing) update_events(shard, entry.second);
+        }
+        return;
+    }
+    if (!shard->accept_armed) arm_accept(shard);
+    for (auto& entry : shard->clients) {
+        TcpClientInfo* client = entry.second;
+        if (client->closing) continue;
+        if (!client->recv_armed) arm_recv(shard, client);
+        if (!client->out_queue.empty()) submit_sends(shard, client);
+    }
+}
+
+void report_handover_phase() {
+    pthread_mutex_lock(&g_tcp_handover.mutex);
+    g_tcp_handover.arrived++;
+    pthread_cond_broadcast(&g_tcp_handover.cv);
+    pthread_mutex_unlock(&g_tcp_handover.mutex);
+}
+
+// Called by the reactor after every event batch. A frozen reactor blocks
+// here until the handover thread either ends the process or resumes it.
+void follow_handover(TcpShard* shard) {
+    while (true) {
+        int phase = g_tcp_handover.phase.load(memory_order_acquire);
+        if (phase == shard->handover_phase) return;
+
+        switch (phase) {
+            case HANDOVER_PAUSE_INPUT:
+                if (!shard->input_paused) pause_input(shard);
+                if (!input_stopped(shard)) return; // wait for the cancellations
+                break;
+            case HANDOVER_FREEZE:
+                if (!freeze_output(shard)) return;
+                break;
+            case HANDOVER_RESUME:
+                resume_io(shard);
+                break;
+            default:
+                break;
+        }
+        shard->handover_phase = phase;
+        if (phase == HANDOVER_NONE) return;
+        report_handover_phase();
+        if (phase != HANDOVER_FREEZE) return;
+
+        pthread_mutex_lock(&g_tcp_handover.mutex);
+        while (g_tcp_handover.phase.load() == HANDOVER_FREEZE) {
+            pthread_cond_wait(&g_tcp_handover.cv, &g_tcp_handover.mutex);
+        }
+        pthread_mutex_unlock(&g_tcp_handover.mutex);
+    }
+}
+
+// Connections taken over from the previous process may already hold
+// complete requests; their queued output goes out with this first batch
+void start_adopted_clients(TcpShard* shard) {
+    for (TcpClientInfo* client : shard->adopted) {
+        if (shard->ring != nullptr) arm_recv(shard, client);
+        dispatch_frames(shard, client);
+    }
+    shard->adopted.clear();
+    finish_batch(shard);
+}
+
+void pin_reactor(TcpShard* shard) {
+    if (shard->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(shard->cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+            LOG_WARN("Failed to pin shard %d to core %d", shard->index, shard->cpu);
+        }
+    }
+}
+
+// io_uring reactor: everything prepared during one batch of completions --
+// re-armed receives and the linked send chains of every dirty client -- goes
+// to the kernel with the single io_uring_enter that also waits for the next
+// batch.
+void* run_uring_reactor(void* arg) {
+    TcpShard* shard = static_cast<TcpShard*>(arg);
+    pin_reactor(shard);
+
+    arm_accept(shard);
+    arm_inbox(shard);
+    if (shard->tick_fd != -1) arm_tick_poll(shard);
+    if (shard->wheel_fd != -1) arm_wheel_poll(shard);
+    start_adopted_clients(shard);
+
+    while (true) {
+        if (shard->sends_prepared) {
+            metric_add(METRIC_SEND_SYSCALLS);
+            shard->sends_prepared = false;
+        }
+        if (!shard->stream_timer_armed && streams_waiting(shard)) arm_stream_timer(shard);
+
+        // Completions left over from the last batch are handled without
+        // waiting; the submit still goes out first so sends keep pace
+        unsigned wait_nr = shard->ring->ready_completions() > 0 ? 0 : 1;
+        int ret = 0;
+        if (wait_nr > 0 || shard->ring->pending_submissions() > 0) ret = shard->ring->submit_and_wait(wait_nr);
+        if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY) {
+            LOG_ERROR("io_uring_enter failed: %s", strerror(-ret));
+            break;
+        }
+
+        shard->ring->for_each_cqe([shard](const io_uring_cqe& cqe) { handle_completion(shard, cqe); },
+                                  TCP_MAX_EVENTS);
+
+        finish_batch(shard);
+        follow_handover(shard);
+    }
+
+    return nullptr;
+}
+
+void* run_reactor(void* arg) {
+    TcpShard* shard = static_cast<TcpShard*>(arg);
+    struct epoll_event events[TCP_MAX_EVENTS];
+    pin_reactor(shard);
+    start_adopted_clients(shard);
+
+    while (true) {
+        // Closed clients left in pending_close wait for zero-copy completions
+        int timeout = (streams_waiting(shard) || !shard->pending_close.empty()) ? TCP_STREAM_POLL_MS : -1;
+        int n = epoll_wait(shard->epoll_fd, events, TCP_MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            LOG_ERROR("epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == shard->listen_fd) {
+                accept_clients(shard);
+                continue;
+            }
+            if (fd == shard->inbox_fd) {
+                drain_inbox(shard);
+                continue;
+            }
+            if (fd == shard->tick_fd) {
+                handle_tick(shard);
+                continue;
+            }
+            if (fd == shard->wheel_fd) {
+                advance_idle_timers(shard);
+                continue;
+            }
+
+            auto it = shard->clients.find(fd);
+            if (it == shard->clients.end()) continue;
+            TcpClientInfo* client = it->second;
+            if (client->closing) continue;
+
+            // EPOLLERR also signals zero-copy completions on the error queue
+            if ((events[i].events & EPOLLHUP) || ((events[i].events & EPOLLERR) && !drain_zerocopy(client))) {
+                schedule_close(shard, client);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                flush_client(shard, client);
+            }
+            if (!client->closing && (events[i].events & EPOLLIN)) {
+                read_client(shard, client);
+            }
+        }
+
+        finish_batch(shard);
+        follow_handover(shard);
+    }
+
+    return nullptr;
+}
+
+// Every shard binds its own listener to the same port; the kernel spreads
+// incoming connections across them.
+int create_listener(int port) {
+    int server_fd, opt = 1;
+    struct sockaddr_in server_addr;
+
+    // Create socket
+    server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (server_fd == -1) {
+        cerr << "Socket creation failed!" << endl;
+        return -1;
+    }
 
+    // Set socket options
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        cerr << "Socket setsockopt error!" << endl;
+        close(server_fd);
+        return -1;
+    }
 
+    // Configure server address
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+    memset(server_addr.sin_zero, '\0', sizeof(server_addr.sin_zero));
 
+    // Bind socket
+    if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        cerr << "Bind failed!" << endl;
+        close(server_fd);
+        return -1;
+    }
+
+    // Listen for connections
+    if (listen(server_fd, SOMAXCONN) < 0) {
+        cerr << "Listen failed!" << endl;
+        close(server_fd);
+        return -1;
+    }
+
+    return server_fd;
+}
+
+bool setup_uring_shard(TcpShard* shard) {
+    // io_uring waits on completions itself; blocking fds let it poll
+    // internally instead of failing requests with EAGAIN
+    set_nonblocking(shard->listen_fd, false);
+
+    shard->ring = new IoUring();
+    int ret = shard->ring->init(TCP_URING_ENTRIES);
+    if (ret == 0) ret = shard->ring->setup_buffer_ring(0, TCP_URING_RECV_BUFFERS, TCP_URING_RECV_BUFFER_SIZE);
+    if (ret < 0) {
+        cerr << "Failed to set up io_uring for shard " << shard->index << ": " << strerror(-ret) << endl;
+        return false;
+    }
+    return true;
+}
+
+// A listener taken over from the previous process is used as it is
+bool setup_shard(TcpShard* shard, int port) {
+    if (shard->listen_fd == -1) shard->listen_fd = create_listener(port);
+    if (shard->listen_fd == -1) return false;
+
+    if (g_tcp_config.coalesce_us > 0) {
+        shard->tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        if (shard->tick_fd == -1) {
+            cerr << "Failed to create coalescing timer for shard " << shard->index << endl;
+            return false;
+        }
+    }
+
+    if (g_tcp_config.idle_timeout_ms > 0) {
+        struct itimerspec tick;
+        tick.it_value.tv_sec = tick.it_interval.tv_sec = 0;
+        tick.it_value.tv_nsec = tick.it_interval.tv_nsec = TCP_WHEEL_TICK_MS * 1000000L;
+        shard->wheel_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        if (shard->wheel_fd == -1 || timerfd_settime(shard->wheel_fd, 0, &tick, NULL) != 0) {
+            cerr << "Failed to create idle timer for shard " << shard->index << endl;
+            return false;
+        }
+        shard->idle_wheel = new TimerWheel(TCP_WHEEL_TICK_MS, monotonic_ms());
+    }
+
+    if (g_tcp_config.backend == BACKEND_URING) {
+        shard->inbox_fd = eventfd(0, EFD_NONBLOCK);
+        return shard->inbox_fd != -1 && setup_uring_shard(shard);
+    }
+
+    set_nonblocking(shard->listen_fd, true);
+    shard->epoll_fd = epoll_create1(0);
+    shard->inbox_fd = eventfd(0, EFD_NONBLOCK);
+    if (shard->epoll_fd == -1 || shard->inbox_fd == -1) {
+        cerr << "Failed to create epoll/eventfd for shard " << shard->index << endl;
+        return false;
+    }
+
+    int fds[4] = {shard->listen_fd, shard->inbox_fd, shard->tick_fd, shard->wheel_fd};
+    for (int fd : fds) {
+        if (fd == -1) continue;
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            cerr << "Failed to register shard " << shard->index << " fds with epoll!" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Hot upgrade messages on the upgrade socket, tagged by their first byte
+enum TcpHandoverMessage {
+    HANDOVER_STATE = 'S', // old -> new: next piece of the serialized state
+    HANDOVER_FDS   = 'F', // old -> new: listeners, then client sockets (SCM_RIGHTS)
+    HANDOVER_END   = 'E', // old -> new: everything sent
+    HANDOVER_READY = 'R', // new -> old: state accepted, stop serving
+    HANDOVER_DONE  = 'D'  // old -> new: message log closed, exiting now
+};
+
+static const uint32_t TCP_HANDOVER_MAGIC = 0x48504354;   // "TCPH"
+static const uint32_t TCP_HANDOVER_VERSION = 1;
+static const size_t TCP_HANDOVER_CHUNK = 60000;          // state bytes per message
+static const int TCP_HANDOVER_TIMEOUT_S = 10;            // per phase and per socket operation
+
+// The state is plain host-order words and length-prefixed strings; both
+// processes run on the same host
+void put_u32(string& out, uint32_t value) { out.append((const char*)&value, sizeof(value)); }
+void put_u64(string& out, uint64_t value) { out.append((const char*)&value, sizeof(value)); }
+void put_bytes(string& out, const string& bytes) {
+    put_u32(out, (uint32_t)bytes.size());
+    out.append(bytes);
+}
+
+struct TcpStateReader {
+    const string& data;
+    size_t offset;
+    bool ok; // false once a read ran past the end
+
+    explicit TcpStateReader(const string& state) : data(state), offset(0), ok(true) {}
+
+    bool take(void* out, size_t length) {
+        ok = ok && data.size() - offset >= length;
+        if (ok) memcpy(out, data.data() + offset, length);
+        if (ok) offset += length;
+        return ok;
+    }
+    uint32_t u32() { uint32_t value = 0; take(&value, sizeof(value)); return value; }
+    uint64_t u64() { uint64_t value = 0; take(&value, sizeof(value)); return value; }
+    string bytes() {
+        uint32_t length = u32();
+        ok = ok && data.size() - offset >= length;
+        if (!ok) return string();
+        offset += length;
+        return data.substr(offset - length, length);
+    }
+};
+
+// A connection as the old process left it
+struct TcpAdoptedClient {
+    uint32_t shard;
+    int socket_fd;
+    int client_id;
+    uint64_t endpoint;      // pack_endpoint()
+    bool framed;
+    string room;
+    string input;           // received, not yet parsed
+    string output;          // encoded, not yet written
+    bool streaming;
+    uint32_t stream_id;
+    string stream_room;
+    uint64_t stream_credit;
+    uint64_t stream_in_flight; // relayed bytes now part of the recipients' output
+};
+
+struct TcpTakeover {
+    vector<int> listeners; // one per shard
+    int next_client_id;
+    vector<TcpAdoptedClient> clients;
+};
+
+void set_socket_timeout(int fd, int seconds) {
+    struct timeval timeout;
+    timeout.tv_sec = seconds;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+// Move every reactor to the phase and wait until all of them carried it
+// out. Returns false if one did not within TCP_HANDOVER_TIMEOUT_S.
+bool run_handover_phase(int phase) {
+    pthread_mutex_lock(&g_tcp_handover.mutex);
+    g_tcp_handover.arrived = 0;
+    g_tcp_handover.phase.store(phase, memory_order_release);
+    pthread_cond_broadcast(&g_tcp_handover.cv);
+    pthread_mutex_unlock(&g_tcp_handover.mutex);
+
+    for (TcpShard* shard : g_tcp_shards) {
+        uint64_t one = 1;
+        if (write(shard->inbox_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            LOG_WARN("Failed to signal shard %d", shard->index);
+        }
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += TCP_HANDOVER_TIMEOUT_S;
+    pthread_mutex_lock(&g_tcp_handover.mutex);
+    int ret = 0;
+    while (g_tcp_handover.arrived < (int)g_tcp_shards.size() && ret != ETIMEDOUT) {
+        ret = pthread_cond_timedwait(&g_tcp_handover.cv, &g_tcp_handover.mutex, &deadline);
+    }
+    bool all = g_tcp_handover.arrived == (int)g_tcp_shards.size();
+    pthread_mutex_unlock(&g_tcp_handover.mutex);
+    return all;
+}
+
+// Serialize the frozen shards: every live connection with its id, room,
+// unparsed input, unwritten output and open stream. fds receives the
+// listeners, then one socket per client record.
+void snapshot_state(string& state, vector<int>& fds) {
+    size_t client_count = 0;
+    for (TcpShard* shard : g_tcp_shards) {
+        for (auto& entry : shard->clients) client_count += !entry.second->closing;
+        fds.push_back(shard->listen_fd);
+    }
+
+    put_u32(state, TCP_HANDOVER_MAGIC);
+    put_u32(state, TCP_HANDOVER_VERSION);
+    put_u32(state, (uint32_t)g_tcp_shards.size());
+    put_u32(state, (uint32_t)g_tcp_next_client_id.load());
+    put_u32(state, (uint32_t)client_count);
+    for (TcpShard* shard : g_tcp_shards) {
+        for (auto& entry : shard->clients) {
+            TcpClientInfo* client = entry.second;
+            if (client->closing) continue;
+            put_u32(state, (uint32_t)shard->index);
+            put_u32(state, (uint32_t)client->client_id);
+            put_u64(state, pack_endpoint(inet_addr(client->client_ip.c_str()), htons(client->client_port)));
+            put_u32(state, client->decoder.framed());
+            put_bytes(state, g_tcp_rooms.name(client->room));
+            put_bytes(state, client->decoder.pending());
+
+            string output;
+            output.reserve(client->out_bytes);
+            for (size_t i = 0; i < client->out_queue.size(); i++) {
+                const TcpSharedBuffer& buffer = client->out_queue[i].buffer;
+                size_t skip = (i == 0) ? client->out_offset : 0;
+                output.append((const char*)buffer.data() + skip, buffer.size() - skip);
+            }
+            put_bytes(state, output);
+
+            TcpInboundStream* stream = client->stream;
+            put_u32(state, stream != nullptr);
+            if (stream != nullptr) {
+                uint64_t in_flight = 0;
+                for (size_t i = 0; i < stream->in_flight.size(); i++) in_flight += stream->in_flight[i].data_bytes;
+                put_u32(state, stream->stream_id);
+                put_bytes(state, g_tcp_rooms.name(stream->room));
+                put_u64(state, stream->credit);
+                put_u64(state, in_flight);
+            }
+            fds.push_back(client->socket_fd);
+        }
+    }
+}
+
+bool send_state(int conn, const string& state, const vector<int>& fds) {
+    char message[TCP_HANDOVER_CHUNK + 1];
+    message[0] = HANDOVER_STATE;
+    for (size_t offset = 0; offset < state.size(); offset += TCP_HANDOVER_CHUNK) {
+        size_t length = min(TCP_HANDOVER_CHUNK, state.size() - offset);
+        memcpy(message + 1, state.data() + offset, length);
+        if (!send_with_fds(conn, message, length + 1, nullptr, 0)) return false;
+    }
+    char tag = HANDOVER_FDS;
+    for (size_t offset = 0; offset < fds.size(); offset += FD_PASSING_MAX_FDS) {
+        size_t count = min(FD_PASSING_MAX_FDS, fds.size() - offset);
+        if (!send_with_fds(conn, &tag, 1, fds.data() + offset, count)) return false;
+    }
+    tag = HANDOVER_END;
+    return send_with_fds(conn, &tag, 1, nullptr, 0);
+}
+
+// Old process: pause, freeze and hand everything to the process on the
+// other end of conn. Does not return if the new process took over.
+void hand_over(int conn) {
+    LOG_INFO("Hot upgrade requested, pausing input");
+    bool ok = run_handover_phase(HANDOVER_PAUSE_INPUT);
+    if (ok && g_tcp_scheduler != nullptr) g_tcp_scheduler->wait_idle(); // chat and history already parsed
+    ok = ok && run_handover_phase(HANDOVER_FREEZE);
+
+    if (ok) {
+        string state;
+        vector<int> fds;
+        snapshot_state(state, fds);
+        char reply = 0;
+        vector<int> unexpected;
+        ok = send_state(conn, state, fds) && recv_with_fds(conn, &reply, 1, unexpected) == 1 &&
+             reply == HANDOVER_READY;
+        for (int fd : unexpected) close(fd);
+        if (ok) {
+            LOG_INFO("Handed %zu connections to the new process, exiting", fds.size() - g_tcp_shards.size());
+            delete g_tcp_log; // the new process opens the log once we are done with it
+            g_tcp_log = nullptr;
+            Logger::instance().flush();
+            char done = HANDOVER_DONE;
+            send_with_fds(conn, &done, 1, nullptr, 0);
+            _exit(0);
+        }
+    }
+
+    LOG_WARN("Hot upgrade failed, resuming");
+    run_handover_phase(HANDOVER_RESUME);
+    g_tcp_handover.phase.store(HANDOVER_NONE, memory_order_release);
+}
+
+// Old process: serve hot upgrade requests on the upgrade socket, one at a
+// time, for as long as the process runs
+void* handover_thread(void* arg) {
+    int listener = (int)(intptr_t)arg;
+    while (true) {
+        int conn = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            LOG_ERROR("Upgrade socket accept failed: %s", strerror(errno));
+            return nullptr;
+        }
+        set_socket_timeout(conn, TCP_HANDOVER_TIMEOUT_S);
+        hand_over(conn);
+        close(conn);
+    }
+}
+
+bool parse_state(const string& state, const vector<int>& fds, TcpTakeover& takeover, string& error) {
+    TcpStateReader reader(state);
+    uint32_t magic = reader.u32();
+    uint32_t version = reader.u32();
+    uint32_t shard_count = reader.u32();
+    takeover.next_client_id = (int)reader.u32();
+    uint32_t client_count = reader.u32();
+    if (!reader.ok || magic != TCP_HANDOVER_MAGIC || version != TCP_HANDOVER_VERSION) {
+        error = "unrecognized state from the running server";
+        return false;
+    }
+    if (shard_count == 0 || fds.size() != (size_t)shard_count + client_count) {
+        error = "expected " + to_string(shard_count + client_count) + " descriptors, got " + to_string(fds.size());
+        return false;
+    }
+
+    takeover.listeners.assign(fds.begin(), fds.begin() + shard_count);
+    for (uint32_t i = 0; i < client_count && reader.ok; i++) {
+        TcpAdoptedClient client;
+        client.shard = reader.u32();
+        client.socket_fd = fds[shard_count + i];
+        client.client_id = (int)reader.u32();
+        client.endpoint = reader.u64();
+        client.framed = reader.u32() != 0;
+        client.room = reader.bytes();
+        client.input = reader.bytes();
+        client.output = reader.bytes();
+        client.streaming = reader.u32() != 0;
+        client.stream_id = 0;
+        client.stream_credit = client.stream_in_flight = 0;
+        if (client.streaming) {
+            client.stream_id = reader.u32();
+            client.stream_room = reader.bytes();
+            client.stream_credit = reader.u64();
+            client.stream_in_flight = reader.u64();
+        }
+        if (client.shard >= shard_count) reader.ok = false;
+        takeover.clients.push_back(move(client));
+    }
+    if (!reader.ok || reader.offset != state.size()) {
+        error = "truncated state from the running server";
+        return false;
+    }
+    return true;
+}
+
+// New process: fetch the running server's listeners, connections and
+// state through its upgrade socket. On failure the old process resumes
+// serving as if nothing happened. On success it is exiting and the caller
+// owns every descriptor in takeover.
+bool take_over(const string& path, TcpTakeover& takeover, string& error) {
+    int conn = connect_unix(path);
+    if (conn == -1) {
+        error = "cannot connect to " + path + ": " + strerror(errno);
+        return false;
+    }
+    set_socket_timeout(conn, TCP_HANDOVER_TIMEOUT_S * 3); // covers the old process's pause and freeze
+
+    string state;
+    vector<int> fds;
+    vector<char> message(TCP_HANDOVER_CHUNK + 1);
+    bool complete = false;
+    while (!complete) {
+        ssize_t length = recv_with_fds(conn, message.data(), message.size(), fds);
+        if (length <= 0) break;
+        if (message[0] == HANDOVER_STATE) state.append(message.data() + 1, length - 1);
+        complete = message[0] == HANDOVER_END;
+    }
+
+    bool ok = complete && parse_state(state, fds, takeover, error);
+    if (!complete) error = "the running server did not send its state";
+    char reply = HANDOVER_READY;
+    ok = ok && send_with_fds(conn, &reply, 1, nullptr, 0);
+    if (!ok) {
+        if (error.empty()) error = "the running server went away";
+        for (int fd : fds) close(fd);
+        close(conn);
+        return false;
+    }
+
+    // Only HANDOVER_DONE means the old process stopped serving; if it gave
+    // up waiting for our reply it has resumed and must keep the clients.
+    // Waiting for it also lets its message log settle before we open it.
+    char done = 0;
+    vector<int> unexpected;
+    ok = recv_with_fds(conn, &done, 1, unexpected) == 1 && done == HANDOVER_DONE;
+    for (int fd : unexpected) close(fd);
+    close(conn);
+    if (!ok) {
+        error = "the running server did not confirm the handover";
+        for (int fd : fds) close(fd);
+        return false;
+    }
+    return true;
+}
+
+// New process: recreate a handed-over connection on its shard and queue
+// its unwritten output. Credit for stream chunks the old process had in
+// flight is returned at once: those bytes are in the recipients' output now.
+void adopt_client(TcpShard* shard, const TcpAdoptedClient& adopted) {
+    uint32_t room;
+    if (!g_tcp_rooms.lookup(adopted.room, room)) room = RoomDirectory::LOBBY;
+    sockaddr_in client_addr = unpack_endpoint(adopted.endpoint);
+    set_nonblocking(adopted.socket_fd, shard->ring == nullptr);
+    TcpClientInfo* client = register_client(shard, adopted.socket_fd, client_addr, adopted.client_id, room);
+    client->decoder.set_framed(adopted.framed);
+    if (!adopted.input.empty()) client->decoder.feed(adopted.input.data(), adopted.input.size());
+
+    const size_t chunk = MessagePool::class_capacity(MessagePool::CLASS_COUNT - 1);
+    for (size_t offset = 0; offset < adopted.output.size(); offset += chunk) {
+        size_t length = min(chunk, adopted.output.size() - offset);
+        TcpSharedBuffer buffer = TcpSharedBuffer::allocate(length);
+        buffer.append(adopted.output.data() + offset, length);
+        enqueue_message(shard, client, buffer);
+    }
+
+    if (adopted.streaming) {
+        TcpInboundStream* stream = new TcpInboundStream();
+        stream->stream_id = adopted.stream_id;
+        if (!g_tcp_rooms.lookup(adopted.stream_room, stream->room)) stream->room = room;
+        stream->credit = adopted.stream_credit + adopted.stream_in_flight;
+        client->stream = stream;
+        shard->streaming_clients.push_back(client);
+        if (adopted.stream_in_flight > 0) {
+            send_stream_control(shard, client, MSG_STREAM_CREDIT, stream->stream_id,
+                                (uint32_t)adopted.stream_in_flight);
+        }
+    }
+
+    if (shard->ring == nullptr) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = adopted.socket_fd;
+        if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, adopted.socket_fd, &ev) < 0) {
+            LOG_ERROR("Failed to register client with epoll: %s", strerror(errno));
+            schedule_close(shard, client);
+        }
+    }
+    shard->adopted.push_back(client);
+    LOG_DEBUG("Client %d taken over on shard %d", client->client_id, shard->index);
+}
+
+void print_usage(const char* prog) {
+    cerr << "Usage: " << prog << " [port] [--shards N] [--workers N] [--pin] [--backend epoll|uring]" << endl
+         << "       [--coalesce-us N] [--max-queue-bytes N] [--max-queue-msgs N]" << endl
+         << "       [--overflow-policy drop-oldest|drop-newest|disconnect]" << endl
+         << "       [--log-dir DIR] [--log-segment-mb N] [--log-segments N]" << endl
+         << "       [--idle-timeout SEC] [--upgrade-socket PATH] [--takeover PATH]" << endl;
+}
+
+int main(int argc, char* argv[]) {
+    int port = 5000; // Default port
+    int shard_count = 1;
+    int worker_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    bool pin_shards = false;
+    string log_dir;
+    size_t log_segment_bytes = MessageLog::DEFAULT_SEGMENT_BYTES;
+    size_t log_segments = MessageLog::DEFAULT_MAX_SEGMENTS;
+    string upgrade_path;  // listen here for a newer binary taking over
+    string takeover_path; // take over from the server listening here
+
+    // Parse command line arguments
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--shards" && i + 1 < argc) {
+            shard_count = atoi(argv[++i]);
+            if (shard_count <= 0) {
+                cerr << "Invalid shard count. Using 1 shard." << endl;
+                shard_count = 1;
+            }
+        } else if (arg == "--workers" && i + 1 < argc) {
+            worker_count = max(0, atoi(argv[++i]));
+        } else if (arg == "--pin") {
+            pin_shards = true;
+        } else if (arg == "--backend" && i + 1 < argc) {
+            string backend = argv[++i];
+            if (backend == "epoll") {
+                g_tcp_config.backend = BACKEND_EPOLL;
+            } else if (backend == "uring") {
+                g_tcp_config.backend = BACKEND_URING;
+            } else {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (arg == "--coalesce-us" && i + 1 < argc) {
+            g_tcp_config.coalesce_us = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if (arg == "--max-queue-bytes" && i + 1 < argc) {
+            g_tcp_config.max_queue_bytes = strtoull(argv[++i], NULL, 10);
+        } else if (arg == "--max-queue-msgs" && i + 1 < argc) {
+            g_tcp_config.max_queue_msgs = strtoull(argv[++i], NULL, 10);
+        } else if (arg == "--overflow-policy" && i + 1 < argc) {
+            string policy = argv[++i];
+            if (policy == "drop-oldest") {
+                g_tcp_config.overflow_policy = OVERFLOW_DROP_OLDEST;
+            } else if (policy == "drop-newest") {
+                g_tcp_config.overflow_policy = OVERFLOW_DROP_NEWEST;
+            } else if (policy == "disconnect") {
+                g_tcp_config.overflow_policy = OVERFLOW_DISCONNECT;
+            } else {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (arg == "--log-dir" && i + 1 < argc) {
+            log_dir = argv[++i];
+        } else if (arg == "--log-segment-mb" && i + 1 < argc) {
+            log_segment_bytes = max(1UL, strtoul(argv[++i], NULL, 10)) * 1024 * 1024;
+        } else if (arg == "--log-segments" && i + 1 < argc) {
+            log_segments = strtoul(argv[++i], NULL, 10);
+        } else if (arg == "--idle-timeout" && i + 1 < argc) {
+            g_tcp_config.idle_timeout_ms = (int64_t)strtoul(argv[++i], NULL, 10) * 1000;
+        } else if (arg == "--upgrade-socket" && i + 1 < argc) {
+            upgrade_path = argv[++i];
+        } else if (arg == "--takeover" && i + 1 < argc) {
+            takeover_path = argv[++i];
+        } else if (arg[0] != '-') {
+            port = atoi(arg.c_str());
+            if (port <= 0 || port > 65535) {
+                cerr << "Invalid port number. Using default port 5000." << endl;
+                port = 5000;
+            }
+        } else {
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // A peer that vanishes mid-write must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+    ServerMetrics::instance(); // start the rate sampler with the server
+
+    // Hot upgrade: the running server keeps serving until it has handed
+    // over, so everything that can fail on its own is set up afterwards
+    TcpTakeover takeover;
+    if (!takeover_path.empty()) {
+        string error;
+        if (!take_over(takeover_path, takeover, error)) {
+            cerr << "Takeover failed: " << error << endl;
+            exit(EXIT_FAILURE);
+        }
+        if (shard_count != (int)takeover.listeners.size()) {
+            cout << "Keeping the running server's " << takeover.listeners.size() << " shard(s)" << endl;
+        }
+        shard_count = (int)takeover.listeners.size();
+        g_tcp_next_client_id = takeover.next_client_id;
+    }
+
+    if (worker_count > 0) g_tcp_scheduler = new TaskScheduler(worker_count);
+    if (!log_dir.empty()) {
+        g_tcp_log = new MessageLog(g_tcp_rooms, log_dir, log_segment_bytes, log_segments);
+        string error;
+        if (!g_tcp_log->open(error)) {
+            cerr << "Message log: " << error << endl;
+            exit(EXIT_FAILURE);
+        }
+        cout << "Logging chat history to " << log_dir << endl;
+    }
+
+    int cpu_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 0; i < shard_count; i++) {
+        TcpShard* shard = new TcpShard(i);
+        if (pin_shards && cpu_count > 0) {
+            shard->cpu = i % cpu_count;
+        }
+        if (!takeover.listeners.empty()) shard->listen_fd = takeover.listeners[i];
+        if (!setup_shard(shard, port)) {
+            exit(EXIT_FAILURE);
+        }
+        g_tcp_shards.push_back(shard);
+    }
+    for (const TcpAdoptedClient& client : takeover.clients) {
+        adopt_client(g_tcp_shards[client.shard], client);
+    }
+    if (!takeover_path.empty()) {
+        cout << "Took over " << takeover.clients.size() << " connection(s) from the previous server" << endl;
+    }
+
+    if (!upgrade_path.empty()) {
+        int upgrade_fd = listen_unix(upgrade_path);
+        pthread_t upgrade_thread;
+        if (upgrade_fd == -1 ||
+            pthread_create(&upgrade_thread, NULL, handover_thread, (void*)(intptr_t)upgrade_fd) != 0) {
+            cerr << "Cannot listen for upgrades on " << upgrade_path << ": " << strerror(errno) << endl;
+            if (takeover_path.empty()) exit(EXIT_FAILURE); // never drop connections just taken over
+        } else {
+            pthread_detach(upgrade_thread);
+            cout << "Listening for hot upgrades on " << upgrade_path << endl;
+        }
+    }
+
+    cout << "Event-driven (" << (g_tcp_config.backend == BACKEND_URING ? "io_uring" : "epoll")
+         << ") TCP Server started on port " << port
+         << " with " << shard_count << " reactor shard(s)" << (pin_shards ? ", pinned" : "")
+         << " and " << worker_count << " worker(s)" << endl;
+    if (g_tcp_config.coalesce_us > 0) {
+        cout << "Coalescing output in " << g_tcp_config.coalesce_us << " us windows" << endl;
+    }
+    if (g_tcp_config.idle_timeout_ms > 0) {
+        cout << "Disconnecting clients silent for " << g_tcp_config.idle_timeout_ms / 1000 << " s" << endl;
+    }
+    cout << "Waiting for connections..." << endl;
+
+    // Each shard runs its own reactor owning accept, read, parse and write
+    for (TcpShard* shard : g_tcp_shards) {
+        void* (*reactor)(void*) = (g_tcp_config.backend == BACKEND_URING) ? run_uring_reactor : run_reactor;
+        if (pthread_create(&shard->thread_id, NULL, reactor, shard) != 0) {
+            cerr << "Failed to create reactor thread!" << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (TcpShard* shard : g_tcp_shards) {
+        pthread_join(shard->thread_id, NULL);
+    }
+
+    // Cleanup; workers may still be posting to the shards
+    delete g_tcp_scheduler;
+    delete g_tcp_log;
+    for (TcpShard* shard : g_tcp_shards) {
+        close(shard->inbox_fd);
+        if (shard->tick_fd != -1) close(shard->tick_fd);
+        if (shard->wheel_fd != -1) close(shard->wheel_fd);
+        delete shard->idle_wheel;
+        if (shard->epoll_fd != -1) close(shard->epoll_fd);
+        delete shard->ring;
+        for (TcpSendBatch* batch : shard->free_batches) delete batch;
+        for (TcpClientInfo* client : shard->streaming_clients) delete client->stream;
+        close(shard->listen_fd);
+        pthread_mutex_destroy(&shard->inbox_mutex);
+        delete shard;
+    }
+
+    return 0;
+}
@@ -11,9 +11,15 @@
 #include <unistd.h>
 #include <cstring>
 #include <chrono>
+#include <deque>
+#include <ctime>
 #include <fcntl.h>
+#include <cerrno>
+#include <atomic>
 
 #include "UDPCommon.h"
+#include "../common/Logger.h"
+#include "../common/HistoryQuery.h"
 
 using namespace std;
 
@@ -22,24 +28,72 @@ static sockaddr_in g_server{};
 static volatile bool g_running = true;
 static pthread_mutex_t g_send_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-// Reliability state for last sent MSG_CHAT
+// Selective repeat for MSG_CHAT, MSG_JOIN and MSG_LEAVE: up to g_window
+// messages in flight, each retransmitted on its own until the server
+// acknowledges it, directly or through the SACK block of any ACK. The
+// server processes them in seq order. Messages typed while the window is
+// full wait in g_backlog.
+//
+// The retransmit timeout adapts to the path (Jacobson/Karels): every ACK
+// for a message that was sent once gives an RTT sample, and RTO = SRTT +
+// 4 * RTTVAR. Samples from retransmitted messages are ambiguous and skipped
+// (Karn). Each timeout of a message doubles that message's own timeout, so
+// many messages expiring one after the other do not inflate the RTO of the
+// rest. The retransmit thread sleeps until the earliest deadline in the
+// window.
+struct InFlight {
+    vector<uint8_t> packet;
+    uint16_t type;
+    bool acked;
+    bool retransmitted;
+    bool fastRetransmitted; // once per message, on SACK evidence of its loss
+    int timeouts;           // backoff: the next timeout is RTO << timeouts
+    int64_t firstSentUs;
+    int64_t sentUs;         // latest transmission
+    int64_t deadlineUs;     // retransmit unless acked by then
+};
+
 static pthread_mutex_t g_retx_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_retx_cond;  // on CLOCK_MONOTONIC; signalled when a deadline may be earlier
+static InFlight g_inFlight[UDP_SACK_WINDOW]; // by seq % UDP_SACK_WINDOW
+static uint32_t g_sendBase = 1;  // oldest unacknowledged seq
 static uint32_t g_nextSeq = 1;
-static uint32_t g_lastPendingSeq = 0;
-static vector<uint8_t> g_lastPacket;
-static chrono::steady_clock::time_point g_lastSentTime;
-static const int RETX_TIMEOUT_MS = 800;
+static uint32_t g_window = 32;   // --window, at most UDP_SACK_WINDOW
+static deque<pair<UdpMessageType, string>> g_backlog;
+static bool g_registered = false; // the hello (seq 0) was acknowledged
+static int g_helloTimeouts = 0;
+static int64_t g_helloSentUs = 0;
+static int64_t g_helloDeadlineUs = 0;
+static const int FAST_RETX_THRESHOLD = 3; // later messages SACKed before a gap counts as lost
 
-static void print_debug(const string &msg)
-{
-    cerr << "[DEBUG] " << msg << endl;
-}
+static const int64_t RTO_INITIAL_US = 1000000; // until the first sample (RFC 6298)
+static const int64_t RTO_MIN_US = 5000;
+static const int64_t RTO_MAX_US = 30000000;
+static RttEstimator g_rtt(RTO_INITIAL_US, RTO_MIN_US, RTO_MAX_US);
+
+// Broadcast chat from the server comes under our own seq (nonzero) once we
+// said hello with FLAG_SACK: every copy is acknowledged with a SackBlock of
+// what has arrived, and each line is shown once, as it arrives. Receiver
+// thread only, apart from the counters.
+static uint32_t g_bcastBase = 1;  // oldest seq not received yet
+static uint64_t g_bcastSeen = 0;  // bit i: seq g_bcastBase + i has arrived
+static atomic<uint64_t> g_bcastReceived(0);
+static atomic<uint64_t> g_bcastDuplicates(0);
+
+static uint64_t g_sentMessages = 0;
+static uint64_t g_retransmits = 0;
+static uint64_t g_fastRetransmits = 0;
+// Loss recovery: from the first transmission of a message that had to be
+// retransmitted to its ACK
+static uint64_t g_recovered = 0;
+static int64_t g_recoveryTotalUs = 0;
+static int64_t g_recoveryMaxUs = 0;
 
 static void send_packet_locked(const vector<uint8_t> &pkt)
 {
     ssize_t sent = sendto(g_sock, pkt.data(), pkt.size(), 0,
                           (const sockaddr*)&g_server, sizeof(g_server));
-    if (sent < 0) print_debug("sendto failed");
+    if (sent < 0) LOG_WARN("sendto failed: %s", strerror(errno));
 }
 
 static void send_packet(const vector<uint8_t> &pkt)
@@ -49,9 +103,171 @@ static void send_packet(const vector<uint8_t> &pkt)
     pthread_mutex_unlock(&g_send_mutex);
 }
 
+// The functions below run under g_retx_mutex. Packets are sent while it is
+// held, straight from their window slot, so nothing is copied.
+
+static bool in_window(uint32_t seq)
+{
+    return seq - g_sendBase < g_nextSeq - g_sendBase;
+}
+
+// The ACK for seq itself has arrived (sample is true) or it is covered by
+// a SACK block. Returns true if seq was still waiting for its ACK.
+static bool mark_acked(uint32_t seq, bool sample, int64_t nowUs)
+{
+    if (!in_window(seq) || g_inFlight[seq % UDP_SACK_WINDOW].acked) return false;
+    InFlight &slot = g_inFlight[seq % UDP_SACK_WINDOW];
+    slot.acked = true;
+    if (!slot.retransmitted) {
+        if (sample) g_rtt.sample(nowUs - slot.sentUs);
+    } else {
+        int64_t recoveryUs = nowUs - slot.firstSentUs;
+        g_recovered++;
+        g_recoveryTotalUs += recoveryUs;
+        g_recoveryMaxUs = max(g_recoveryMaxUs, recoveryUs);
+    }
+    return true;
+}
+
+static void retransmit(uint32_t seq, InFlight &slot, int64_t nowUs)
+{
+    slot.retransmitted = true;
+    slot.sentUs = nowUs;
+    slot.deadlineUs = nowUs + g_rtt.backed_off(slot.timeouts);
+    send_packet(slot.packet);
+    g_retransmits++;
+    LOG_DEBUG("Retransmitting seq=%u, timeout %lld us", seq, (long long)g_rtt.backed_off(slot.timeouts));
+}
+
+// A room change is done only once its status text has arrived, which
+// comes with the ACK for its own seq. Until then the request goes again,
+// however many SACKs cover it, and the server answers the copies with the
+// status.
+static bool waits_for_status(uint32_t seq)
+{
+    uint16_t type = g_inFlight[seq % UDP_SACK_WINDOW].type;
+    return in_window(seq) && (type == MSG_JOIN || type == MSG_LEAVE);
+}
+
+// Everything up to the cumulative seq has arrived, and so has each seq in
+// the bitmap. A message with FAST_RETX_THRESHOLD later ones SACKed was
+// most likely lost; resend it now rather than at its deadline.
+static void apply_sack(const SackBlock &sack, int64_t nowUs)
+{
+    for (uint32_t seq = g_sendBase; in_window(seq) && (int32_t)(sack.cumulative - seq) >= 0; seq++) {
+        if (!waits_for_status(seq)) mark_acked(seq, false, nowUs);
+    }
+    for (uint32_t i = 0; i < 64; i++) {
+        uint32_t seq = sack.cumulative + 2 + i;
+        if ((sack.bitmap & (1ULL << i)) && !waits_for_status(seq)) mark_acked(seq, false, nowUs);
+    }
+
+    int laterAcked = 0;
+    for (uint32_t seq = g_nextSeq - 1; in_window(seq); seq--) {
+        InFlight &slot = g_inFlight[seq % UDP_SACK_WINDOW];
+        if (slot.acked) {
+            laterAcked++;
+        } else if (laterAcked >= FAST_RETX_THRESHOLD && !slot.fastRetransmitted) {
+            slot.fastRetransmitted = true;
+            g_fastRetransmits++;
+            retransmit(seq, slot, nowUs);
+        }
+    }
+}
+
+static void send_in_window(UdpMessageType type, const string &text, int64_t nowUs)
+{
+    uint32_t seq = g_nextSeq++;
+    InFlight &slot = g_inFlight[seq % UDP_SACK_WINDOW];
+    build_packet(slot.packet, type, 0, seq, 0,
+                 reinterpret_cast<const uint8_t*>(text.data()), (uint32_t)text.size());
+    slot.type = type;
+    slot.acked = false;
+    slot.retransmitted = false;
+    slot.fastRetransmitted = false;
+    slot.timeouts = 0;
+    slot.firstSentUs = slot.sentUs = nowUs;
+    slot.deadlineUs = nowUs + g_rtt.rtoUs;
+    send_packet(slot.packet);
+    g_sentMessages++;
+    pthread_cond_signal(&g_retx_cond);
+}
+
+// Slide past the acknowledged head of the window and fill the room it
+// leaves from the backlog. Nothing goes out before the hello is ACKed: the
+// server would not know whose seq it is.
+static void advance_window(int64_t nowUs)
+{
+    while (g_sendBase != g_nextSeq && g_inFlight[g_sendBase % UDP_SACK_WINDOW].acked) {
+        g_inFlight[g_sendBase % UDP_SACK_WINDOW].packet.clear();
+        g_sendBase++;
+    }
+    while (g_registered && !g_backlog.empty() && g_nextSeq - g_sendBase < g_window) {
+        send_in_window(g_backlog.front().first, g_backlog.front().second, nowUs);
+        g_backlog.pop_front();
+    }
+}
+
+// Returns false for a line seen before
+static bool accept_broadcast(uint32_t seq)
+{
+    if ((int32_t)(seq - g_bcastBase) < 0) return false;
+    if (seq - g_bcastBase >= UDP_SACK_WINDOW) {
+        // The server has given up on the lines that far back
+        uint32_t shift = seq - g_bcastBase - (UDP_SACK_WINDOW - 1);
+        g_bcastSeen = shift >= 64 ? 0 : g_bcastSeen >> shift;
+        g_bcastBase += shift;
+    }
+    uint64_t bit = 1ULL << (seq - g_bcastBase);
+    if (g_bcastSeen & bit) return false;
+    g_bcastSeen |= bit;
+    while (g_bcastSeen & 1) {
+        g_bcastSeen >>= 1;
+        g_bcastBase++;
+    }
+    return true;
+}
+
+static void ack_broadcast(uint32_t seq)
+{
+    SackBlock sack;
+    sack.cumulative = g_bcastBase - 1;
+    sack.bitmap = g_bcastSeen >> 1; // bit 0 of g_bcastSeen is always clear
+    uint8_t block[UDP_SACK_BLOCK_SIZE];
+    encode_sack(sack, block);
+    vector<uint8_t> pkt;
+    build_packet(pkt, MSG_CHAT, FLAG_ACK | FLAG_SACK, seq, 0, block, UDP_SACK_BLOCK_SIZE);
+    send_packet(pkt);
+}
+
+static void send_hello_locked(int64_t nowUs);
+
+// MSG_REGISTER: the server has no session for us any more (it removed us
+// as idle, or restarted). Say hello again; what it never acknowledged goes
+// back to the backlog, to be renumbered from seq 1 like everything in the
+// new session, and its broadcasts start over at seq 1 too.
+static void restart_session_locked(int64_t nowUs)
+{
+    for (uint32_t seq = g_nextSeq - 1; in_window(seq); seq--) {
+        InFlight &slot = g_inFlight[seq % UDP_SACK_WINDOW];
+        if (!slot.acked) {
+            string text(slot.packet.begin() + UDP_HEADER_SIZE, slot.packet.end());
+            g_backlog.emplace_front((UdpMessageType)slot.type, text);
+        }
+        slot.packet.clear();
+    }
+    g_sendBase = g_nextSeq = 1;
+    g_registered = false;
+    g_helloTimeouts = 0;
+    g_bcastBase = 1;
+    g_bcastSeen = 0;
+    send_hello_locked(nowUs);
+    pthread_cond_signal(&g_retx_cond);
+}
+
 static void *receiver_thread(void *)
 {
-    print_debug("Receiver thread started");
+    LOG_DEBUG("Receiver thread started");
     vector<uint8_t> buf(2048);
     while (g_running) {
         sockaddr_in from{}; socklen_t fromlen = sizeof(from);
@@ -67,16 +283,54 @@ static void *receiver_thread(void *)
             continue;
         }
 
-        if (type == MSG_CHAT && (flags & FLAG_ACK)) {
+        if (flags & FLAG_ACK) {
+            SackBlock sack;
+            bool hasSack = (flags & FLAG_SACK) && decode_sack(payload, plLen, sack);
+            if (hasSack) {
+                payload += UDP_SACK_BLOCK_SIZE;
+                plLen -= UDP_SACK_BLOCK_SIZE;
+            }
             pthread_mutex_lock(&g_retx_mutex);
-            if (seq == g_lastPendingSeq && g_lastPendingSeq != 0) {
-                g_lastPendingSeq = 0;
+            int64_t now = monotonic_us();
+            if (seq == 0 && type == MSG_CHAT && !g_registered) {
+                g_registered = true;
+                if (g_helloTimeouts == 0) g_rtt.sample(now - g_helloSentUs);
             }
+            bool status = plLen > 0 && (type == MSG_JOIN || type == MSG_LEAVE);
+            bool first = (status || !waits_for_status(seq)) && mark_acked(seq, true, now);
+            if (hasSack) apply_sack(sack, now);
+            advance_window(now);
             pthread_mutex_unlock(&g_retx_mutex);
+            // Room changes are acknowledged with a status text
+            if (first && status) {
+                cout << "[SYSTEM] " << string(reinterpret_cast<const char*>(payload), plLen) << endl;
+            }
         } else if (type == MSG_CHAT) {
+            if (seq != 0) {
+                bool fresh = accept_broadcast(seq);
+                ack_broadcast(seq);
+                if (!fresh) {
+                    g_bcastDuplicates++;
+                    continue;
+                }
+                g_bcastReceived++;
+            }
             string s;
             if (plLen > 0) s.assign(reinterpret_cast<const char*>(payload), plLen);
             cout << s << endl;
+        } else if (type == MSG_HISTORY) {
+            cout << (clientId == 0 ? "[SYSTEM] " : "[HISTORY] ")
+                 << string(reinterpret_cast<const char*>(payload), plLen) << endl;
+        } else if (type == MSG_REGISTER) {
+            pthread_mutex_lock(&g_retx_mutex);
+            bool restart = g_registered; // a hello is already on its way otherwise
+            if (restart) restart_session_locked(monotonic_us());
+            pthread_mutex_unlock(&g_retx_mutex);
+            if (restart) cout << "[SYSTEM] The server no longer knows this client, registering again" << endl;
+        } else if (type == MSG_PING) {
+            vector<uint8_t> pong; // keepalive: show the server we are still here
+            build_packet(pong, MSG_PING, 0, 0, 0, nullptr, 0);
+            send_packet(pong);
         } else if (type == MSG_STATS) {
             string s;
             if (plLen > 0) s.assign(reinterpret_cast<const char*>(payload), plLen);
@@ -86,59 +340,101 @@ static void *receiver_thread(void *)
     return nullptr;
 }
 
+// The hello registers us with the server; it goes again until it is ACKed
+static void send_hello_locked(int64_t nowUs)
+{
+    const string hello = "hello";
+    vector<uint8_t> pkt;
+    build_packet(pkt, MSG_CHAT, FLAG_SACK, 0, 0,
+                 reinterpret_cast<const uint8_t*>(hello.data()), (uint32_t)hello.size());
+    g_helloSentUs = nowUs;
+    g_helloDeadlineUs = nowUs + g_rtt.backed_off(g_helloTimeouts);
+    send_packet(pkt);
+}
+
 static void *retx_thread(void *)
 {
-    print_debug("Retransmit thread started");
+    LOG_DEBUG("Retransmit thread started");
+    pthread_mutex_lock(&g_retx_mutex);
     while (g_running) {
-        pthread_mutex_lock(&g_retx_mutex);
-        uint32_t pending = g_lastPendingSeq;
-        auto last = g_lastSentTime;
-        vector<uint8_t> pkt = g_lastPacket;
-        pthread_mutex_unlock(&g_retx_mutex);
-
-        if (pending != 0) {
-            auto now = chrono::steady_clock::now();
-            auto ms = chrono::duration_cast<chrono::milliseconds>(now - last).count();
-            if (ms >= RETX_TIMEOUT_MS && !pkt.empty()) {
-                print_debug("Retransmitting seq=" + to_string(pending));
-                send_packet(pkt);
-                pthread_mutex_lock(&g_retx_mutex);
-                g_lastSentTime = chrono::steady_clock::now();
-                pthread_mutex_unlock(&g_retx_mutex);
-            }
+        // Everything past its deadline goes again, with its timeout doubled
+        int64_t now = monotonic_us();
+        if (!g_registered && now >= g_helloDeadlineUs) {
+            g_helloTimeouts++;
+            send_hello_locked(now);
+        }
+        for (uint32_t seq = g_sendBase; in_window(seq); seq++) {
+            InFlight &slot = g_inFlight[seq % UDP_SACK_WINDOW];
+            if (slot.acked || now < slot.deadlineUs) continue;
+            slot.timeouts++;
+            retransmit(seq, slot, now);
+        }
+
+        // Sleep until the earliest deadline, or until a send sets an
+        // earlier one (at most a second, to notice /quit)
+        int64_t wake = now + 1000000;
+        if (!g_registered) wake = min(wake, g_helloDeadlineUs);
+        for (uint32_t seq = g_sendBase; in_window(seq); seq++) {
+            InFlight &slot = g_inFlight[seq % UDP_SACK_WINDOW];
+            if (!slot.acked) wake = min(wake, slot.deadlineUs);
+        }
+        if (wake > now) {
+            timespec until;
+            until.tv_sec = wake / 1000000;
+            until.tv_nsec = (wake % 1000000) * 1000;
+            pthread_cond_timedwait(&g_retx_cond, &g_retx_mutex, &until);
         }
-        usleep(100000); // 100ms
     }
+    pthread_mutex_unlock(&g_retx_mutex);
     return nullptr;
 }
 
 static void send_hello()
 {
-    const string hello = "hello";
-    vector<uint8_t> pkt;
-    build_packet(pkt, MSG_CHAT, 0, 0, 0,
-                 reinterpret_cast<const uint8_t*>(hello.data()), (uint32_t)hello.size());
-    send_packet(pkt);
+    pthread_mutex_lock(&g_retx_mutex);
+    send_hello_locked(monotonic_us());
+    pthread_cond_signal(&g_retx_cond);
+    pthread_mutex_unlock(&g_retx_mutex);
 }
 
-static void send_say(const string &text)
+// Send a message that is retransmitted until the server ACKs it, or queue
+// it while the window is full
+static void send_reliable(UdpMessageType type, const string &text)
 {
-    uint32_t seq;
-    vector<uint8_t> pkt;
     pthread_mutex_lock(&g_retx_mutex);
-    seq = g_nextSeq++;
-    build_packet(pkt, MSG_CHAT, 0, seq, 0,
-                 reinterpret_cast<const uint8_t*>(text.data()), (uint32_t)text.size());
-    g_lastPacket = pkt;
-    g_lastPendingSeq = seq;
-    g_lastSentTime = chrono::steady_clock::now();
+    g_backlog.emplace_back(type, text);
+    advance_window(monotonic_us());
     pthread_mutex_unlock(&g_retx_mutex);
+}
 
+static void send_history_request(const string &request)
+{
+    vector<uint8_t> pkt;
+    build_packet(pkt, MSG_HISTORY, 0, 0, 0,
+                 reinterpret_cast<const uint8_t*>(request.data()), (uint32_t)request.size());
     send_packet(pkt);
 }
 
 static void send_stats_request()
 {
+    pthread_mutex_lock(&g_retx_mutex);
+    char report[640];
+    snprintf(report, sizeof(report),
+             "Client Statistics:\n Window: %u, in flight %u, queued %zu"
+             "\n Reliable messages sent: %llu, retransmits %llu (%llu fast)"
+             "\n RTT: srtt %.2f ms, rttvar %.2f ms, RTO %.2f ms (%llu samples)"
+             "\n Loss recovery: %llu messages, avg %.2f ms, max %.2f ms"
+             "\n Broadcasts received: %llu (%llu duplicates)",
+             g_window, g_nextSeq - g_sendBase, g_backlog.size(),
+             (unsigned long long)g_sentMessages, (unsigned long long)g_retransmits,
+             (unsigned long long)g_fastRetransmits,
+             g_rtt.srttUs / 1000.0, g_rtt.rttvarUs / 1000.0, g_rtt.rtoUs / 1000.0, (unsigned long long)g_rtt.samples,
+             (unsigned long long)g_recovered, g_recovered == 0 ? 0.0 : g_recoveryTotalUs / 1000.0 / g_recovered,
+             g_recoveryMaxUs / 1000.0, (unsigned long long)g_bcastReceived.load(),
+             (unsigned long long)g_bcastDuplicates.load());
+    pthread_mutex_unlock(&g_retx_mutex);
+    cout << report << endl;
+
     vector<uint8_t> pkt;
     build_packet(pkt, MSG_STATS, 0, 0, 0, nullptr, 0);
     send_packet(pkt);
@@ -148,8 +444,23 @@ int main(int argc, char *argv[])
 {
     string server_ip = "127.0.0.1";
     int port = 5001;
-    if (argc > 1) server_ip = argv[1];
-    if (argc > 2) { int p = atoi(argv[2]); if (p > 0 && p <= 65535) port = p; }
+    int positional = 0;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--window" && i + 1 < argc) {
+            g_window = (uint32_t)min(max(atoi(argv[++i]), 1), (int)UDP_SACK_WINDOW);
+        } else if (arg[0] != '-' && positional == 0) {
+            server_ip = arg;
+            positional++;
+        } else if (arg[0] != '-' && positional == 1) {
+            int p = atoi(arg.c_str());
+            if (p > 0 && p <= 65535) port = p;
+            positional++;
+        } else {
+            cerr << "Usage: " << argv[0] << " [server_ip] [port] [--window N]" << endl;
+            return 1;
+        }
+    }
 
     g_sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (g_sock < 0) {
@@ -167,7 +478,14 @@ int main(int argc, char *argv[])
     memset(g_server.sin_zero, '\0', sizeof(g_server.sin_zero));
 
     cout << "UDP Client connecting to " << server_ip << ":" << port << endl;
-    cout << "Commands:\n  /say <text>\n  /stats\n  /quit" << endl;
+    cout << "Commands:\n  /say <text>\n  /join <room>\n  /leave\n  /history N | HH:MM[:SS] [HH:MM[:SS]]\n  /stats\n  /quit" << endl;
+
+    // Retransmit deadlines are monotonic
+    pthread_condattr_t condAttr;
+    pthread_condattr_init(&condAttr);
+    pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+    pthread_cond_init(&g_retx_cond, &condAttr);
+    pthread_condattr_destroy(&condAttr);
 
     // Start threads
     pthread_t rxTid, rtTid;
@@ -182,14 +500,31 @@ int main(int argc, char *argv[])
         if (line == "/quit") { g_running = false; break; }
         if (line.rfind("/say ", 0) == 0) {
             string msg = line.substr(5);
-            if (!msg.empty()) send_say(msg);
+            if (!msg.empty()) send_reliable(MSG_CHAT, msg);
+            continue;
+        }
+        if (line.rfind("/join ", 0) == 0) {
+            send_reliable(MSG_JOIN, line.substr(6));
+            continue;
+        }
+        if (line == "/leave") {
+            send_reliable(MSG_LEAVE, "");
+            continue;
+        }
+        if (line.rfind("/history ", 0) == 0) {
+            string request;
+            if (make_history_request(line.substr(9), request)) {
+                send_history_request(request);
+            } else {
+                cout << "Usage: /history N or /history HH:MM[:SS] [HH:MM[:SS]]" << endl;
+            }
             continue;
         }
         if (line == "/stats") {
             send_stats_request();
             continue;
         }
-        cout << "Unknown command. Use /say <text>, /stats, /quit" << endl;
+        cout << "Unknown command. Use /say <text>, /join <room>, /leave, /history, /stats, /quit" << endl;
     }
 
     // Cleanup
@@ -7,18 +7,44 @@
 #include <chrono>
 #include <sstream>
 #include <iomanip>
+#include <ctime>
 #include <arpa/inet.h>
 
+#include "../common/MessagePool.h"
+
 using namespace std;
 
 // Message types
 enum UdpMessageType : uint16_t {
     MSG_CHAT  = 1,
-    MSG_STATS = 2
+    MSG_STATS = 2,
+    // Payload is the room name (join) or empty (leave, back to the lobby).
+    // Retransmitted like chat; the ACK carries a status text.
+    MSG_JOIN  = 3,
+    MSG_LEAVE = 4,
+    // Request text as in HistoryQuery.h, not retransmitted. Answered with one
+    // packet per stored chat line from its original sender, then a summary
+    // from client id 0; also sent unasked on registration and on join.
+    MSG_HISTORY = 5,
+    // Keepalive probe from the server to a client that has gone quiet, empty
+    // payload, not retransmitted. The client echoes it back; any packet from
+    // a client resets its idle timer.
+    MSG_PING = 6,
+    // From the server, empty payload, not retransmitted: the answer to any
+    // packet but a hello from a sender it does not know, for instance one
+    // removed as idle. The client says hello again to get a new session.
+    MSG_REGISTER = 7
 };
 
 // Flags
 static const uint16_t FLAG_ACK = 0x0001; // ACK for reliability
+// Selective repeat. On the registration hello: the client keeps a window
+// of reliable messages (chat, join, leave) in flight, so the server should
+// process them in seq order, exactly once, and acknowledge with SACKs; in
+// return, broadcast chat to the client carries a nonzero per-client seq
+// and is retransmitted until the client ACKs it (MSG_CHAT, FLAG_ACK |
+// FLAG_SACK, same seq). On an ACK: the payload starts with a SackBlock.
+static const uint16_t FLAG_SACK = 0x0002;
 
 static const size_t UDP_MAX_PAYLOAD = 1024;
 
@@ -80,6 +106,104 @@ inline size_t build_packet(vector<uint8_t> &out,
     return out.size();
 }
 
+// Same as above but into a pooled buffer, with the payload given as a prefix
+// and a body so callers never concatenate them first
+inline BufferRef build_packet(uint16_t type, uint16_t flags,
+                              uint32_t seq, uint32_t clientId,
+                              const void *prefix, uint32_t prefixLen,
+                              const void *payload, uint32_t payloadLen)
+{
+    BufferRef out = BufferRef::allocate(UDP_HEADER_SIZE + prefixLen + payloadLen);
+    if (!out) return out;
+    UdpHeader hdr;
+    encode_header(hdr, type, flags, seq, clientId, prefixLen + payloadLen);
+    out.append(&hdr, UDP_HEADER_SIZE);
+    if (prefixLen > 0) out.append(prefix, prefixLen);
+    if (payloadLen > 0) out.append(payload, payloadLen);
+    return out;
+}
+
+// Receive state of the server for one client: every seq up to
+// cumulative has been processed, and bit i of bitmap is set if
+// cumulative + 2 + i has arrived and waits for the gap before it. A
+// sender's window is therefore at most UDP_SACK_WINDOW messages.
+static const uint32_t UDP_SACK_WINDOW = 64;
+static const size_t UDP_SACK_BLOCK_SIZE = 12;
+
+struct SackBlock {
+    uint32_t cumulative;
+    uint64_t bitmap;
+};
+
+inline void encode_sack(const SackBlock &sack, uint8_t *out)
+{
+    uint32_t cumulative = htonl(sack.cumulative);
+    uint32_t high = htonl((uint32_t)(sack.bitmap >> 32)), low = htonl((uint32_t)sack.bitmap);
+    memcpy(out, &cumulative, 4);
+    memcpy(out + 4, &high, 4);
+    memcpy(out + 8, &low, 4);
+}
+
+inline bool decode_sack(const uint8_t *data, uint32_t len, SackBlock &sack)
+{
+    if (len < UDP_SACK_BLOCK_SIZE) return false;
+    uint32_t cumulative, high, low;
+    memcpy(&cumulative, data, 4);
+    memcpy(&high, data + 4, 4);
+    memcpy(&low, data + 8, 4);
+    sack.cumulative = ntohl(cumulative);
+    sack.bitmap = ((uint64_t)ntohl(high) << 32) | ntohl(low);
+    return true;
+}
+
+// Retransmit timeout from RTT samples (Jacobson/Karels, RFC 6298): RTO =
+// SRTT + max(granularity, 4 * RTTVAR), clamped to [min, max]. Callers skip
+// samples from retransmitted messages (Karn) and back off per message.
+struct RttEstimator {
+    static const int64_t GRANULARITY_US = 1000;
+
+    int64_t srttUs;
+    int64_t rttvarUs;
+    int64_t rtoUs;   // before backoff
+    uint64_t samples;
+    int64_t minUs;
+    int64_t maxUs;
+
+    RttEstimator(int64_t initialUs, int64_t minRtoUs, int64_t maxRtoUs)
+        : srttUs(0), rttvarUs(0), rtoUs(initialUs), samples(0), minUs(minRtoUs), maxUs(maxRtoUs) {}
+
+    void sample(int64_t rttUs)
+    {
+        if (samples++ == 0) {
+            srttUs = rttUs;
+            rttvarUs = rttUs / 2;
+        } else {
+            int64_t error = srttUs > rttUs ? srttUs - rttUs : rttUs - srttUs;
+            rttvarUs = (3 * rttvarUs + error) / 4;
+            srttUs = (7 * srttUs + rttUs) / 8;
+        }
+        int64_t variance = 4 * rttvarUs > GRANULARITY_US ? 4 * rttvarUs : GRANULARITY_US;
+        rtoUs = srttUs + variance;
+        if (rtoUs < minUs) rtoUs = minUs;
+        if (rtoUs > maxUs) rtoUs = maxUs;
+    }
+
+    // The timeout for a message that has already timed out this many times
+    int64_t backed_off(int timeouts) const
+    {
+        if (timeouts >= 16) return maxUs;
+        int64_t timeout = rtoUs << timeouts;
+        return timeout < maxUs ? timeout : maxUs;
+    }
+};
+
+inline int64_t monotonic_us()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
 inline bool parse_packet(const uint8_t *data, size_t len,
                          uint16_t &type, uint16_t &flags,
                          uint32_t &seq, uint32_t &clientId,
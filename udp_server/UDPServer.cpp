@@ -3,7 +3,6 @@
 #include <iostream>
 #include <vector>
 #include <string>
-#include <sstream>
 #include <algorithm>
 #include <pthread.h>
 #include <sys/socket.h>
@@ -12,17 +11,91 @@
 #include <unistd.h>
 #include <cstring>
 #include <chrono>
-#include <queue>
 #include <unordered_map>
+#include <cerrno>
+#include <atomic>
 
 #include "UDPCommon.h"
+#include "../common/ClientRegistry.h"
+#include "../common/Logger.h"
+#include "../common/Timestamp.h"
+#include "../common/ServerMetrics.h"
+#include "../common/TaskScheduler.h"
+#include "../common/RoomIndex.h"
+#include "../common/MessageLog.h"
+#include "../common/TimerWheel.h"
 
 using namespace std;
 
+// Reliable packets from a selective-repeat client that arrived ahead of a
+// gap, by seq % UDP_SACK_WINDOW
+struct HeldPackets {
+    uint64_t mask;
+    BufferRef packets[UDP_SACK_WINDOW];
+
+    HeldPackets() : mask(0) {}
+};
+
+// The status text of a selective-repeat client's latest join or leave.
+// The client waits for it, so a retransmission of that request, which is
+// not processed again, gets it again.
+struct RoomStatus {
+    uint32_t seq;
+    uint32_t length;
+    char text[128];
+};
+
+// Broadcasts to a selective-repeat client are reliable too: every chat line
+// it is sent carries the next seq of the client's own outbound sequence, and
+// the client acknowledges it with a SackBlock. The last UDP_SACK_WINDOW
+// lines wait here until they are acknowledged and are resent by the
+// retransmit thread, so neither the receive loop nor the fan-out ever waits
+// for a slow client. A client that falls a whole window behind loses its
+// oldest line, which bounds what a vanished client holds until it is
+// evicted.
+struct OutboundEntry {
+    BufferRef packet;      // as broadcast, shared with the other recipients
+    int64_t firstSentUs;
+    int64_t sentUs;        // latest transmission
+    int timeouts;          // backoff: the next timeout is RTO << timeouts
+    bool acked;            // or given up
+    bool retransmitted;
+    bool fastRetransmitted;
+};
+
+struct OutboundQueue {
+    pthread_mutex_t mutex;
+    uint64_t endpoint;
+    uint32_t base;         // oldest unacknowledged seq
+    uint32_t nextSeq;
+    OutboundEntry entries[UDP_SACK_WINDOW]; // by seq % UDP_SACK_WINDOW
+    RttEstimator rtt;
+    int64_t wakeUs;        // when the retransmit thread looks at it next; INT64_MAX when idle
+    bool closed;           // the client is gone; the retransmit thread frees the queue
+    WheelTimer timer;      // retransmit thread only
+
+    OutboundQueue(uint64_t ep, const RttEstimator &initial)
+        : endpoint(ep), base(1), nextSeq(1), entries(), rtt(initial), wakeUs(INT64_MAX), closed(false)
+    {
+        pthread_mutex_init(&mutex, NULL);
+        timer.data = reinterpret_cast<uint64_t>(this);
+    }
+
+    ~OutboundQueue() { pthread_mutex_destroy(&mutex); }
+};
+
 struct ClientEndpoint {
     sockaddr_in addr;
     uint32_t clientId;
-    chrono::steady_clock::time_point lastSeen;
+    uint32_t room;  // only touched by this client's own (ordered) packets
+    int64_t lastSeenMs; // monotonic; stamped by its packets, read by the idle reaper (__atomic)
+    // Selective repeat (FLAG_SACK on the hello), also only touched in the
+    // client's lane
+    bool sack;
+    uint32_t rxNext;     // next reliable seq to process
+    HeldPackets *held;   // allocated on the first gap
+    RoomStatus *status;  // allocated on the first join or leave
+    OutboundQueue *out;  // reliable broadcasts; read from any lane, cleared on eviction (__atomic)
 };
 
 struct ServerStats {
@@ -35,193 +108,1003 @@ struct ServerStats {
 };
 
 // Globals
-static int g_socket_fd = -1;
-static vector<ClientEndpoint> g_clients;
-static pthread_mutex_t g_clients_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t g_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
-static ServerStats g_stats;
-static uint32_t g_nextClientId = 1;
-
-static pthread_mutex_t g_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t g_queue_cv = PTHREAD_COND_INITIALIZER;
-
-struct Outgoing {
-    vector<uint8_t> packet;
-    sockaddr_in addr;
+static ClientRegistry<ClientEndpoint> g_clients; // by clientId and by address, lock-free reads
+static const ServerStats g_stats; // immutable after startup, read without locking
+static atomic<uint32_t> g_nextClientId(1);
+static RoomDirectory g_rooms;
+static RoomMembers g_roomMembers; // members are packed endpoints
+static MessageLog *g_log = nullptr; // --log-dir: chat history on disk
+
+// Packets are handled on a pool of workers: the receive loop only reads
+// datagrams and submits them, ordered per sender. Broadcasts are split into
+// slices of recipients that idle workers steal, so a few busy senders do
+// not pin all the fan-out work to one core.
+static TaskScheduler *g_scheduler = nullptr;
+static const size_t UDP_DATAGRAM_BUFFER = 2048;
+
+// Both directions move several datagrams per syscall: the receive loop
+// reads up to g_recvBatch with one recvmmsg(), and a broadcast slice of
+// g_sendBatch room slots goes out in one sendmmsg(), so fan-out to N
+// clients costs about N / g_sendBatch syscalls.
+static const int UDP_MAX_BATCH = 1024; // UIO_MAXIOV, the kernel's limit per call
+static int g_recvBatch = 32;  // --recv-batch
+static int g_sendBatch = 64;  // --send-batch; also room slots walked per fan-out task
+
+// Receive shards (--receivers): each has its own socket bound to the port
+// with SO_REUSEPORT and its own receive thread. The kernel picks the socket
+// by hashing the sender's address, so all of a client's datagrams reach the
+// same receiver, which keeps them in order on their way to the workers.
+struct UdpReceiver {
+    int fd;
+    atomic<uint64_t> datagrams;
+    atomic<uint64_t> calls; // recvmmsg()s
+
+    UdpReceiver() : fd(-1), datagrams(0), calls(0) {}
 };
 
-static queue<Outgoing> g_outgoing;
+static vector<UdpReceiver*> g_receivers;
+static atomic<uint32_t> g_nextSendSocket(0);
 
-static string endpoint_key(const sockaddr_in &addr)
+// All the sockets share the address, so any of them can send to any client.
+// Each thread sends through one of them, chosen round robin on its first
+// send, so concurrent senders do not all contend on one socket.
+static int send_socket()
+{
+    thread_local int fd = g_receivers[g_nextSendSocket++ % g_receivers.size()]->fd;
+    return fd;
+}
+
+// Idle clients: UDP has no connection to close, so a client that went away
+// would stay registered, and be sent every broadcast, forever. A reaper
+// thread keeps one timer per client on a timer wheel (see check_idle()).
+static const int64_t UDP_WHEEL_TICK_MS = 100;
+static int64_t g_idleTimeoutMs = 0; // --idle-timeout; 0 keeps clients forever
+static atomic<uint64_t> g_keepaliveProbes(0);
+static atomic<uint64_t> g_idleEvictions(0);
+static atomic<uint64_t> g_registerRequests(0); // MSG_REGISTER sent to unknown senders
+
+struct IdleWatch {
+    WheelTimer timer;
+    uint64_t endpoint;
+    uint32_t clientId;
+};
+
+static pthread_mutex_t g_idleMutex = PTHREAD_MUTEX_INITIALIZER;
+static vector<IdleWatch*> g_idleNew; // registered since the reaper's last tick
+
+// Reliable broadcast (see OutboundQueue). Queues reach the retransmit
+// thread through g_retxArmed whenever they need to be looked at sooner
+// than their timer says and through g_retxClosed when their client is
+// evicted; both are pushed under the queue's own mutex, so an evicted queue
+// is never armed after it is closed.
+static const int64_t UDP_RETX_TICK_MS = 10;
+static const int64_t UDP_RTO_INITIAL_US = 1000000; // until the client's first sample (RFC 6298)
+static const int64_t UDP_RTO_MIN_US = 2 * UDP_RETX_TICK_MS * 1000;
+static const int64_t UDP_RTO_MAX_US = 10000000;
+static const int UDP_RETX_MAX_TIMEOUTS = 8;     // then the line is given up
+static const int UDP_FAST_RETX_THRESHOLD = 3;   // later lines acknowledged before a gap counts as lost
+static const RttEstimator g_initialRtt(UDP_RTO_INITIAL_US, UDP_RTO_MIN_US, UDP_RTO_MAX_US);
+static atomic<uint64_t> g_reliableSent(0);
+static atomic<uint64_t> g_reliableRetransmits(0);
+static atomic<uint64_t> g_reliableFastRetransmits(0);
+static atomic<uint64_t> g_reliableAcks(0);
+static atomic<uint64_t> g_reliableAbandoned(0);
+static pthread_mutex_t g_retxMutex = PTHREAD_MUTEX_INITIALIZER;
+static vector<OutboundQueue*> g_retxArmed;
+static vector<OutboundQueue*> g_retxClosed;
+
+static const size_t ENDPOINT_TEXT_SIZE = INET_ADDRSTRLEN + 6;
+
+// "a.b.c.d:port" for log lines
+static inline const char *format_endpoint(const sockaddr_in &addr, char (&text)[ENDPOINT_TEXT_SIZE])
 {
     char ip[INET_ADDRSTRLEN] = {0};
     inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
-    stringstream ss;
-    ss << ip << ":" << ntohs(addr.sin_port);
-    return ss.str();
+    snprintf(text, sizeof(text), "%s:%u", ip, (unsigned)ntohs(addr.sin_port));
+    return text;
 }
 
-static void print_debug(const string &msg)
+// Register a sender the registry does not know yet, if its packet is a
+// hello; ce gets the new client. Packets from one address are handled in
+// its own lane, so nothing registers it in between.
+static bool register_client(const sockaddr_in &addr, uint16_t flags, const uint8_t *payload, uint32_t plLen,
+                            ClientEndpoint &ce)
 {
-    cerr << "[DEBUG] " << msg << endl;
+    if (plLen != 5 || memcmp(payload, "hello", 5) != 0) {
+        // Only register on explicit hello as per requirement
+        return false;
+    }
+
+    ce = ClientEndpoint{};
+    ce.addr = addr;
+    ce.clientId = g_nextClientId.fetch_add(1);
+    ce.room = RoomDirectory::LOBBY;
+    ce.lastSeenMs = monotonic_ms();
+    ce.sack = (flags & FLAG_SACK) != 0;
+    ce.rxNext = 1;
+    ce.held = nullptr;
+    ce.status = nullptr;
+    ce.out = ce.sack ? new OutboundQueue(pack_endpoint(addr), g_initialRtt) : nullptr;
+
+    if (!g_clients.insert(ce.clientId, pack_endpoint(addr), ce)) {
+        delete ce.out;
+        return false;
+    }
+    g_roomMembers.join(RoomDirectory::LOBBY, pack_endpoint(addr));
+    if (g_idleTimeoutMs > 0) {
+        IdleWatch *watch = new IdleWatch();
+        watch->endpoint = pack_endpoint(addr);
+        watch->clientId = ce.clientId;
+        watch->timer.data = reinterpret_cast<uint64_t>(watch);
+        pthread_mutex_lock(&g_idleMutex);
+        g_idleNew.push_back(watch);
+        pthread_mutex_unlock(&g_idleMutex);
+    }
+
+    char where[ENDPOINT_TEXT_SIZE];
+    LOG_INFO("Registered new client id=%u from %s, total clients=%zu",
+             ce.clientId, format_endpoint(addr, where), g_clients.size());
+    return true;
 }
 
-static uint32_t find_client_id_by_addr(const sockaddr_in &addr)
+// Workers write to the socket directly; the kernel serializes concurrent
+// sendto() calls on it
+static void send_packet(const BufferRef &packet, const sockaddr_in &addr)
 {
-    uint32_t id = 0;
-    pthread_mutex_lock(&g_clients_mutex);
-    for (const auto &c : g_clients) {
-        if (c.addr.sin_addr.s_addr == addr.sin_addr.s_addr &&
-            c.addr.sin_port == addr.sin_port) {
-            id = c.clientId;
-            break;
+    if (!packet) return;
+    ssize_t sent = sendto(send_socket(), packet.data(), packet.size(), 0,
+                          (const sockaddr*)&addr, sizeof(addr));
+    metric_add(METRIC_SEND_SYSCALLS);
+    if (sent < 0) {
+        LOG_WARN("sendto failed: %s", strerror(errno));
+        metric_add(METRIC_SEND_ERRORS);
+    } else {
+        metric_add(METRIC_MESSAGES_OUT);
+        metric_add(METRIC_BYTES_OUT, sent);
+    }
+}
+
+// Packets queued for one sendmmsg(). Only the iovec points at each packet,
+// so the caller keeps the packets alive until flush(); add() flushes by
+// itself when the batch is full. One per worker thread (send_batch()),
+// on that thread's socket.
+class SendBatch {
+public:
+    SendBatch(int fd, int capacity)
+        : fd_(fd), msgs_(capacity), iovs_(2 * capacity), addrs_(capacity), headers_(capacity), count_(0) {}
+
+    void add(const BufferRef &packet, const sockaddr_in &addr)
+    {
+        if (!packet) return;
+        iovec *iov = &iovs_[2 * count_];
+        iov[0].iov_base = const_cast<char*>(packet.data());
+        iov[0].iov_len = packet.size();
+        queue(addr, 1);
+    }
+
+    // As add(), with seq in the header instead of the packet's own: the
+    // header goes from a copy kept here, the rest from the shared packet
+    void add_sequenced(const BufferRef &packet, const sockaddr_in &addr, uint32_t seq)
+    {
+        if (!packet || packet.size() < UDP_HEADER_SIZE) return;
+        UdpHeader &header = headers_[count_];
+        memcpy(&header, packet.data(), UDP_HEADER_SIZE);
+        header.seq = htonl(seq);
+        iovec *iov = &iovs_[2 * count_];
+        iov[0].iov_base = &header;
+        iov[0].iov_len = UDP_HEADER_SIZE;
+        iov[1].iov_base = const_cast<char*>(packet.data()) + UDP_HEADER_SIZE;
+        iov[1].iov_len = packet.size() - UDP_HEADER_SIZE;
+        queue(addr, 2);
+    }
+
+    void flush()
+    {
+        size_t done = 0;
+        while (done < count_) {
+            int sent = sendmmsg(fd_, &msgs_[done], (unsigned)(count_ - done), 0);
+            metric_add(METRIC_SEND_SYSCALLS);
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent <= 0) {
+                // The first remaining packet failed; skip it and send the rest
+                LOG_WARN("sendmmsg failed: %s", strerror(errno));
+                metric_add(METRIC_SEND_ERRORS);
+                done++;
+                continue;
+            }
+            uint64_t bytes = 0;
+            for (int i = 0; i < sent; i++) bytes += msgs_[done + i].msg_len;
+            metric_add(METRIC_MESSAGES_OUT, sent);
+            metric_add(METRIC_BYTES_OUT, bytes);
+            done += sent;
         }
+        count_ = 0;
+    }
+
+private:
+    void queue(const sockaddr_in &addr, size_t iovCount)
+    {
+        addrs_[count_] = addr;
+        msghdr &hdr = msgs_[count_].msg_hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_name = &addrs_[count_];
+        hdr.msg_namelen = sizeof(sockaddr_in);
+        hdr.msg_iov = &iovs_[2 * count_];
+        hdr.msg_iovlen = iovCount;
+        if (++count_ == msgs_.size()) flush();
     }
-    pthread_mutex_unlock(&g_clients_mutex);
-    return id;
+
+    int fd_;
+    vector<mmsghdr> msgs_;
+    vector<iovec> iovs_;       // two per packet
+    vector<sockaddr_in> addrs_;
+    vector<UdpHeader> headers_; // for add_sequenced()
+    size_t count_;
+};
+
+static SendBatch &send_batch()
+{
+    thread_local SendBatch batch(send_socket(), g_sendBatch);
+    return batch;
 }
 
-static void ensure_register_client(const sockaddr_in &addr, const string &maybeHello)
+// Hand a queue to the retransmit thread; called with the queue's mutex held
+static void hand_to_retransmitter(OutboundQueue *queue, vector<OutboundQueue*> &list)
 {
-    if (find_client_id_by_addr(addr) != 0) return;
+    pthread_mutex_lock(&g_retxMutex);
+    list.push_back(queue);
+    pthread_mutex_unlock(&g_retxMutex);
+}
 
-    if (maybeHello != "hello") {
-        // Only register on explicit hello as per requirement
+// Have the retransmit thread look at the queue by deadlineUs, if it would
+// not anyway: a new line, or RTT samples that shrank the timeout. Called
+// with the queue's mutex held.
+static void wake_retransmitter_by(OutboundQueue *queue, int64_t deadlineUs)
+{
+    if (deadlineUs + UDP_RETX_TICK_MS * 1000 >= queue->wakeUs) return;
+    queue->wakeUs = deadlineUs;
+    hand_to_retransmitter(queue, g_retxArmed);
+}
+
+// Keep a line for the client until it is acknowledged and return its seq,
+// or 0 once the client is gone
+static uint32_t queue_reliable(OutboundQueue *queue, const BufferRef &packet, int64_t nowUs)
+{
+    pthread_mutex_lock(&queue->mutex);
+    uint32_t seq = 0;
+    if (!queue->closed) {
+        if (queue->nextSeq - queue->base == UDP_SACK_WINDOW) {
+            // A whole window behind: the oldest line is given up
+            OutboundEntry &oldest = queue->entries[queue->base % UDP_SACK_WINDOW];
+            oldest.packet.reset();
+            oldest.acked = true;
+            g_reliableAbandoned++;
+            while (queue->base != queue->nextSeq && queue->entries[queue->base % UDP_SACK_WINDOW].acked) {
+                queue->base++;
+            }
+        }
+        seq = queue->nextSeq++;
+        OutboundEntry &entry = queue->entries[seq % UDP_SACK_WINDOW];
+        entry.packet = packet;
+        entry.firstSentUs = entry.sentUs = nowUs;
+        entry.timeouts = 0;
+        entry.acked = entry.retransmitted = entry.fastRetransmitted = false;
+        wake_retransmitter_by(queue, nowUs + queue->rtt.backed_off(0));
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return seq;
+}
+
+// Send the shared packet to every member in one slice of a pinned member
+// array. Selective-repeat members get it under their own seq.
+static void send_slice(const BufferRef &packet, const RoomMembers::Slots *slots, size_t begin, uint64_t exclude)
+{
+    SendBatch &batch = send_batch();
+    uint64_t recipients = 0, reliable = 0;
+    int64_t nowUs = monotonic_us();
+    RoomMembers::for_each_in(slots, begin, begin + g_sendBatch, [&](uint64_t member) {
+        if (member == exclude) return;
+        uint32_t seq = 0;
+        g_clients.with_endpoint(member, [&](ClientEndpoint &c) {
+            OutboundQueue *queue = __atomic_load_n(&c.out, __ATOMIC_ACQUIRE);
+            if (queue != nullptr) seq = queue_reliable(queue, packet, nowUs);
+        });
+        if (seq != 0) {
+            batch.add_sequenced(packet, unpack_endpoint(member), seq);
+            reliable++;
+        } else {
+            batch.add(packet, unpack_endpoint(member));
+        }
+        recipients++;
+    });
+    batch.flush();
+    metric_add(METRIC_FANOUT, recipients);
+    if (reliable > 0) g_reliableSent += reliable;
+}
+
+// One broadcast split into slices: every slice walks the same pinned
+// array, so a join, leave or compaction meanwhile cannot move a member
+// into a slice that already ran (missing the line) or one still to come
+// (getting it twice). The last slice to finish releases the pin.
+struct SliceWalk {
+    RoomMembers::Slots *slots;
+    uint64_t exclude;
+    atomic<size_t> remaining;
+};
+
+static void finish_slice(SliceWalk *walk)
+{
+    if (walk->remaining.fetch_sub(1, memory_order_acq_rel) != 1) return;
+    RoomMembers::unpin(walk->slots);
+    delete walk;
+}
+
+// Task: arg is the slice's first slot; context is its SliceWalk
+static void send_slice_task(Task &task)
+{
+    SliceWalk *walk = static_cast<SliceWalk*>(task.context);
+    send_slice(task.buffer, walk->slots, (size_t)task.arg, walk->exclude);
+    finish_slice(walk);
+}
+
+// Hand every slice but the first to the scheduler, then send the first one
+// here; the packet is shared by reference, never copied. Only the room's
+// members are walked, so the cost follows the room size, not the server's.
+// Slice k of one sender's broadcasts always goes to the same ordered lane,
+// so its members get that sender's lines in the order they were sent,
+// while different slices still spread over the workers.
+static void broadcast_to_room_except(const BufferRef &packet, uint32_t room, uint64_t exclude)
+{
+    if (!packet) return;
+    metric_add(METRIC_BROADCASTS);
+    RoomMembers::Slots *slots = g_roomMembers.pin(room);
+    if (slots == nullptr) return;
+    size_t count = RoomMembers::slot_count(slots);
+    if (count <= (size_t)g_sendBatch) {
+        send_slice(packet, slots, 0, exclude);
+        RoomMembers::unpin(slots);
         return;
     }
 
-    ClientEndpoint ce{};
-    ce.addr = addr;
-    ce.clientId = g_nextClientId++;
-    ce.lastSeen = chrono::steady_clock::now();
+    SliceWalk *walk = new SliceWalk();
+    walk->slots = slots;
+    walk->exclude = exclude;
+    walk->remaining.store((count + g_sendBatch - 1) / g_sendBatch, memory_order_relaxed);
+    for (size_t begin = g_sendBatch, slice = 1; begin < count; begin += g_sendBatch, slice++) {
+        g_scheduler->submit_ordered(exclude + (slice << 48), Task{send_slice_task, packet, begin, walk});
+    }
+    send_slice(packet, slots, 0, exclude);
+    finish_slice(walk);
+}
 
-    pthread_mutex_lock(&g_clients_mutex);
-    g_clients.push_back(ce);
-    size_t count = g_clients.size();
-    pthread_mutex_unlock(&g_clients_mutex);
+// The SACK block that goes in front of every ACK to a selective-repeat
+// client; returns its length, 0 for other clients
+static uint32_t client_sack(const ClientEndpoint &c, uint8_t *out)
+{
+    if (!c.sack) return 0;
+    SackBlock sack;
+    sack.cumulative = c.rxNext - 1;
+    sack.bitmap = 0;
+    if (c.held != nullptr) {
+        // Bit i stands for seq rxNext + 1 + i, held in slot (rxNext + 1 + i) % 64
+        unsigned shift = (c.rxNext + 1) % UDP_SACK_WINDOW;
+        sack.bitmap = shift == 0 ? c.held->mask : (c.held->mask >> shift) | (c.held->mask << (64 - shift));
+    }
+    encode_sack(sack, out);
+    return UDP_SACK_BLOCK_SIZE;
+}
 
-    print_debug("Registered new client id=" + to_string(ce.clientId) +
-                " from " + endpoint_key(addr) + ", total clients=" + to_string(count));
+static void reply_ack(const sockaddr_in &addr, uint16_t type, uint32_t seq, uint32_t clientId,
+                      const uint8_t *sack, uint32_t sackLen, const char *text = nullptr, uint32_t textLen = 0)
+{
+    uint16_t flags = sackLen > 0 ? FLAG_ACK | FLAG_SACK : FLAG_ACK;
+    send_packet(build_packet(type, flags, seq, clientId, sack, sackLen, text, textLen), addr);
 }
 
-static void enqueue_send(const vector<uint8_t> &packet, const sockaddr_in &addr)
+// A packet from a sender with no session, say one removed as idle
+static void ask_to_register(const sockaddr_in &addr)
 {
-    pthread_mutex_lock(&g_queue_mutex);
-    g_outgoing.push(Outgoing{packet, addr});
-    pthread_cond_signal(&g_queue_cv);
-    pthread_mutex_unlock(&g_queue_mutex);
+    send_packet(build_packet(MSG_REGISTER, 0, 0, 0, nullptr, 0, nullptr, 0), addr);
+    g_registerRequests++;
 }
 
-static void broadcast_to_all_except(const vector<uint8_t> &packet, uint32_t excludeId)
+enum SackVerdict { SACK_IN_ORDER, SACK_HELD, SACK_DUPLICATE, SACK_BEYOND };
+
+// Where a reliable packet from a selective-repeat client goes: the next
+// seq is processed now, one ahead of a gap waits in held until the gap is
+// filled, and one seen before is only acknowledged again. The sender's
+// window keeps it within UDP_SACK_WINDOW of rxNext; anything further is
+// dropped.
+static SackVerdict sequence_packet(ClientEndpoint &c, uint32_t seq, const BufferRef &datagram)
 {
-    pthread_mutex_lock(&g_clients_mutex);
-    for (const auto &c : g_clients) {
-        if (c.clientId == excludeId) continue;
-        enqueue_send(packet, c.addr);
+    uint32_t ahead = seq - c.rxNext;
+    if (ahead == 0) {
+        c.rxNext++;
+        return SACK_IN_ORDER;
     }
-    pthread_mutex_unlock(&g_clients_mutex);
+    if ((int32_t)ahead < 0) return SACK_DUPLICATE;
+    if (ahead > UDP_SACK_WINDOW) return SACK_BEYOND;
+    if (c.held == nullptr) c.held = new HeldPackets();
+    uint64_t bit = 1ULL << (seq % UDP_SACK_WINDOW);
+    if (c.held->mask & bit) return SACK_DUPLICATE;
+    c.held->packets[seq % UDP_SACK_WINDOW] = datagram;
+    c.held->mask |= bit;
+    return SACK_HELD;
 }
 
-static void *sender_thread(void *)
+// Move out the held packet whose turn it is now, if it has arrived
+static bool take_held(uint64_t endpoint, BufferRef &datagram)
 {
-    print_debug("Sender thread started");
-    while (true) {
-        pthread_mutex_lock(&g_queue_mutex);
-        while (g_outgoing.empty()) {
-            pthread_cond_wait(&g_queue_cv, &g_queue_mutex);
+    bool found = false;
+    g_clients.with_endpoint(endpoint, [&](ClientEndpoint &c) {
+        uint64_t bit = 1ULL << (c.rxNext % UDP_SACK_WINDOW);
+        if (c.held == nullptr || (c.held->mask & bit) == 0) return;
+        datagram = move(c.held->packets[c.rxNext % UDP_SACK_WINDOW]);
+        c.held->mask &= ~bit;
+        found = true;
+    });
+    return found;
+}
+
+// Any packet from a registered client, keepalive replies included, shows
+// it is still there
+static inline void mark_active(ClientEndpoint &c)
+{
+    __atomic_store_n(&c.lastSeenMs, monotonic_ms(), __ATOMIC_RELAXED);
+}
+
+// Settle one line of a reliable broadcast; an ACK for the line itself
+// (sample) times the round trip unless the line was sent more than once
+static void queue_ack(OutboundQueue *queue, uint32_t seq, bool sample, int64_t nowUs)
+{
+    if (seq - queue->base >= queue->nextSeq - queue->base) return;
+    OutboundEntry &entry = queue->entries[seq % UDP_SACK_WINDOW];
+    if (entry.acked) return;
+    entry.acked = true;
+    entry.packet.reset();
+    if (sample && !entry.retransmitted) queue->rtt.sample(nowUs - entry.sentUs);
+}
+
+// A selective-repeat client acknowledged broadcast line seq; its SACK block
+// says what else it has. Lines it is missing behind enough acknowledged
+// ones are resent at once instead of waiting for their timeout.
+static void handle_broadcast_ack(const sockaddr_in &from, uint32_t seq, const uint8_t *payload, uint32_t plLen)
+{
+    SackBlock sack;
+    if (!decode_sack(payload, plLen, sack)) return;
+    BufferRef resend[UDP_SACK_WINDOW];
+    uint32_t resendSeq[UDP_SACK_WINDOW];
+    int count = 0;
+    bool known = g_clients.with_endpoint(pack_endpoint(from), [&](ClientEndpoint &c) {
+        mark_active(c);
+        OutboundQueue *queue = __atomic_load_n(&c.out, __ATOMIC_ACQUIRE);
+        if (queue == nullptr) return;
+        int64_t nowUs = monotonic_us();
+        pthread_mutex_lock(&queue->mutex);
+        queue_ack(queue, seq, true, nowUs);
+        for (uint32_t s = queue->base; s != queue->nextSeq && (int32_t)(sack.cumulative - s) >= 0; s++) {
+            queue_ack(queue, s, false, nowUs);
+        }
+        for (uint32_t i = 0; i < UDP_SACK_WINDOW; i++) {
+            if (sack.bitmap & (1ULL << i)) queue_ack(queue, sack.cumulative + 2 + i, false, nowUs);
+        }
+
+        int later = 0;
+        int64_t earliest = INT64_MAX;
+        for (uint32_t s = queue->nextSeq; s != queue->base;) {
+            OutboundEntry &entry = queue->entries[--s % UDP_SACK_WINDOW];
+            if (entry.acked) {
+                later++;
+                continue;
+            }
+            if (later >= UDP_FAST_RETX_THRESHOLD && !entry.fastRetransmitted) {
+                entry.fastRetransmitted = entry.retransmitted = true;
+                entry.sentUs = nowUs;
+                resend[count] = entry.packet;
+                resendSeq[count++] = s;
+            }
+            earliest = min(earliest, entry.sentUs + queue->rtt.backed_off(entry.timeouts));
         }
-        Outgoing out = g_outgoing.front();
-        g_outgoing.pop();
-        pthread_mutex_unlock(&g_queue_mutex);
-
-        ssize_t sent = sendto(g_socket_fd, out.packet.data(), out.packet.size(), 0,
-                              (const sockaddr*)&out.addr, sizeof(out.addr));
-        if (sent < 0) {
-            print_debug("sendto failed");
+        if (earliest != INT64_MAX) wake_retransmitter_by(queue, earliest);
+        while (queue->base != queue->nextSeq && queue->entries[queue->base % UDP_SACK_WINDOW].acked) {
+            queue->base++;
         }
+        pthread_mutex_unlock(&queue->mutex);
+    });
+    if (!known) {
+        ask_to_register(from);
+        return;
     }
-    return nullptr;
+    g_reliableAcks++;
+    if (count == 0) return;
+    SendBatch &batch = send_batch();
+    for (int i = 0; i < count; i++) batch.add_sequenced(resend[i], from, resendSeq[i]);
+    batch.flush();
+    g_reliableRetransmits += count;
+    g_reliableFastRetransmits += count;
 }
 
-static void reply_ack(const sockaddr_in &addr, uint32_t seq, uint32_t clientId)
+// Replay the room's history to one client, a packet per message, straight
+// from the log. Quiet replays (on registration or join) send no summary
+// when there is nothing to replay.
+static void send_history(const sockaddr_in &addr, uint32_t room, const string &request, bool quiet)
 {
-    vector<uint8_t> pkt;
-    build_packet(pkt, MSG_CHAT, FLAG_ACK, seq, clientId, nullptr, 0);
-    enqueue_send(pkt, addr);
+    HistoryQuery query;
+    char summary[96];
+    int len;
+    if (g_log == nullptr) {
+        len = snprintf(summary, sizeof(summary), "History is not enabled on this server");
+    } else if (!parse_history_request(request.data(), request.size(), query)) {
+        len = snprintf(summary, sizeof(summary), "Invalid history request");
+    } else {
+        // Sent in batches; the packets stay referenced here until they are out
+        SendBatch &batch = send_batch();
+        vector<BufferRef> packets;
+        size_t replayed = g_log->replay(room, query, [&](const MessageLog::Record &record) {
+            char timestamp[16], prefix[64];
+            format_timestamp(record.timestamp_ms, timestamp);
+            int prefixLen = snprintf(prefix, sizeof(prefix), "[%s] Client %u: ", timestamp, record.client_id);
+            packets.push_back(build_packet(MSG_HISTORY, 0, 0, record.client_id, prefix, (uint32_t)prefixLen,
+                                           record.payload, record.payload_length));
+            batch.add(packets.back(), addr);
+        });
+        batch.flush();
+        if (replayed == 0 && quiet) return;
+        len = snprintf(summary, sizeof(summary), "End of history (%zu messages)", replayed);
+    }
+    send_packet(build_packet(MSG_HISTORY, 0, 0, 0, nullptr, 0, summary, (uint32_t)len), addr);
 }
 
-static void send_stats(const sockaddr_in &addr)
+// MSG_JOIN / MSG_LEAVE: move the sender and ACK with a status text. A
+// retransmitted request simply moves the client into the same room again;
+// from a selective-repeat client it is a duplicate instead, answered by
+// handle_packet() with the status kept here.
+static void handle_room_change(const sockaddr_in &from, uint16_t type, uint32_t seq,
+                               const uint8_t *payload, uint32_t plLen)
+{
+    uint64_t endpoint = pack_endpoint(from);
+    string name = type == MSG_LEAVE ? string("lobby") : string((const char*)payload, plLen);
+    uint32_t room = 0;
+    char reply[128];
+    int len;
+    if (!RoomDirectory::valid_name(name)) {
+        len = snprintf(reply, sizeof(reply), "Invalid room name (up to %zu letters, digits, '-', '_' or '.')",
+                       RoomDirectory::MAX_NAME);
+    } else if (!g_rooms.lookup(name, room)) {
+        len = snprintf(reply, sizeof(reply), "Too many rooms");
+    } else {
+        len = -1;
+    }
+
+    uint32_t clientId = 0;
+    bool moved = false;
+    uint8_t sack[UDP_SACK_BLOCK_SIZE];
+    uint32_t sackLen = 0;
+    g_clients.with_endpoint(endpoint, [&](ClientEndpoint &c) {
+        clientId = c.clientId;
+        sackLen = client_sack(c, sack);
+        mark_active(c);
+        if (len < 0 && c.room != room) {
+            g_roomMembers.leave(c.room, endpoint);
+            g_roomMembers.join(room, endpoint);
+            c.room = room;
+            moved = true;
+        }
+        if (len < 0) {
+            len = snprintf(reply, sizeof(reply), "Now in room %s (%zu members)", name.c_str(),
+                           g_roomMembers.size(room));
+        }
+        len = min(len, (int)sizeof(reply) - 1);
+        if (c.sack) {
+            if (c.status == nullptr) c.status = new RoomStatus();
+            c.status->seq = seq;
+            c.status->length = (uint32_t)len;
+            memcpy(c.status->text, reply, len);
+        }
+    });
+    if (clientId == 0) {
+        ask_to_register(from);
+        return;
+    }
+    uint16_t flags = sackLen > 0 ? FLAG_ACK | FLAG_SACK : FLAG_ACK;
+    send_packet(build_packet(type, flags, seq, clientId, sack, sackLen, reply, (uint32_t)len), from);
+    // Only the request that actually moved the client catches it up, not
+    // its retransmissions
+    if (moved && g_log != nullptr) send_history(from, room, history_last_request(HISTORY_ON_JOIN), true);
+}
+
+// Task, in the client's own lane so it cannot race a packet moving it
+// between rooms: forget the client unless it spoke up after the check.
+// context carries the client id the reaper saw.
+static void evict_idle_task(Task &task)
 {
-    int uptime = 0;
-    size_t clients = 0;
-    pthread_mutex_lock(&g_stats_mutex);
-    uptime = g_stats.uptimeSeconds();
-    pthread_mutex_unlock(&g_stats_mutex);
+    uint64_t endpoint = task.arg;
+    uint32_t clientId = (uint32_t)(uintptr_t)task.context, room = 0;
+    bool idle = false;
+    OutboundQueue *queue = nullptr;
+    g_clients.with_endpoint(endpoint, [&](ClientEndpoint &c) {
+        room = c.room;
+        idle = c.clientId == clientId &&
+               monotonic_ms() - __atomic_load_n(&c.lastSeenMs, __ATOMIC_RELAXED) >= g_idleTimeoutMs;
+        if (idle) {
+            delete c.held;
+            c.held = nullptr;
+            delete c.status;
+            c.status = nullptr;
+            queue = __atomic_exchange_n(&c.out, nullptr, __ATOMIC_ACQ_REL);
+        }
+    });
+    if (!idle) return;
+    if (queue != nullptr) {
+        // Fan-out tasks that loaded the pointer first see it closed
+        pthread_mutex_lock(&queue->mutex);
+        queue->closed = true;
+        hand_to_retransmitter(queue, g_retxClosed);
+        pthread_mutex_unlock(&queue->mutex);
+    }
+    g_roomMembers.leave(room, endpoint);
+    g_clients.erase(clientId);
+    g_idleEvictions++;
+    char where[ENDPOINT_TEXT_SIZE];
+    LOG_INFO("Client %u from %s idle for %lld s, removed, total clients=%zu", clientId,
+             format_endpoint(unpack_endpoint(endpoint), where), (long long)(g_idleTimeoutMs / 1000), g_clients.size());
+}
 
-    pthread_mutex_lock(&g_clients_mutex);
-    clients = g_clients.size();
-    pthread_mutex_unlock(&g_clients_mutex);
+// A client's timer fired. Quiet for a third of the timeout: probe it with
+// MSG_PING and check again when it should have answered; quiet for the
+// whole timeout: remove it. A watch whose client is gone is freed.
+static void check_idle(TimerWheel &wheel, IdleWatch *watch, int64_t now)
+{
+    int64_t lastSeen = 0;
+    bool current = false;
+    g_clients.with_endpoint(watch->endpoint, [&](ClientEndpoint &c) {
+        current = c.clientId == watch->clientId;
+        lastSeen = __atomic_load_n(&c.lastSeenMs, __ATOMIC_RELAXED);
+    });
+    if (!current) {
+        delete watch;
+        return;
+    }
 
-    stringstream ss;
-    ss << "Server Statistics:\n Clients connected: " << clients
-       << "\n Server uptime: " << uptime << " seconds";
-    string s = ss.str();
-    vector<uint8_t> pkt;
-    build_packet(pkt, MSG_STATS, 0, 0, 0,
-                 reinterpret_cast<const uint8_t*>(s.data()), (uint32_t)s.size());
+    int64_t interval = max(g_idleTimeoutMs / 3, UDP_WHEEL_TICK_MS);
+    int64_t idle = now - lastSeen;
+    if (idle >= g_idleTimeoutMs) {
+        g_scheduler->submit_ordered(watch->endpoint, Task{evict_idle_task, BufferRef(), watch->endpoint,
+                                                          (void*)(uintptr_t)watch->clientId});
+        wheel.schedule(&watch->timer, now + interval); // frees the watch once the client is gone
+    } else if (idle < interval) {
+        wheel.schedule(&watch->timer, lastSeen + interval);
+    } else {
+        send_packet(build_packet(MSG_PING, 0, 0, watch->clientId, nullptr, 0, nullptr, 0),
+                    unpack_endpoint(watch->endpoint));
+        g_keepaliveProbes++;
+        wheel.schedule(&watch->timer, now + min(interval, g_idleTimeoutMs - idle));
+    }
+}
 
-    enqueue_send(pkt, addr);
+// The reaper owns the timer wheel; nothing else touches it. Clients are
+// handed over through g_idleNew when they register.
+static void *idle_reaper_thread(void *)
+{
+    TimerWheel wheel(UDP_WHEEL_TICK_MS, monotonic_ms());
+    vector<IdleWatch*> added;
+    while (true) {
+        usleep(UDP_WHEEL_TICK_MS * 1000);
+        int64_t now = monotonic_ms();
+        pthread_mutex_lock(&g_idleMutex);
+        added.swap(g_idleNew);
+        pthread_mutex_unlock(&g_idleMutex);
+        for (IdleWatch *watch : added) {
+            wheel.schedule(&watch->timer, now + max(g_idleTimeoutMs / 3, UDP_WHEEL_TICK_MS));
+        }
+        added.clear();
+        wheel.advance(now, [&](WheelTimer *timer) {
+            check_idle(wheel, reinterpret_cast<IdleWatch*>(timer->data), now);
+        });
+    }
+    return nullptr;
 }
 
-static void handle_packet(const uint8_t *data, size_t len, const sockaddr_in &from)
+// Resend the queue's overdue lines, each with its own timeout doubled,
+// and set its timer for the next deadline. The packets are kept in sent
+// until the batch is flushed.
+static void retransmit_due(TimerWheel &wheel, OutboundQueue *queue, int64_t nowUs,
+                           SendBatch &batch, vector<BufferRef> &sent)
 {
-    uint16_t type, flags; uint32_t seq, clientId, plLen; const uint8_t *payload;
-    if (!parse_packet(data, len, type, flags, seq, clientId, payload, plLen)) {
-        print_debug("Invalid packet received");
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->closed) {
+        pthread_mutex_unlock(&queue->mutex);
         return;
     }
+    sockaddr_in addr = unpack_endpoint(queue->endpoint);
+    int64_t next = INT64_MAX;
+    for (uint32_t seq = queue->base; seq != queue->nextSeq; seq++) {
+        OutboundEntry &entry = queue->entries[seq % UDP_SACK_WINDOW];
+        if (entry.acked) continue;
+        int64_t deadline = entry.sentUs + queue->rtt.backed_off(entry.timeouts);
+        if (deadline <= nowUs) {
+            if (entry.timeouts >= UDP_RETX_MAX_TIMEOUTS) {
+                entry.acked = true;
+                entry.packet.reset();
+                g_reliableAbandoned++;
+                continue;
+            }
+            entry.timeouts++;
+            entry.retransmitted = true;
+            entry.sentUs = nowUs;
+            sent.push_back(entry.packet);
+            batch.add_sequenced(sent.back(), addr, seq);
+            g_reliableRetransmits++;
+            deadline = nowUs + queue->rtt.backed_off(entry.timeouts);
+        }
+        next = min(next, deadline);
+    }
+    while (queue->base != queue->nextSeq && queue->entries[queue->base % UDP_SACK_WINDOW].acked) {
+        queue->base++;
+    }
+    queue->wakeUs = next;
+    if (next == INT64_MAX) {
+        wheel.cancel(&queue->timer); // the next line hands it over again
+    } else {
+        wheel.schedule(&queue->timer, (next + 999) / 1000);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+// The retransmit thread owns its timer wheel, one timer per queue with
+// lines in flight, and frees the queues of evicted clients once no timer
+// can reach them.
+static void *retransmit_thread(void *)
+{
+    TimerWheel wheel(UDP_RETX_TICK_MS, monotonic_ms());
+    SendBatch &batch = send_batch();
+    vector<OutboundQueue*> armed, closed;
+    vector<BufferRef> sent;
+    while (true) {
+        usleep(UDP_RETX_TICK_MS * 1000);
+        int64_t nowUs = monotonic_us();
+        pthread_mutex_lock(&g_retxMutex);
+        armed.swap(g_retxArmed);
+        closed.swap(g_retxClosed);
+        pthread_mutex_unlock(&g_retxMutex);
+        for (OutboundQueue *queue : armed) retransmit_due(wheel, queue, nowUs, batch, sent);
+        for (OutboundQueue *queue : closed) {
+            wheel.cancel(&queue->timer);
+            EpochReclaimer::instance().retire(queue);
+        }
+        armed.clear();
+        closed.clear();
+        wheel.advance(nowUs / 1000, [&](WheelTimer *timer) {
+            retransmit_due(wheel, reinterpret_cast<OutboundQueue*>(timer->data), nowUs, batch, sent);
+        });
+        batch.flush();
+        sent.clear();
+    }
+    return nullptr;
+}
+
+static void send_stats(const sockaddr_in &addr)
+{
+    // Client count and counters are atomics; no lock is taken
+    char report[UDP_MAX_PAYLOAD];
+    int len = snprintf(report, sizeof(report), "Server Statistics:\n Clients connected: %zu\n Server uptime: %d seconds\n Rooms: %zu",
+                       g_clients.size(), g_stats.uptimeSeconds(), g_rooms.size());
+    len += ServerMetrics::instance().format_report(report + len, sizeof(report) - len);
+    len = min(len, (int)sizeof(report) - 1);
+    len += g_scheduler->format_report(report + len, sizeof(report) - len);
+    len = min(len, (int)sizeof(report) - 1);
+    MetricSnapshot metrics = ServerMetrics::instance().snapshot();
+    uint64_t recvCalls = 0;
+    len += snprintf(report + len, sizeof(report) - len, "\n Receivers: %zu, datagrams per receiver:", g_receivers.size());
+    len = min(len, (int)sizeof(report) - 1);
+    for (UdpReceiver *receiver : g_receivers) {
+        recvCalls += receiver->calls.load(memory_order_relaxed);
+        len += snprintf(report + len, sizeof(report) - len, " %llu",
+                        (unsigned long long)receiver->datagrams.load(memory_order_relaxed));
+        len = min(len, (int)sizeof(report) - 1);
+    }
+    uint64_t sendCalls = metrics.values[METRIC_SEND_SYSCALLS];
+    len += snprintf(report + len, sizeof(report) - len,
+                    "\n Batching: recv batch %d (avg %.1f datagrams per recvmmsg), send batch %d (avg %.1f per send syscall)",
+                    g_recvBatch, recvCalls == 0 ? 0.0 : (double)metrics.values[METRIC_MESSAGES_IN] / recvCalls,
+                    g_sendBatch, sendCalls == 0 ? 0.0 : (double)metrics.values[METRIC_MESSAGES_OUT] / sendCalls);
+    len = min(len, (int)sizeof(report) - 1);
+    if (g_log != nullptr) {
+        len += g_log->format_report(report + len, sizeof(report) - len);
+        len = min(len, (int)sizeof(report) - 1);
+    }
+    uint64_t reliableSent = g_reliableSent.load();
+    len += snprintf(report + len, sizeof(report) - len,
+                    "\n Reliable broadcast: %llu lines, retransmits %llu (%.1f%% overhead, %llu fast), acks %llu, given up %llu",
+                    (unsigned long long)reliableSent, (unsigned long long)g_reliableRetransmits.load(),
+                    reliableSent == 0 ? 0.0 : 100.0 * g_reliableRetransmits.load() / reliableSent,
+                    (unsigned long long)g_reliableFastRetransmits.load(), (unsigned long long)g_reliableAcks.load(),
+                    (unsigned long long)g_reliableAbandoned.load());
+    len = min(len, (int)sizeof(report) - 1);
+    if (g_idleTimeoutMs > 0) {
+        len += snprintf(report + len, sizeof(report) - len,
+                        "\n Idle timeout: %lld s, keepalive probes %llu, idle evictions %llu, re-registrations asked %llu",
+                        (long long)(g_idleTimeoutMs / 1000), (unsigned long long)g_keepaliveProbes.load(),
+                        (unsigned long long)g_idleEvictions.load(), (unsigned long long)g_registerRequests.load());
+        len = min(len, (int)sizeof(report) - 1);
+    }
+    send_packet(build_packet(MSG_STATS, 0, 0, 0, nullptr, 0, report, (uint32_t)len), addr);
+}
+
+// Returns true if a selective-repeat client's packet was processed while
+// later ones are held, which may now be next in line
+static bool handle_packet(const BufferRef &datagram, const sockaddr_in &from)
+{
+    uint16_t type, flags; uint32_t seq, clientId, plLen; const uint8_t *payload;
+    if (!parse_packet((const uint8_t*)datagram.data(), datagram.size(), type, flags, seq, clientId, payload, plLen)) {
+        LOG_DEBUG("Invalid packet received");
+        return false;
+    }
 
-    string content;
-    if (plLen > 0) content.assign(reinterpret_cast<const char*>(payload), plLen);
+    // Reliable packets (seq 0 is the hello) from selective-repeat clients
+    // are put in seq order first; other clients' are taken as they come.
+    // The same registry lookup serves the chat that follows.
+    bool reliable = seq != 0 && (flags & FLAG_ACK) == 0 &&
+                    (type == MSG_CHAT || type == MSG_JOIN || type == MSG_LEAVE);
+    bool chat = type == MSG_CHAT && (flags & FLAG_ACK) == 0;
+    bool release = false;
+    uint32_t senderId = 0, room = RoomDirectory::LOBBY;
+    uint8_t sack[UDP_SACK_BLOCK_SIZE];
+    uint32_t sackLen = 0;
+    if (reliable || chat) {
+        SackVerdict verdict = SACK_IN_ORDER;
+        char status[128];
+        int statusLen = 0;
+        g_clients.with_endpoint(pack_endpoint(from), [&](ClientEndpoint &c) {
+            senderId = c.clientId;
+            room = c.room;
+            mark_active(c);
+            if (reliable && c.sack) {
+                verdict = sequence_packet(c, seq, datagram);
+                release = verdict == SACK_IN_ORDER && c.held != nullptr && c.held->mask != 0;
+            }
+            sackLen = client_sack(c, sack);
+            if (verdict != SACK_DUPLICATE || type == MSG_CHAT) return;
+            // A room change already done: its status again, or, if a later
+            // one has replaced it, where the client is now
+            if (c.status != nullptr && c.status->seq == seq) {
+                statusLen = (int)c.status->length;
+                memcpy(status, c.status->text, statusLen);
+            } else {
+                statusLen = snprintf(status, sizeof(status), "Now in room %s (%zu members)",
+                                     g_rooms.name(c.room).c_str(), g_roomMembers.size(c.room));
+                statusLen = min(statusLen, (int)sizeof(status) - 1);
+            }
+        });
+        if (verdict == SACK_BEYOND) return false;
+        if (verdict != SACK_IN_ORDER) {
+            reply_ack(from, type, seq, senderId, sack, sackLen, status, (uint32_t)statusLen);
+            return false;
+        }
+    }
 
-    if (type == MSG_CHAT && (flags & FLAG_ACK) == 0) {
-        // Registration on hello
-        ensure_register_client(from, content);
-        uint32_t senderId = find_client_id_by_addr(from);
+    if (chat) {
+        // An unknown sender's chat only counts as a registration hello
+        bool registered = false;
         if (senderId == 0) {
-            // not registered; ignore non-hello chat
-            return;
+            ClientEndpoint ce;
+            if (!register_client(from, flags, payload, plLen, ce)) {
+                ask_to_register(from);
+                return false;
+            }
+            registered = true;
+            senderId = ce.clientId;
+            room = ce.room;
+            sackLen = client_sack(ce, sack);
+        }
+        if (!registered && seq == 0 && (flags & FLAG_SACK)) {
+            // A selective-repeat client resends its hello until it is
+            // acknowledged; a copy is not chat
+            reply_ack(from, MSG_CHAT, 0, senderId, sack, sackLen);
+            return false;
         }
 
         // ACK back to sender
-        reply_ack(from, seq, senderId);
-
-        // Broadcast chat to others (exclude sender)
-        string prefixed = "[" + get_timestamp() + "] Client " + to_string(senderId) + ": " + content;
-        vector<uint8_t> pkt;
-        build_packet(pkt, MSG_CHAT, 0, 0, senderId,
-                     reinterpret_cast<const uint8_t*>(prefixed.data()), (uint32_t)prefixed.size());
-        broadcast_to_all_except(pkt, senderId);
-        print_debug("Broadcasted chat from client " + to_string(senderId));
+        reply_ack(from, MSG_CHAT, seq, senderId, sack, sackLen);
+
+        // Broadcast chat to the rest of the sender's room
+        char prefix[64];
+        int prefixLen = snprintf(prefix, sizeof(prefix), "[%s] Client %u: ", cached_timestamp(), senderId);
+        broadcast_to_room_except(build_packet(MSG_CHAT, 0, 0, senderId, prefix, (uint32_t)prefixLen,
+                                              payload, plLen), room, pack_endpoint(from));
+        LOG_DEBUG("Broadcasted chat from client %u to room %u", senderId, room);
+
+        // The registration hello is not worth keeping; the newcomer gets
+        // the lobby's recent history instead
+        if (g_log != nullptr && registered) {
+            send_history(from, room, history_last_request(HISTORY_ON_JOIN), true);
+        } else if (g_log != nullptr) {
+            g_log->append(room, senderId, payload, plLen);
+        }
+    } else if ((type == MSG_JOIN || type == MSG_LEAVE) && (flags & FLAG_ACK) == 0) {
+        handle_room_change(from, type, seq, payload, plLen);
+    } else if (type == MSG_HISTORY) {
+        uint32_t room = RoomDirectory::LOBBY;
+        if (!g_clients.with_endpoint(pack_endpoint(from), [&](ClientEndpoint &c) {
+                room = c.room;
+                mark_active(c);
+            })) {
+            ask_to_register(from);
+            return false;
+        }
+        send_history(from, room, string((const char*)payload, plLen), false);
+    } else if (type == MSG_PING) {
+        if (!g_clients.with_endpoint(pack_endpoint(from), mark_active)) ask_to_register(from);
     } else if (type == MSG_STATS) {
         send_stats(from);
-    } else if (type == MSG_CHAT && (flags & FLAG_ACK)) {
-        // Server does not expect ACKs for its broadcasts; ignore
+    } else if (type == MSG_CHAT && (flags & FLAG_ACK) && (flags & FLAG_SACK)) {
+        handle_broadcast_ack(from, seq, payload, plLen);
     }
+    return release;
 }
 
-int main(int argc, char *argv[])
+// Task: one received datagram; arg is the sender's packed endpoint. Held
+// packets it completes the sequence for are processed right after it.
+static void handle_packet_task(Task &task)
 {
-    int port = 5001;
-    if (argc > 1) {
-        int p = atoi(argv[1]);
-        if (p > 0 && p <= 65535) port = p;
+    sockaddr_in from = unpack_endpoint(task.arg);
+    BufferRef datagram = move(task.buffer);
+    while (handle_packet(datagram, from) && take_held(task.arg, datagram)) {}
+}
+
+// Receive loop of one shard: each datagram lands in a pooled buffer that
+// travels with its task, and its slot gets a fresh buffer. recvmmsg() waits
+// for the first datagram only, then takes whatever else is already queued,
+// up to a batch. Tasks from one sender run in arrival order.
+static void *receive_loop(void *arg)
+{
+    UdpReceiver *receiver = static_cast<UdpReceiver*>(arg);
+    vector<mmsghdr> msgs(g_recvBatch);
+    vector<iovec> iovs(g_recvBatch);
+    vector<sockaddr_in> addrs(g_recvBatch);
+    vector<BufferRef> datagrams(g_recvBatch);
+    while (true) {
+        for (int i = 0; i < g_recvBatch; i++) {
+            if (!datagrams[i]) datagrams[i] = BufferRef::allocate(UDP_DATAGRAM_BUFFER);
+            iovs[i].iov_base = datagrams[i].mutable_data();
+            iovs[i].iov_len = datagrams[i].capacity();
+            memset(&msgs[i].msg_hdr, 0, sizeof(msghdr));
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = recvmmsg(receiver->fd, msgs.data(), (unsigned)g_recvBatch, MSG_WAITFORONE, NULL);
+        receiver->calls.fetch_add(1, memory_order_relaxed);
+        if (n < 0) {
+            if (errno != EINTR) LOG_WARN("recvmmsg failed: %s", strerror(errno));
+            continue;
+        }
+        uint64_t bytes = 0;
+        for (int i = 0; i < n; i++) {
+            bytes += msgs[i].msg_len;
+            datagrams[i].set_size(msgs[i].msg_len);
+            uint64_t endpoint = pack_endpoint(addrs[i]);
+            g_scheduler->submit_ordered(endpoint, Task{handle_packet_task, move(datagrams[i]), endpoint, nullptr});
+        }
+        receiver->datagrams.fetch_add(n, memory_order_relaxed);
+        metric_add(METRIC_MESSAGES_IN, n);
+        metric_add(METRIC_BYTES_IN, bytes);
     }
+    return nullptr;
+}
 
-    g_socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (g_socket_fd < 0) {
-        cerr << "Failed to create UDP socket" << endl;
-        return 1;
+// A socket bound to the port. Only several receivers share it through
+// SO_REUSEPORT; a lone one keeps the port to itself, so a second server
+// started on it fails to bind instead of quietly taking half the traffic.
+static int create_receiver_socket(int port, bool shared)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) return -1;
+    int opt = 1;
+    if (shared && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) != 0) {
+        close(fd);
+        return -1;
     }
 
     sockaddr_in srv{};
@@ -229,36 +1112,90 @@ int main(int argc, char *argv[])
     srv.sin_port = htons(port);
     srv.sin_addr.s_addr = INADDR_ANY;
     memset(srv.sin_zero, '\0', sizeof(srv.sin_zero));
+    if (bind(fd, (sockaddr*)&srv, sizeof(srv)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-    if (bind(g_socket_fd, (sockaddr*)&srv, sizeof(srv)) < 0) {
-        cerr << "Bind failed on UDP port " << port << endl;
-        close(g_socket_fd);
-        return 1;
+int main(int argc, char *argv[])
+{
+    int port = 5001;
+    int workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int receivers = 1;
+    string logDir;
+    size_t logSegmentBytes = MessageLog::DEFAULT_SEGMENT_BYTES;
+    size_t logSegments = MessageLog::DEFAULT_MAX_SEGMENTS;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--workers" && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+        } else if (arg == "--receivers" && i + 1 < argc) {
+            receivers = atoi(argv[++i]);
+        } else if (arg == "--log-dir" && i + 1 < argc) {
+            logDir = argv[++i];
+        } else if (arg == "--log-segment-mb" && i + 1 < argc) {
+            logSegmentBytes = max(1UL, strtoul(argv[++i], NULL, 10)) * 1024 * 1024;
+        } else if (arg == "--log-segments" && i + 1 < argc) {
+            logSegments = strtoul(argv[++i], NULL, 10);
+        } else if (arg == "--recv-batch" && i + 1 < argc) {
+            g_recvBatch = min(max(atoi(argv[++i]), 1), UDP_MAX_BATCH);
+        } else if (arg == "--send-batch" && i + 1 < argc) {
+            g_sendBatch = min(max(atoi(argv[++i]), 1), UDP_MAX_BATCH);
+        } else if (arg == "--idle-timeout" && i + 1 < argc) {
+            g_idleTimeoutMs = max(0L, atol(argv[++i])) * 1000;
+        } else if (arg[0] != '-') {
+            int p = atoi(arg.c_str());
+            if (p > 0 && p <= 65535) port = p;
+        } else {
+            cerr << "Usage: " << argv[0] << " [port] [--workers N] [--receivers N] [--log-dir DIR] [--log-segment-mb N] [--log-segments N] [--idle-timeout SEC]"
+                 << " [--recv-batch N] [--send-batch N]" << endl;
+            return 1;
+        }
     }
+    if (workers <= 0) workers = 1;
 
-    cout << "UDP Server listening on port " << port << endl;
+    if (receivers <= 0) receivers = 1;
 
-    // Start sender thread
-    pthread_t senderTid;
-    if (pthread_create(&senderTid, NULL, sender_thread, NULL) != 0) {
-        cerr << "Failed to start sender thread" << endl;
-        close(g_socket_fd);
-        return 1;
+    for (int i = 0; i < receivers; i++) {
+        UdpReceiver *receiver = new UdpReceiver();
+        receiver->fd = create_receiver_socket(port, receivers > 1);
+        if (receiver->fd < 0) {
+            cerr << "Bind failed on UDP port " << port << ": " << strerror(errno) << endl;
+            return 1;
+        }
+        g_receivers.push_back(receiver);
     }
 
-    // Receive loop
-    vector<uint8_t> buf(2048);
-    while (true) {
-        sockaddr_in from{}; socklen_t fromlen = sizeof(from);
-        ssize_t n = recvfrom(g_socket_fd, buf.data(), buf.size(), 0,
-                             (sockaddr*)&from, &fromlen);
-        if (n < 0) {
-            print_debug("recvfrom failed");
-            continue;
+    ServerMetrics::instance(); // start the rate sampler with the server
+    g_scheduler = new TaskScheduler(workers);
+    if (!logDir.empty()) {
+        g_log = new MessageLog(g_rooms, logDir, logSegmentBytes, logSegments);
+        string error;
+        if (!g_log->open(error)) {
+            cerr << "Message log: " << error << endl;
+            return 1;
         }
-        handle_packet(buf.data(), (size_t)n, from);
+        cout << "Logging chat history to " << logDir << endl;
     }
+    if (g_idleTimeoutMs > 0) {
+        pthread_t reaper;
+        pthread_create(&reaper, NULL, idle_reaper_thread, NULL);
+        pthread_detach(reaper);
+        cout << "Removing clients idle for " << g_idleTimeoutMs / 1000 << " s" << endl;
+    }
+    pthread_t retransmitter;
+    pthread_create(&retransmitter, NULL, retransmit_thread, NULL);
+    pthread_detach(retransmitter);
+    cout << "UDP Server listening on port " << port << " with " << receivers << " receiver(s) and "
+         << workers << " worker(s)" << endl;
 
-    close(g_socket_fd);
+    for (int i = 1; i < receivers; i++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, receive_loop, g_receivers[i]);
+        pthread_detach(thread);
+    }
+    receive_loop(g_receivers[0]);
     return 0;
 }